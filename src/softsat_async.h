@@ -0,0 +1,391 @@
+// Copyright OpenFX and contributors to the OpenFX project.
+// Copyright SalkocsisFX.
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+Coroutines for batch tools that read, saturate and write many frames at once.
+
+A tool writes each frame's journey as a coroutine returning a RenderTask,
+awaiting a FrameSlots slot before it allocates anything, IoPool::run to read
+and write, and FrameRenderer::processAsync to saturate:
+
+  RenderTask Convert(FrameRenderer &renderer, IoPool &io, FrameSlots &slots, int frame)
+  {
+    FrameSlots::Slot slot = co_await slots.acquire();
+    Frame buffers;
+    co_await io.run([&] { Read(frame, buffers); });
+    co_await renderer.processAsync(buffers.view);
+    co_await io.run([&] { Write(frame, buffers); });
+  }
+
+The renderer gathers up whatever frames are waiting and renders them as one
+batch on its BatchProcessor, so the more frames there are in flight the
+fewer barriers there are between them, while the slots keep how many frames
+are held in memory at once bounded.
+*/
+
+#ifndef SOFTSAT_ASYNC_H
+#define SOFTSAT_ASYNC_H
+
+#include <coroutine>
+#include "softsat_core.h"
+
+namespace SoftSat {
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // the coroutine type for a frame's work. It starts as soon as it is called
+  // and runs on whichever thread resumed it last, wait blocks until it is done
+  // and throws on anything it threw. It must be done before it goes away, so
+  // the destructor waits too.
+  class RenderTask {
+  public :
+    struct promise_type {
+      std::mutex mutex;
+      std::condition_variable doneCondition;
+      bool done;
+      std::exception_ptr error;
+
+      promise_type() : done(false) {}
+
+      RenderTask get_return_object() { return RenderTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+      std::suspend_never initial_suspend() noexcept { return std::suspend_never(); }
+      void return_void() {}
+      void unhandled_exception() { error = std::current_exception(); }
+
+      // stay around once done, for wait to look at, and wake it
+      struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        void await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+        {
+          promise_type &promise = handle.promise();
+          std::lock_guard<std::mutex> lock(promise.mutex);
+          promise.done = true;
+          promise.doneCondition.notify_all();
+        }
+        void await_resume() noexcept {}
+      };
+      FinalAwaiter final_suspend() noexcept { return FinalAwaiter(); }
+    };
+
+    RenderTask(RenderTask &&other) : handle_(other.handle_) { other.handle_ = NULL; }
+    RenderTask(const RenderTask &) = delete;
+    RenderTask &operator=(const RenderTask &) = delete;
+
+    ~RenderTask()
+    {
+      if(handle_) {
+        waitForDone();
+        handle_.destroy();
+      }
+    }
+
+    // block until the coroutine is done, throwing on anything it threw
+    void wait()
+    {
+      waitForDone();
+      if(handle_.promise().error) {
+        std::rethrow_exception(handle_.promise().error);
+      }
+    }
+
+  protected :
+    explicit RenderTask(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+    void waitForDone()
+    {
+      promise_type &promise = handle_.promise();
+      std::unique_lock<std::mutex> lock(promise.mutex);
+      promise.doneCondition.wait(lock, [&promise]() { return promise.done; });
+    }
+
+    std::coroutine_handle<promise_type> handle_;
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // a count of frames that may be in flight at once. Awaiting acquire gives a
+  // slot, suspending until one is free, which is handed back when the slot
+  // goes away. Someone waiting on a slot carries on on the thread that gave
+  // one back.
+  class FrameSlots {
+  public :
+    explicit FrameSlots(unsigned int count) : free_(count) {}
+
+    class Slot {
+    public :
+      Slot() : slots_(NULL) {}
+      explicit Slot(FrameSlots *slots) : slots_(slots) {}
+      Slot(Slot &&other) : slots_(other.slots_) { other.slots_ = NULL; }
+      Slot(const Slot &) = delete;
+      Slot &operator=(const Slot &) = delete;
+      ~Slot() { if(slots_) slots_->release(); }
+
+    protected :
+      FrameSlots *slots_;
+    };
+
+    struct Awaiter {
+      FrameSlots *slots;
+
+      // take a free slot if there is one, otherwise queue up for the next
+      bool await_ready() { return false; }
+      bool await_suspend(std::coroutine_handle<> handle)
+      {
+        std::lock_guard<std::mutex> lock(slots->mutex_);
+        if(slots->free_ > 0) {
+          --slots->free_;
+          return false;
+        }
+        slots->waiting_.push_back(handle);
+        return true;
+      }
+      Slot await_resume() { return Slot(slots); }
+    };
+
+    Awaiter acquire() { Awaiter awaiter = {this}; return awaiter; }
+
+  protected :
+    // pass the slot straight on to whoever has waited longest, or free it
+    void release()
+    {
+      std::coroutine_handle<> next;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if(waiting_.empty()) {
+          ++free_;
+          return;
+        }
+        next = waiting_.front();
+        waiting_.pop_front();
+      }
+      next.resume();
+    }
+
+    std::mutex mutex_;
+    unsigned int free_;
+    std::deque<std::coroutine_handle<> > waiting_;
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // threads for blocking I/O, so that reading and writing frames doesn't hold
+  // up the render threads. Awaiting run calls the function on one of them and
+  // carries on there once it returns, throwing on anything it threw.
+  class IoPool {
+  public :
+    // start the threads, one for every two processors if 0, as I/O mostly waits
+    explicit IoPool(unsigned int nThreads = 0);
+
+    // finish whatever is queued, then stop the threads
+    ~IoPool();
+
+    struct Awaiter {
+      IoPool *pool;
+      std::function<void()> io;
+      std::exception_ptr error;
+
+      bool await_ready() { return false; }
+      void await_suspend(std::coroutine_handle<> handle) { pool->post(this, handle); }
+      void await_resume()
+      {
+        if(error) {
+          std::rethrow_exception(error);
+        }
+      }
+    };
+
+    Awaiter run(std::function<void()> io) { Awaiter awaiter = {this, std::move(io), NULL}; return awaiter; }
+
+  protected :
+    struct Request {
+      Awaiter *awaiter;
+      std::coroutine_handle<> handle;
+    };
+
+    void post(Awaiter *awaiter, std::coroutine_handle<> handle);
+    void threadMain();
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::deque<Request> requests_;
+    bool stop_;
+    std::vector<std::thread> threads_;
+  };
+
+  inline IoPool::IoPool(unsigned int nThreads)
+    : stop_(false)
+  {
+    if(nThreads == 0) {
+      nThreads = std::max(std::thread::hardware_concurrency() / 2, 1u);
+    }
+    for(unsigned int t = 0; t < nThreads; ++t) {
+      threads_.emplace_back(&IoPool::threadMain, this);
+    }
+  }
+
+  inline IoPool::~IoPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for(size_t t = 0; t < threads_.size(); ++t) {
+      threads_[t].join();
+    }
+  }
+
+  inline void IoPool::post(Awaiter *awaiter, std::coroutine_handle<> handle)
+  {
+    Request request = {awaiter, handle};
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      requests_.push_back(request);
+    }
+    wake_.notify_one();
+  }
+
+  inline void IoPool::threadMain()
+  {
+    for(;;) {
+      Request request;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait(lock, [this]() { return stop_ || !requests_.empty(); });
+        if(requests_.empty()) {
+          return;
+        }
+        request = requests_.front();
+        requests_.pop_front();
+      }
+
+      try {
+        request.awaiter->io();
+      }
+      catch(...) {
+        request.awaiter->error = std::current_exception();
+      }
+      request.handle.resume();
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // saturates frames for coroutines. Awaiting processAsync queues the frame
+  // up, and a thread of the renderer's own takes all the frames that are
+  // queued and renders them as a batch on the pools, the frames queued
+  // meanwhile going in the next. Once a batch is done, each of its
+  // coroutines carries on on that thread in turn, so they should hand their
+  // I/O to an IoPool rather than doing it there. The renderer must outlive
+  // the frames awaiting it.
+  class FrameRenderer {
+  public :
+    // the settings are as for BatchProcessor
+    explicit FrameRenderer(const RenderSettings &settings, const AbortCheck &aborted = AbortCheck());
+
+    // render what is queued, then stop the thread
+    ~FrameRenderer();
+
+    struct Awaiter {
+      FrameRenderer *renderer;
+      FrameView *frame;
+      std::exception_ptr error;
+
+      bool await_ready() { return false; }
+      void await_suspend(std::coroutine_handle<> handle) { renderer->post(this, handle); }
+      void await_resume()
+      {
+        if(error) {
+          std::rethrow_exception(error);
+        }
+      }
+    };
+
+    // render the frame, which must stay put until the await is done
+    Awaiter processAsync(FrameView &frame) { Awaiter awaiter = {this, &frame, NULL}; return awaiter; }
+
+    const RenderSettings &settings() const { return batch_.settings(); }
+
+  protected :
+    struct Request {
+      Awaiter *awaiter;
+      std::coroutine_handle<> handle;
+    };
+
+    void post(Awaiter *awaiter, std::coroutine_handle<> handle);
+    void threadMain();
+
+    BatchProcessor batch_;
+    AbortCheck aborted_;
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::vector<Request> requests_;
+    bool stop_;
+    std::thread thread_;
+  };
+
+  inline FrameRenderer::FrameRenderer(const RenderSettings &settings, const AbortCheck &aborted)
+    : batch_(settings)
+    , aborted_(aborted)
+    , stop_(false)
+  {
+    thread_ = std::thread(&FrameRenderer::threadMain, this);
+  }
+
+  inline FrameRenderer::~FrameRenderer()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    thread_.join();
+  }
+
+  inline void FrameRenderer::post(Awaiter *awaiter, std::coroutine_handle<> handle)
+  {
+    Request request = {awaiter, handle};
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      requests_.push_back(request);
+    }
+    wake_.notify_one();
+  }
+
+  inline void FrameRenderer::threadMain()
+  {
+    std::vector<Request> batch;
+    std::vector<FrameView> frames;
+    for(;;) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait(lock, [this]() { return stop_ || !requests_.empty(); });
+        if(requests_.empty()) {
+          return;
+        }
+        batch.swap(requests_);
+      }
+
+      // the views are copied, the pixels and scopes they point at are not
+      frames.clear();
+      for(size_t r = 0; r < batch.size(); ++r) {
+        frames.push_back(*batch[r].awaiter->frame);
+      }
+
+      try {
+        batch_.processFrames(frames, aborted_);
+      }
+      catch(...) {
+        std::exception_ptr error = std::current_exception();
+        for(size_t r = 0; r < batch.size(); ++r) {
+          batch[r].awaiter->error = error;
+        }
+      }
+
+      for(size_t r = 0; r < batch.size(); ++r) {
+        batch[r].handle.resume();
+      }
+      batch.clear();
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,200 @@
+// Copyright OpenFX and contributors to the OpenFX project.
+// Copyright SalkocsisFX.
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+A stand-in client for the render server, for trying it out.
+
+  softsat_client [frames] [width] [height] [pipe name]
+
+It makes up float RGBA frames, pushes them through the server with the ring
+full, checks each one against rendering it here and says how long the round
+trips took. The settings are deterministic, so the two must match exactly.
+*/
+
+#include "softsat_server.h"
+
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+
+using namespace SoftSat;
+
+namespace {
+
+  const unsigned int kSlots = 4;
+
+  // the same made up frame every time for the same number
+  void MakeFrame(float *pixels, int width, int height, int frame)
+  {
+    for(int y = 0; y < height; ++y) {
+      for(int x = 0; x < width; ++x) {
+        float *pixel = pixels + (size_t(y) * width + x) * 4;
+        pixel[0] = float(x) / width;
+        pixel[1] = 0.5f + 0.4f * sinf(x * 0.05f + y * 0.03f + frame * 0.1f);
+        pixel[2] = float(y) / height;
+        pixel[3] = 1.0f;
+      }
+    }
+  }
+
+  // send a message and wait for the answer
+  bool Transact(HANDLE pipe, const void *message, DWORD bytes, ServerReply &reply)
+  {
+    DWORD done = 0;
+    if(!WriteFile(pipe, message, bytes, &done, NULL) || done != bytes) {
+      return false;
+    }
+    if(!ReadFile(pipe, &reply, sizeof(reply), &done, NULL) || done != sizeof(reply)) {
+      return false;
+    }
+    if(reply.status != 0) {
+      fprintf(stderr, "softsat_client: server says %s\n", reply.error);
+      return false;
+    }
+    return true;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  int nFrames = argc > 1 ? atoi(argv[1]) : 100;
+  int width = argc > 2 ? atoi(argv[2]) : 1920;
+  int height = argc > 3 ? atoi(argv[3]) : 1080;
+  const char *pipeName = argc > 4 ? argv[4] : SOFTSAT_SERVER_PIPE;
+  if(nFrames <= 0 || width <= 0 || height <= 0) {
+    fprintf(stderr, "usage: softsat_client [frames] [width] [height] [pipe name]\n");
+    return 1;
+  }
+
+  // connect, waiting for the server if it is busy with someone else
+  HANDLE pipe = INVALID_HANDLE_VALUE;
+  for(int attempt = 0; attempt < 10 && pipe == INVALID_HANDLE_VALUE; ++attempt) {
+    pipe = CreateFileA(pipeName, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+    if(pipe == INVALID_HANDLE_VALUE && GetLastError() == ERROR_PIPE_BUSY) {
+      WaitNamedPipeA(pipeName, 1000);
+    }
+  }
+  if(pipe == INVALID_HANDLE_VALUE) {
+    fprintf(stderr, "softsat_client: no server on %s\n", pipeName);
+    return 1;
+  }
+  DWORD mode = PIPE_READMODE_MESSAGE;
+  SetNamedPipeHandleState(pipe, &mode, NULL, NULL);
+
+  // ask for a ring and open it
+  unsigned long long frameBytes = (unsigned long long) width * height * 4 * sizeof(float);
+  ServerHello hello = {eServerHello, kServerVersion, kSlots, frameBytes};
+  ServerReply reply;
+  if(!Transact(pipe, &hello, sizeof(hello), reply)) {
+    return 1;
+  }
+  std::string ring = reply.ring;
+  HANDLE mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, ring.c_str());
+  void *view = mapping ? MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0) : NULL;
+  HANDLE submitEvent = OpenEventA(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, (ring + "Submit").c_str());
+  HANDLE doneEvent = OpenEventA(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, (ring + "Done").c_str());
+  if(!view || !submitEvent || !doneEvent) {
+    fprintf(stderr, "softsat_client: could not open the ring %s\n", ring.c_str());
+    return 1;
+  }
+  RingLayout layout(view, frameBytes);
+  RingHeader &header = layout.header();
+
+  ServerSettings message;
+  memset(&message, 0, sizeof(message));
+  message.type = eServerSettings;
+  message.saturation = 1.4f;
+  message.transfer = eTransferLinear;
+  message.exposure = 1.0f;
+  message.chromaDetail = 0.5f;
+  message.chromaSize = 2.0f;
+  message.gamutCompression = 1;
+  message.grainAmount = 0.02f;
+  message.grainColour = 0.3f;
+  message.deterministic = 1;
+  if(!Transact(pipe, &message, sizeof(message), reply)) {
+    return 1;
+  }
+
+  // the same settings here, to check the server's frames against
+  RenderSettings settings;
+  std::shared_ptr<const Lut3D> lut;
+  UnpackSettings(message, settings, lut);
+  BuildCineonTable();
+  std::vector<float> source(size_t(width) * height * 4), expected(source.size());
+  OfxRectI bounds = {0, 0, width, height};
+  ImageView noMask;
+
+  typedef std::chrono::steady_clock Clock;
+  std::vector<Clock::time_point> sent(nFrames);
+  std::vector<double> latencies;
+  int mismatches = 0, failures = 0;
+  Clock::time_point start = Clock::now();
+
+  unsigned long long submitted = 0, checked = 0;
+  while(checked < (unsigned long long) nFrames) {
+    // keep the ring full
+    while(submitted < (unsigned long long) nFrames && submitted - checked < kSlots) {
+      unsigned int s = (unsigned int)(submitted % kSlots);
+      RingSlot &slot = layout.slot(s);
+      slot.width = width;
+      slot.height = height;
+      slot.nComponents = 4;
+      slot.bytesPerComponent = 4;
+      slot.time = OfxTime(submitted);
+      slot.wantScopes = 0;
+      MakeFrame((float *) layout.source(s), width, height, int(submitted));
+
+      sent[submitted] = Clock::now();
+      header.submitted.store(++submitted, std::memory_order_release);
+      SetEvent(submitEvent);
+    }
+
+    // wait for the oldest, then check whatever has come back
+    unsigned long long completed = header.completed.load(std::memory_order_acquire);
+    if(completed == checked) {
+      WaitForSingleObject(doneEvent, 1000);
+      continue;
+    }
+    Clock::time_point now = Clock::now();
+    for(; checked < completed; ++checked) {
+      unsigned int s = (unsigned int)(checked % kSlots);
+      const RingSlot &slot = layout.slot(s);
+      latencies.push_back(std::chrono::duration<double, std::micro>(now - sent[checked]).count());
+      if(slot.status != 0) {
+        fprintf(stderr, "softsat_client: frame %llu failed, %s\n", checked, slot.error);
+        ++failures;
+        continue;
+      }
+
+      MakeFrame(source.data(), width, height, int(checked));
+      ImageView sourceView(source.data(), bounds, width * 16, 4, 4);
+      ImageView expectedView(expected.data(), bounds, width * 16, 4, 4);
+      RenderSettings frameSettings = settings;
+      frameSettings.grainTime = OfxTime(checked);
+      {
+        // the server's threads render in this mode, so we must too
+        FloatModeGuard floatMode(settings.deterministic);
+        RenderWindow(frameSettings, AbortCheck(), sourceView, noMask, expectedView, bounds);
+      }
+      if(memcmp(expected.data(), layout.output(s), expected.size() * sizeof(float)) != 0) {
+        ++mismatches;
+      }
+    }
+  }
+  double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+  std::sort(latencies.begin(), latencies.end());
+  printf("%d frames of %dx%d in %.3f s, %d failed, %d differed from a local render\n",
+         nFrames, width, height, seconds, failures, mismatches);
+  printf("round trip us: min %.0f median %.0f max %.0f\n",
+         latencies.front(), latencies[latencies.size() / 2], latencies.back());
+
+  UnmapViewOfFile(view);
+  CloseHandle(mapping);
+  CloseHandle(submitEvent);
+  CloseHandle(doneEvent);
+  CloseHandle(pipe);
+  return failures || mismatches ? 1 : 0;
+}
@@ -0,0 +1,2579 @@
+// Copyright OpenFX and contributors to the OpenFX project.
+// Copyright SalkocsisFX.
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+The SoftSaturate pixel kernel on its own, for the plugin and for anything
+else that wants to saturate images, such as batch tools and libraries.
+
+Nothing here talks to an OFX host, the only OFX it uses is ofxCore.h's plain
+rectangle and time types. Images are wrapped up in ImageViews, the settings
+are filled in by the caller, and ProcessImage does the threading that a host
+would otherwise do.
+*/
+
+#ifndef SOFTSAT_CORE_H
+#define SOFTSAT_CORE_H
+
+#include <windows.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <emmintrin.h>
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <vector>
+#include "ofxCore.h"
+
+// Deterministic renders are only the same bits whether or not the target has
+// FMA if multiplies and adds are never fused, so anything including this must
+// be built with -ffp-contract=off, or /fp:precise with MSVC, as the tools are.
+
+namespace SoftSat {
+
+  // each LUT gets its own id, so caches can tell them apart
+  inline std::atomic<unsigned long long> gNextLutId(1);
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // a 3D LUT, each entry is padded out to RGBA so it can be fetched with a single
+  // SSE load, red varies fastest as in .cube files
+  struct Lut3D {
+    unsigned long long id;
+    int size;
+    float domainMin[3];
+    float domainMax[3];
+
+    // size^3 entries, either in storage or in a mapped cache file
+    const float *table;
+    std::vector<float> storage;
+    void *mappedView;
+
+    // optional 1D LUT shared by all channels, taking [0, 1] input to the
+    // cube's lattice, used by baked LUTs to put more entries in the shadows
+    std::vector<float> shaper;
+
+    Lut3D()
+      : id(gNextLutId++)
+      , size(0)
+      , table(NULL)
+      , mappedView(NULL)
+    {
+      for(int c = 0; c < 3; ++c) {
+        domainMin[c] = 0.0f;
+        domainMax[c] = 1.0f;
+      }
+    }
+
+    ~Lut3D()
+    {
+      if(mappedView)
+        UnmapViewOfFile(mappedView);
+    }
+
+    // allocate the table in storage
+    float *allocate()
+    {
+      storage.assign(size_t(nEntries()) * 4, 0.0f);
+      table = storage.data();
+      return storage.data();
+    }
+
+    // number of entries in the table
+    int nEntries() const { return size * size * size; }
+
+  private :
+    Lut3D(const Lut3D &);
+    Lut3D &operator=(const Lut3D &);
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // read a 3D LUT from a .cube file, returns false if the file is missing or
+  // isn't a well formed 3D cube
+  inline bool ReadCubeFile(const char *path, Lut3D &lut)
+  {
+    FILE *file = fopen(path, "r");
+    if(!file) {
+      return false;
+    }
+
+    bool ok = true;
+    int entries = 0;
+    float *table = NULL;
+    char line[512];
+    while(ok && fgets(line, sizeof(line), file)) {
+      char *text = line;
+      while(isspace((unsigned char) *text)) ++text;
+
+      // skip blank lines and comments
+      if(*text == 0 || *text == '#') {
+        continue;
+      }
+
+      float lo, hi;
+      if(sscanf(text, "LUT_3D_SIZE %d", &lut.size) == 1) {
+        ok = lut.size >= 2 && lut.size <= 256 && entries == 0;
+        if(ok) {
+          table = lut.allocate();
+        }
+      }
+      else if(sscanf(text, "DOMAIN_MIN %f %f %f", &lut.domainMin[0], &lut.domainMin[1], &lut.domainMin[2]) == 3) {
+      }
+      else if(sscanf(text, "DOMAIN_MAX %f %f %f", &lut.domainMax[0], &lut.domainMax[1], &lut.domainMax[2]) == 3) {
+      }
+      else if(sscanf(text, "LUT_3D_INPUT_RANGE %f %f", &lo, &hi) == 2) {
+        for(int c = 0; c < 3; ++c) {
+          lut.domainMin[c] = lo;
+          lut.domainMax[c] = hi;
+        }
+      }
+      else if(strncmp(text, "LUT_1D_SIZE", 11) == 0) {
+        // 1D only cubes are not something we apply
+        ok = false;
+      }
+      else if(isalpha((unsigned char) *text)) {
+        // TITLE and any other keyword we don't care about
+      }
+      else {
+        float *entry = table && entries < lut.nEntries() ? &table[size_t(entries) * 4] : NULL;
+        ok = entry && sscanf(text, "%f %f %f", &entry[0], &entry[1], &entry[2]) == 3;
+        ++entries;
+      }
+    }
+    fclose(file);
+
+    for(int c = 0; c < 3; ++c) {
+      ok = ok && lut.domainMax[c] > lut.domainMin[c];
+    }
+    return ok && lut.size > 0 && entries == lut.nEntries();
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // the encodings the source might arrive in, in the order of the transfer param's options
+  enum TransferFunction {
+    eTransferLinear = 0,
+    eTransferCineonLog,
+    eTransferPQ,
+    eTransferHLG,
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // per channel gain and offset that stretch a faded frame's black and white
+  // points back out to 0 and 1
+  struct Levels {
+    float gain[3];
+    float offset[3];
+
+    Levels()
+    {
+      for(int c = 0; c < 3; ++c) {
+        gain[c] = 1.0f;
+        offset[c] = 0.0f;
+      }
+    }
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // a copy of a source frame, kept so temporal denoising can look at it again
+  // while rendering the frames either side
+  struct SourceFrame {
+    OfxTime time;
+    double renderScale;
+    OfxRectI bounds;
+    int rowBytes;
+    int nComponents;
+    int bytesPerComponent;
+
+    // what the host's image was, so a change upstream shows, and a cheaper
+    // check of it for each render of the frame to make
+    unsigned long long identity;
+    unsigned long long fingerprint;
+
+    std::vector<unsigned char> pixels;
+  };
+
+  // the scopes bin the rendered pixels' Rec. 709 chroma, Cb and Cr in
+  // [-0.5, 0.5], on a coarse grid, and each channel on a histogram over [0, 1]
+  const int kVectorscopeSize = 64;
+  const int kScopeHistogramBins = 256;
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // the vectorscope and histogram of the pixels one render wrote, which it
+  // fills in as it goes, being the only thread writing to it
+  struct ScopeBins {
+    unsigned int vectorscope[kVectorscopeSize][kVectorscopeSize];  // [Cr][Cb]
+    unsigned int histogram[3][kScopeHistogramBins];
+    unsigned long long count;
+  };
+
+  // the most frames either side temporal denoising looks at
+  const int kMaxDenoiseRadius = 3;
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // what the kernel needs to know to render, fetched from the params once per render
+  struct RenderSettings {
+    float saturation;
+    TransferFunction transfer;
+
+    // stretch each channel out to its shot's black and white points before
+    // anything else, the render fills in the levels
+    bool restoreLevels;
+    Levels levels;
+
+    // even out the exposure of each frame against its neighbours within the
+    // radius, the render fills in the gain, which the kernel applies in
+    // linear light along with the saturation
+    bool deflicker;
+    int deflickerRadius;
+    float exposure;
+
+    // average each pixel's chroma with that of the same pixel in the frames
+    // within the radius either side, by the strength. The render fills in the
+    // frames it could get, which depend on where the pixel is, so nothing
+    // temporal is ever baked.
+    float denoiseStrength;
+    int denoiseRadius;
+    int denoiseCount;
+    const SourceFrame *denoiseFrames[2 * kMaxDenoiseRadius];
+
+    // blur each pixel's chroma with that of the pixels around it, taking back
+    // colour that has bled, or sharpen it, from -1 for fully blurred up. The
+    // blur's size is in pixels at full resolution, the render fills in the
+    // radius of the box passes that make it up at its render scale.
+    float chromaDetail;
+    float chromaSize;
+    int chromaRadius;
+
+    // scale the saturation to bring the frame's chroma to the target, the
+    // render folds the resulting gain into the saturation
+    bool autoSaturation;
+    float targetChroma;
+
+    // frames either side whose chroma is averaged into the auto gain, and how
+    // different two frames must be for there to be a cut between them, which
+    // the averaging doesn't cross
+    int smoothingRadius;
+    float cutThreshold;
+
+    // compress colours out of gamut after saturating back towards grey
+    bool gamutCompression;
+
+    // LUT applied after saturation, may be NULL
+    const Lut3D *lut;
+
+    // grain added to the finished pixels, how much, how much of it differs
+    // between the channels, and what it is keyed on along with the position
+    float grainAmount;
+    float grainColour;
+    int grainSeed;
+    OfxTime grainTime;
+
+    // compile the color transform into a LUT for 8 and 16 bit renders
+    bool bake;
+
+    // render the same bits whatever the machine, tiling or thread count
+    bool deterministic;
+
+    // if set, the whole effect baked into one table, which replaces every other stage
+    const Lut3D *bakedLut;
+
+    // if set, where the render bins the pixels it writes for the scopes,
+    // which has no effect on them
+    ScopeBins *scopes;
+
+    RenderSettings()
+      : saturation(1.0f)
+      , transfer(eTransferLinear)
+      , restoreLevels(false)
+      , deflicker(false)
+      , deflickerRadius(0)
+      , exposure(1.0f)
+      , denoiseStrength(0.0f)
+      , denoiseRadius(0)
+      , denoiseCount(0)
+      , chromaDetail(0.0f)
+      , chromaSize(2.0f)
+      , chromaRadius(0)
+      , autoSaturation(false)
+      , targetChroma(0.1f)
+      , smoothingRadius(0)
+      , cutThreshold(0.4f)
+      , gamutCompression(false)
+      , lut(NULL)
+      , grainAmount(0.0f)
+      , grainColour(0.0f)
+      , grainSeed(0)
+      , grainTime(0)
+      , bake(false)
+      , deterministic(false)
+      , bakedLut(NULL)
+      , scopes(NULL)
+    {}
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // do two sets of settings do the same thing to a pixel's color, ignoring
+  // anything that depends on where the pixel is
+  inline bool SameColorTransform(const RenderSettings &a, const RenderSettings &b)
+  {
+    return a.saturation == b.saturation &&
+           a.transfer == b.transfer &&
+           a.restoreLevels == b.restoreLevels &&
+           (!a.restoreLevels || memcmp(&a.levels, &b.levels, sizeof(Levels)) == 0) &&
+           a.exposure == b.exposure &&
+           a.gamutCompression == b.gamutCompression &&
+           a.deterministic == b.deterministic &&
+           a.lut == b.lut;
+  }
+
+  // box blurs that make up the near gaussian blur of the chroma detail stage
+  const int kChromaBlurPasses = 3;
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // the radius of each box blur making up a blur of the given size in pixels,
+  // taking it as a standard deviation. Three passes of radius r have a
+  // variance of r(r + 1).
+  inline int ChromaBlurRadius(float size)
+  {
+    return std::max(int(floorf((sqrtf(1.0f + 4.0f * size * size) - 1.0f) * 0.5f + 0.5f)), 1);
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // for exact results the box blurs' running sums start afresh at the start of
+  // each block of this many pixels, counted in image coordinates. A block as
+  // long as the window costs at most one more add per pixel.
+  inline int ExactBlurBlock(int radius)
+  {
+    return std::max(2 * radius + 1, 16);
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // how far outside a window the source pixels still affect it, further for
+  // exact results as a sum carries on from the start of its block
+  inline int SourceBorder(const RenderSettings &settings)
+  {
+    if(settings.chromaDetail == 0) {
+      return 0;
+    }
+    int reach = settings.chromaRadius;
+    if(settings.deterministic) {
+      reach += ExactBlurBlock(settings.chromaRadius) - 1;
+    }
+    return kChromaBlurPasses * reach;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // does each output pixel depend on nothing but the color of the same source
+  // pixel, so the effect can be baked into a table
+  inline bool IsPointwise(const RenderSettings &settings)
+  {
+    return settings.denoiseCount == 0 && settings.chromaDetail == 0;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // a rectangle grown by a border all round
+  inline OfxRectI GrowRect(OfxRectI rect, int border)
+  {
+    rect.x1 -= border;
+    rect.y1 -= border;
+    rect.x2 += border;
+    rect.y2 += border;
+    return rect;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Cineon log encoding, 10 bit code values with reference white at 685, reference
+  // black at 95, a negative gamma of 0.6 and 0.002 density per code value
+  const float kCineonRefWhite = 685.0f;
+  const float kCineonRefBlack = 95.0f;
+  const float kCineonCodesPerStop = 300.0f * 0.30103f; // 300 codes per decade, in log2
+
+  // code value -> linear, filled in by BuildCineonTable
+  inline float gCineonToLinear[1024];
+
+  // offset and scale that map reference black to 0 and reference white to 1
+  inline float gCineonBlackOffset = 0;
+  inline float gCineonLinearScale = 1;
+
+  // the exposure at code value 0, the lowest we can encode
+  inline float gCineonMinExposure = 0;
+
+  inline std::once_flag gCineonTableBuilt;
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // a view of an image's pixels, held by someone else who must keep them
+  // around for as long as it is used
+  class ImageView {
+  public    :
+    // an empty image, with no pixels
+    ImageView();
+
+    // wrap pixels whose rows are rowBytes apart, bottom row first
+    ImageView(void *data, const OfxRectI &bounds, int rowBytes, int nComponents, int bytesPerComponent);
+
+    // get a pixel address, cast to the right type
+    template <class T>
+    T *pixelAddress(int x, int y)
+    {
+      return reinterpret_cast<T *>(rawAddress(x, y));
+    }
+
+    // Is this image empty?
+    operator bool();
+
+    // bytes per component, 1, 2 or 4 for byte, short and float images
+    int bytesPerComponent() const { return bytesPerComponent_; }
+
+    // number of components
+    int nComponents() const { return nComponents_; }
+
+    // bytes per pixel
+    int bytesPerPixel() const { return bytesPerPixel_; }
+
+    // bytes from the start of one row to the next
+    int rowBytes() const { return rowBytes_; }
+
+    // pixel bounds of the data we hold
+    const OfxRectI &bounds() const { return bounds_; }
+
+  protected :
+    // Look up a pixel address in the image. returns null if the pixel was not
+    // in the bounds of the image
+    void *rawAddress(int x, int y);
+
+    int rowBytes_;
+    OfxRectI bounds_;
+    char *dataPtr_;
+    int nComponents_;
+    int bytesPerComponent_;
+    int bytesPerPixel_;
+  };
+
+  inline ImageView::ImageView()
+    : rowBytes_(0)
+    , dataPtr_(NULL)
+    , nComponents_(0)
+    , bytesPerComponent_(0)
+    , bytesPerPixel_(0)
+  {
+    bounds_.x1 = bounds_.x2 = bounds_.y1 = bounds_.y2 = 0;
+  }
+
+  inline ImageView::ImageView(void *data, const OfxRectI &bounds, int rowBytes, int nComponents, int bytesPerComponent)
+    : rowBytes_(rowBytes)
+    , bounds_(bounds)
+    , dataPtr_((char *) data)
+    , nComponents_(nComponents)
+    , bytesPerComponent_(bytesPerComponent)
+    , bytesPerPixel_(nComponents * bytesPerComponent)
+  {
+  }
+
+  // get the address of a location in the image as a void *
+  inline void *ImageView::rawAddress(int x, int y)
+  {
+    // Inside the bounds of this image?
+    if(x < bounds_.x1 || x >= bounds_.x2 || y < bounds_.y1 || y >= bounds_.y2)
+      return NULL;
+
+    // turn image plane coordinates into offsets from the bottom left
+    int yOffset = y - bounds_.y1;
+    int xOffset = x - bounds_.x1;
+
+    // Find the start of our row, using byte arithmetic
+    char *rowStart = (dataPtr_) + yOffset * rowBytes_;
+
+    // finally find the position of the first component of column
+    return rowStart + (xOffset * bytesPerPixel_);
+  }
+
+  // are we empty?
+  inline ImageView:: operator bool()
+  {
+    return dataPtr_ != NULL;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // asked every so often during a render whether to give up on it, an empty
+  // one never does
+  typedef std::function<bool()> AbortCheck;
+
+  static inline bool Aborted(const AbortCheck &aborted)
+  {
+    return aborted && aborted();
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // clamp to 0 and MAX inclusive
+  template <class T, int MAX>
+  static inline T Clamp(float value)
+  {
+    if(MAX == 1)
+      return value; // don't clamp floating point values
+    else
+      return value < 0 ? T(0) : (value > MAX ? T(MAX) : T(value));
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // clamp to 0 and MAX inclusive
+  template <class T1, class T2>
+  static inline T1 Blend(T1 v1, T2 v2, float blend)
+  {
+    return v1 + (v2-v1) * blend;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // puts the SSE unit into one fixed floating point mode for as long as it is
+  // around, round to nearest with denormals flushed to zero, whatever mode
+  // the host left the thread in, and puts the host's mode back after
+  class FloatModeGuard {
+  public :
+    explicit FloatModeGuard(bool enable = true)
+      : saved_(_mm_getcsr())
+      , enabled_(enable)
+    {
+      if(enabled_) {
+        // all exceptions masked, round to nearest, flush to zero and denormals are zero
+        _mm_setcsr(0x1F80 | 0x8000 | 0x0040);
+      }
+    }
+
+    ~FloatModeGuard()
+    {
+      if(enabled_) {
+        _mm_setcsr(saved_);
+      }
+    }
+
+  protected :
+    unsigned int saved_;
+    bool enabled_;
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // log2 of four positive normalised floats, good to about 1e-6
+  static inline __m128 FastLog2(__m128 x)
+  {
+    const __m128 one = _mm_set1_ps(1.0f);
+    __m128i bits = _mm_castps_si128(x);
+
+    // split into an exponent and a mantissa in [sqrt(1/2), sqrt(2))
+    __m128i exponent = _mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(127));
+    __m128 mantissa = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x007FFFFF)),
+                                                    _mm_set1_epi32(0x3F800000)));
+    __m128 big = _mm_cmpgt_ps(mantissa, _mm_set1_ps(1.41421356f));
+    mantissa = _mm_sub_ps(mantissa, _mm_and_ps(big, _mm_mul_ps(mantissa, _mm_set1_ps(0.5f))));
+    exponent = _mm_sub_epi32(exponent, _mm_castps_si128(big));
+
+    // log2(m) = 2/ln(2) * atanh(u) with u = (m - 1)/(m + 1), |u| < 0.172
+    __m128 u = _mm_div_ps(_mm_sub_ps(mantissa, one), _mm_add_ps(mantissa, one));
+    __m128 u2 = _mm_mul_ps(u, u);
+    __m128 poly = _mm_add_ps(_mm_mul_ps(u2, _mm_set1_ps(1.0f/9.0f)), _mm_set1_ps(1.0f/7.0f));
+    poly = _mm_add_ps(_mm_mul_ps(poly, u2), _mm_set1_ps(1.0f/5.0f));
+    poly = _mm_add_ps(_mm_mul_ps(poly, u2), _mm_set1_ps(1.0f/3.0f));
+    poly = _mm_add_ps(_mm_mul_ps(poly, u2), one);
+    poly = _mm_mul_ps(_mm_mul_ps(poly, u), _mm_set1_ps(2.88539008f));
+
+    return _mm_add_ps(_mm_cvtepi32_ps(exponent), poly);
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // 2^x of four floats, good to about 2e-7 relative
+  static inline __m128 FastExp2(__m128 x)
+  {
+    x = _mm_max_ps(_mm_min_ps(x, _mm_set1_ps(127.0f)), _mm_set1_ps(-126.0f));
+
+    // split into a whole power of two and a fraction in [-0.5, 0.5]
+    __m128i whole = _mm_cvtps_epi32(x);
+    __m128 f = _mm_sub_ps(x, _mm_cvtepi32_ps(whole));
+
+    // 2^f = e^(f ln(2)), taylor series to 6th order
+    __m128 poly = _mm_add_ps(_mm_mul_ps(f, _mm_set1_ps(1.54035304e-4f)), _mm_set1_ps(1.33335581e-3f));
+    poly = _mm_add_ps(_mm_mul_ps(poly, f), _mm_set1_ps(9.61812911e-3f));
+    poly = _mm_add_ps(_mm_mul_ps(poly, f), _mm_set1_ps(5.55041087e-2f));
+    poly = _mm_add_ps(_mm_mul_ps(poly, f), _mm_set1_ps(2.40226507e-1f));
+    poly = _mm_add_ps(_mm_mul_ps(poly, f), _mm_set1_ps(6.93147181e-1f));
+    poly = _mm_add_ps(_mm_mul_ps(poly, f), _mm_set1_ps(1.0f));
+
+    __m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(whole, _mm_set1_epi32(127)), 23));
+    return _mm_mul_ps(poly, scale);
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // fill in the Cineon tables, which anything rendering must do first. Only
+  // the first call does anything, so the plugin and batches in the same
+  // process can each call it. The exposures come from FastExp2 rather than the
+  // C runtime's powf, whose last bits differ between runtimes, so the tables
+  // and deterministic renders through them are the same everywhere.
+  inline void BuildCineonTable()
+  {
+    std::call_once(gCineonTableBuilt, []() {
+      // 10^((code - white) / 300) is 2^((code - white) / codes per stop)
+      const __m128 invCodesPerStop = _mm_set1_ps(1.0f / kCineonCodesPerStop);
+      const __m128 refWhite = _mm_set1_ps(kCineonRefWhite);
+      alignas(16) float exposures[4];
+
+      _mm_store_ps(exposures, FastExp2(_mm_mul_ps(_mm_sub_ps(_mm_setr_ps(kCineonRefBlack, 0.0f, 0.0f, 0.0f), refWhite),
+                                                  invCodesPerStop)));
+      gCineonBlackOffset = exposures[0];
+      gCineonMinExposure = exposures[1];
+      gCineonLinearScale = 1.0f - gCineonBlackOffset;
+
+      for(int code = 0; code < 1024; code += 4) {
+        __m128 codes = _mm_cvtepi32_ps(_mm_setr_epi32(code, code + 1, code + 2, code + 3));
+        _mm_store_ps(exposures, FastExp2(_mm_mul_ps(_mm_sub_ps(codes, refWhite), invCodesPerStop)));
+        for(int i = 0; i < 4; ++i) {
+          gCineonToLinear[code + i] = (exposures[i] - gCineonBlackOffset) / gCineonLinearScale;
+        }
+      }
+    });
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // a short strip of a row converted to planar float, normalised so 1 is white,
+  // which is what every stage of the kernel works on
+  struct PixelChunk {
+    enum { kSize = 256 };
+
+    alignas(16) float r[kSize];
+    alignas(16) float g[kSize];
+    alignas(16) float b[kSize];
+    alignas(16) float mask[kSize];
+
+    int count;  // number of pixels in the strip
+    int n;      // count padded up to a multiple of 4, the arrays are valid up to here
+    int begin;  // [begin, end) is the part of the strip that has source pixels
+    int end;
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // read a strip of source and mask pixels starting at x, y
+  template <class T, int MAX>
+  void LoadChunk(PixelChunk &chunk, ImageView &src, ImageView &mask, int x, int y, int count)
+  {
+    chunk.count = count;
+    chunk.n = (count + 3) & ~3;
+
+    // find where the source overlaps the strip, anything outside it renders as black
+    const OfxRectI &bounds = src.bounds();
+    chunk.begin = chunk.end = 0;
+    if(y >= bounds.y1 && y < bounds.y2) {
+      chunk.begin = std::min(std::max(bounds.x1 - x, 0), count);
+      chunk.end = std::max(std::min(bounds.x2 - x, count), chunk.begin);
+    }
+
+    const float scale = 1.0f / float(MAX);
+    const int nComps = src.nComponents();
+    const T *srcPix = chunk.begin < chunk.end ? src.pixelAddress<T>(x + chunk.begin, y) : NULL;
+    const bool hasMask = mask;
+
+    for(int i = 0; i < chunk.n; ++i) {
+      if(i >= chunk.begin && i < chunk.end) {
+        chunk.r[i] = srcPix[0] * scale;
+        chunk.g[i] = srcPix[1] * scale;
+        chunk.b[i] = srcPix[2] * scale;
+        srcPix += nComps;
+      }
+      else {
+        chunk.r[i] = chunk.g[i] = chunk.b[i] = 0;
+      }
+
+      // get the amount to mask by, no mask image means we do the full effect everywhere
+      float maskAmount = 1.0f;
+      if(hasMask) {
+        T *maskPix = i < count ? mask.pixelAddress<T>(x + i, y) : NULL;
+        maskAmount = maskPix ? float(*maskPix)/float(MAX) : 0;
+      }
+      chunk.mask[i] = maskAmount;
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // write a processed strip to the output, blending with the source by the mask
+  template <class T, int MAX>
+  void StoreChunk(const PixelChunk &chunk, ImageView &src, ImageView &output, int x, int y)
+  {
+    const int nComps = output.nComponents();
+    const float *planes[3] = {chunk.r, chunk.g, chunk.b};
+
+    // integer outputs round to nearest, floats go out as they are
+    const float rounding = MAX == 1 ? 0.0f : 0.5f;
+
+    T *dstPix = output.pixelAddress<T>(x, y);
+    const T *srcPix = chunk.begin < chunk.end ? src.pixelAddress<T>(x + chunk.begin, y) : NULL;
+
+    for(int i = 0; i < chunk.count; ++i) {
+      if(i < chunk.begin || i >= chunk.end) {
+        // we don't have a pixel in the source image, set output to zero
+        for(int c = 0; c < nComps; ++c) {
+          dstPix[c] = 0;
+        }
+      }
+      else {
+        float maskAmount = chunk.mask[i];
+        if(maskAmount == 0) {
+          // we have a mask input, but the mask is zero here,
+          // so no effect happens, copy source to output
+          for(int c = 0; c < nComps; ++c) {
+            dstPix[c] = srcPix[c];
+          }
+        }
+        else {
+          for(int c = 0; c < 3; ++c) {
+            T value = Clamp<T, MAX>(planes[c][i] * MAX + rounding);
+            // use the mask to control how much original we should have
+            dstPix[c] = Blend(srcPix[c], value, maskAmount);
+          }
+
+          if(nComps == 4) { // if we have an alpha, just copy it
+            dstPix[3] = srcPix[3];
+          }
+        }
+        srcPix += nComps;
+      }
+      dstPix += nComps;
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // look up a value in [0, 1] in a 1D table with last + 1 entries, interpolating
+  // between entries so float sources don't band
+  static inline float Lookup1D(const float *table, int last, float value)
+  {
+    float position = std::min(std::max(value * last, 0.0f), float(last));
+    int index = std::min(int(position), last - 1);
+    float frac = position - index;
+    return table[index] + (table[index + 1] - table[index]) * frac;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Cineon code values to linear through the table
+  inline void CineonToLinear(float *values, int n)
+  {
+    for(int i = 0; i < n; ++i) {
+      values[i] = Lookup1D(gCineonToLinear, 1023, values[i]);
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // linear back to Cineon code values
+  inline void LinearToCineon(float *values, int n)
+  {
+    const __m128 scale = _mm_set1_ps(gCineonLinearScale);
+    const __m128 offset = _mm_set1_ps(gCineonBlackOffset);
+    const __m128 smallest = _mm_set1_ps(gCineonMinExposure);
+    const __m128 codesPerStop = _mm_set1_ps(kCineonCodesPerStop);
+    const __m128 refWhite = _mm_set1_ps(kCineonRefWhite);
+    const __m128 normalise = _mm_set1_ps(1.0f / 1023.0f);
+
+    for(int i = 0; i < n; i += 4) {
+      // anything saturated below code value 0 is clamped to it
+      __m128 exposure = _mm_add_ps(_mm_mul_ps(_mm_load_ps(values + i), scale), offset);
+      exposure = _mm_max_ps(exposure, smallest);
+      __m128 code = _mm_add_ps(_mm_mul_ps(FastLog2(exposure), codesPerStop), refWhite);
+      _mm_store_ps(values + i, _mm_mul_ps(code, normalise));
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // pow for four positive floats via log2 and exp2, zero and below go to ~0
+  static inline __m128 FastPow(__m128 x, __m128 power)
+  {
+    x = _mm_max_ps(x, _mm_set1_ps(1e-30f));
+    return FastExp2(_mm_mul_ps(FastLog2(x), power));
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // pick a where the mask is set, b where it isn't
+  static inline __m128 Select(__m128 mask, __m128 a, __m128 b)
+  {
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // SMPTE ST 2084 (PQ) constants, linear light is normalised so 1 is 10000 nits
+  const float kPQ_m1 = 2610.0f / 16384.0f;
+  const float kPQ_m2 = 2523.0f / 4096.0f * 128.0f;
+  const float kPQ_c1 = 3424.0f / 4096.0f;
+  const float kPQ_c2 = 2413.0f / 4096.0f * 32.0f;
+  const float kPQ_c3 = 2392.0f / 4096.0f * 32.0f;
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // PQ signal to linear, the EOTF. The signal is clamped to [0, 1], as 1 is
+  // the brightest PQ encodes, and past about 1.98 the curve's denominator
+  // goes through zero.
+  inline void PQToLinear(float *values, int n)
+  {
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 invM1 = _mm_set1_ps(1.0f / kPQ_m1);
+    const __m128 invM2 = _mm_set1_ps(1.0f / kPQ_m2);
+    const __m128 c1 = _mm_set1_ps(kPQ_c1);
+    const __m128 c2 = _mm_set1_ps(kPQ_c2);
+    const __m128 c3 = _mm_set1_ps(kPQ_c3);
+
+    for(int i = 0; i < n; i += 4) {
+      __m128 signal = _mm_min_ps(_mm_max_ps(_mm_load_ps(values + i), zero), one);
+      __m128 e = FastPow(signal, invM2);
+      __m128 ratio = _mm_div_ps(_mm_max_ps(_mm_sub_ps(e, c1), zero),
+                                _mm_sub_ps(c2, _mm_mul_ps(c3, e)));
+      _mm_store_ps(values + i, FastPow(ratio, invM1));
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // linear to PQ signal, the inverse EOTF, negative light is clamped to black
+  inline void LinearToPQ(float *values, int n)
+  {
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 m1 = _mm_set1_ps(kPQ_m1);
+    const __m128 m2 = _mm_set1_ps(kPQ_m2);
+    const __m128 c1 = _mm_set1_ps(kPQ_c1);
+    const __m128 c2 = _mm_set1_ps(kPQ_c2);
+    const __m128 c3 = _mm_set1_ps(kPQ_c3);
+
+    for(int i = 0; i < n; i += 4) {
+      __m128 y = FastPow(_mm_load_ps(values + i), m1);
+      __m128 ratio = _mm_div_ps(_mm_add_ps(c1, _mm_mul_ps(c2, y)),
+                                _mm_add_ps(one, _mm_mul_ps(c3, y)));
+      _mm_store_ps(values + i, FastPow(ratio, m2));
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // ARIB STD-B67 / BT.2100 HLG constants, we saturate scene light so there
+  // is no OOTF involved
+  const float kHLG_a = 0.17883277f;
+  const float kHLG_b = 0.28466892f;
+  const float kHLG_c = 0.55991073f;
+  const float kLog2e = 1.44269504f;
+  const float kLn2 = 0.693147181f;
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // HLG signal to scene linear, the inverse OETF
+  inline void HLGToLinear(float *values, int n)
+  {
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 third = _mm_set1_ps(1.0f / 3.0f);
+    const __m128 twelfth = _mm_set1_ps(1.0f / 12.0f);
+    const __m128 expScale = _mm_set1_ps(kLog2e / kHLG_a);
+    const __m128 b = _mm_set1_ps(kHLG_b);
+    const __m128 c = _mm_set1_ps(kHLG_c);
+
+    for(int i = 0; i < n; i += 4) {
+      __m128 signal = _mm_max_ps(_mm_load_ps(values + i), zero);
+      __m128 low = _mm_mul_ps(_mm_mul_ps(signal, signal), third);
+      __m128 high = _mm_mul_ps(_mm_add_ps(FastExp2(_mm_mul_ps(_mm_sub_ps(signal, c), expScale)), b), twelfth);
+      _mm_store_ps(values + i, Select(_mm_cmple_ps(signal, half), low, high));
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // scene linear to HLG signal, the OETF, negative light is clamped to black
+  inline void LinearToHLG(float *values, int n)
+  {
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 three = _mm_set1_ps(3.0f);
+    const __m128 twelve = _mm_set1_ps(12.0f);
+    const __m128 twelfth = _mm_set1_ps(1.0f / 12.0f);
+    const __m128 logScale = _mm_set1_ps(kHLG_a * kLn2);
+    const __m128 b = _mm_set1_ps(kHLG_b);
+    const __m128 c = _mm_set1_ps(kHLG_c);
+
+    for(int i = 0; i < n; i += 4) {
+      __m128 light = _mm_max_ps(_mm_load_ps(values + i), zero);
+      __m128 low = _mm_sqrt_ps(_mm_mul_ps(light, three));
+      __m128 log = FastLog2(_mm_max_ps(_mm_sub_ps(_mm_mul_ps(light, twelve), b), _mm_set1_ps(1e-30f)));
+      __m128 high = _mm_add_ps(_mm_mul_ps(log, logScale), c);
+      _mm_store_ps(values + i, Select(_mm_cmple_ps(light, twelfth), low, high));
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // decode a plane from the source's transfer function into linear light
+  inline void DecodeTransfer(float *values, int n, TransferFunction transfer)
+  {
+    switch(transfer) {
+    case eTransferCineonLog : CineonToLinear(values, n); break;
+    case eTransferPQ        : PQToLinear(values, n); break;
+    case eTransferHLG       : HLGToLinear(values, n); break;
+    default                 : break;
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // encode a plane of linear light back into the source's transfer function
+  inline void EncodeTransfer(float *values, int n, TransferFunction transfer)
+  {
+    switch(transfer) {
+    case eTransferCineonLog : LinearToCineon(values, n); break;
+    case eTransferPQ        : LinearToPQ(values, n); break;
+    case eTransferHLG       : LinearToHLG(values, n); break;
+    default                 : break;
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // scale each component around the average of R, G and B, and the whole
+  // pixel by the exposure gain, in the one pass
+  inline void Saturate(PixelChunk &chunk, float saturation, float exposure)
+  {
+    // e * ((c - a) * s + a) is c * (e * s) + a * e * (1 - s)
+    const __m128 sat = _mm_set1_ps(saturation * exposure);
+    const __m128 greyScale = _mm_set1_ps(exposure * (1.0f - saturation) / 3.0f);
+
+    for(int i = 0; i < chunk.n; i += 4) {
+      __m128 r = _mm_load_ps(chunk.r + i);
+      __m128 g = _mm_load_ps(chunk.g + i);
+      __m128 b = _mm_load_ps(chunk.b + i);
+      __m128 grey = _mm_mul_ps(_mm_add_ps(_mm_add_ps(r, g), b), greyScale);
+      _mm_store_ps(chunk.r + i, _mm_add_ps(_mm_mul_ps(r, sat), grey));
+      _mm_store_ps(chunk.g + i, _mm_add_ps(_mm_mul_ps(g, sat), grey));
+      _mm_store_ps(chunk.b + i, _mm_add_ps(_mm_mul_ps(b, sat), grey));
+    }
+  }
+
+  // how far, as a fraction of their brightness, the same pixel in two frames
+  // can differ before denoising takes it to have moved and leaves it out, and
+  // the least that counts as moved, so shadow noise doesn't
+  const float kDenoiseMotionThreshold = 0.1f;
+  const float kDenoiseMotionFloor = 0.01f;
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // the ACES reference gamut compression's constants. A channel's distance
+  // from the achromatic axis is how far below the pixel's largest channel it
+  // is, as a fraction of that, so 1 is on the gamut boundary. Past the
+  // threshold, distances are compressed so the limit lands on the boundary.
+  // The channels are red, green and blue, whose distances are how cyan,
+  // magenta and yellow the pixel is.
+  const float kGamutThreshold[3] = {0.815f, 0.803f, 0.880f};
+  const float kGamutLimit[3] = {1.147f, 1.264f, 1.312f};
+  const float kGamutPower = 1.2f;
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // pull colours out beyond the gamut boundary back in, towards the achromatic
+  // axis, leaving those well inside it alone, in linear light. Every lane
+  // works the compression out, where it applies is picked after.
+  inline void CompressGamut(PixelChunk &chunk)
+  {
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 power = _mm_set1_ps(kGamutPower);
+    const __m128 invPower = _mm_set1_ps(-1.0f / kGamutPower);
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+
+    // the scale making the compression take the limit to 1
+    __m128 threshold[3], scale[3], invScale[3];
+    for(int c = 0; c < 3; ++c) {
+      float span = kGamutLimit[c] - kGamutThreshold[c];
+      __m128 ratio = _mm_set1_ps((1.0f - kGamutThreshold[c]) / span);
+      __m128 lift = _mm_sub_ps(FastPow(ratio, _mm_set1_ps(-kGamutPower)), one);
+      threshold[c] = _mm_set1_ps(kGamutThreshold[c]);
+      scale[c] = _mm_mul_ps(_mm_set1_ps(span), FastPow(lift, invPower));
+      invScale[c] = _mm_div_ps(one, scale[c]);
+    }
+
+    float *planes[3] = {chunk.r, chunk.g, chunk.b};
+    for(int i = 0; i < chunk.n; i += 4) {
+      __m128 v[3] = {_mm_load_ps(chunk.r + i), _mm_load_ps(chunk.g + i), _mm_load_ps(chunk.b + i)};
+      __m128 achromatic = _mm_max_ps(_mm_max_ps(v[0], v[1]), v[2]);
+      __m128 magnitude = _mm_and_ps(achromatic, absMask);
+
+      // black has no distance to compress
+      __m128 hasColour = _mm_cmpgt_ps(magnitude, _mm_setzero_ps());
+      __m128 invMagnitude = _mm_div_ps(one, _mm_max_ps(magnitude, _mm_set1_ps(1e-30f)));
+
+      for(int c = 0; c < 3; ++c) {
+        __m128 distance = _mm_mul_ps(_mm_sub_ps(achromatic, v[c]), invMagnitude);
+
+        // t + s * x / (1 + x^p)^(1/p), x being how far past the threshold in units of s
+        __m128 x = _mm_mul_ps(_mm_sub_ps(distance, threshold[c]), invScale[c]);
+        __m128 knee = FastPow(_mm_add_ps(one, FastPow(x, power)), invPower);
+        __m128 compressed = _mm_add_ps(threshold[c], _mm_mul_ps(scale[c], _mm_mul_ps(x, knee)));
+
+        __m128 apply = _mm_and_ps(hasColour, _mm_cmpgt_ps(distance, threshold[c]));
+        __m128 result = _mm_sub_ps(achromatic, _mm_mul_ps(compressed, magnitude));
+        _mm_store_ps(planes[c] + i, Select(apply, result, v[c]));
+      }
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // move each pixel's chroma by the strength towards its average with the
+  // same pixel in the neighbouring frames. A neighbour's weight falls off
+  // linearly as its luma moves away from the pixel's, reaching zero at the
+  // motion threshold, so moving things don't smear colour. Luma is left as it
+  // is.
+  inline void DenoiseChroma(PixelChunk &chunk, const PixelChunk *neighbours, int nNeighbours, float strength)
+  {
+    const __m128 third = _mm_set1_ps(1.0f / 3.0f);
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 threshold = _mm_set1_ps(kDenoiseMotionThreshold);
+    const __m128 minReach = _mm_set1_ps(kDenoiseMotionFloor);
+    const __m128 amount = _mm_set1_ps(strength);
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+
+    for(int i = 0; i < chunk.n; i += 4) {
+      __m128 r = _mm_load_ps(chunk.r + i);
+      __m128 g = _mm_load_ps(chunk.g + i);
+      __m128 b = _mm_load_ps(chunk.b + i);
+      __m128 luma = _mm_mul_ps(_mm_add_ps(_mm_add_ps(r, g), b), third);
+      __m128 reach = _mm_add_ps(_mm_mul_ps(_mm_and_ps(luma, absMask), threshold), minReach);
+
+      // the pixel's own chroma, and the weighted sum of everyone's
+      __m128 cr = _mm_sub_ps(r, luma), cg = _mm_sub_ps(g, luma), cb = _mm_sub_ps(b, luma);
+      __m128 sumR = cr, sumG = cg, sumB = cb, weight = one;
+
+      for(int k = 0; k < nNeighbours; ++k) {
+        const PixelChunk &neighbour = neighbours[k];
+        __m128 nr = _mm_load_ps(neighbour.r + i);
+        __m128 ng = _mm_load_ps(neighbour.g + i);
+        __m128 nb = _mm_load_ps(neighbour.b + i);
+        __m128 nLuma = _mm_mul_ps(_mm_add_ps(_mm_add_ps(nr, ng), nb), third);
+
+        __m128 moved = _mm_div_ps(_mm_and_ps(_mm_sub_ps(nLuma, luma), absMask), reach);
+        __m128 w = _mm_max_ps(_mm_sub_ps(one, moved), _mm_setzero_ps());
+
+        sumR = _mm_add_ps(sumR, _mm_mul_ps(_mm_sub_ps(nr, nLuma), w));
+        sumG = _mm_add_ps(sumG, _mm_mul_ps(_mm_sub_ps(ng, nLuma), w));
+        sumB = _mm_add_ps(sumB, _mm_mul_ps(_mm_sub_ps(nb, nLuma), w));
+        weight = _mm_add_ps(weight, w);
+      }
+
+      __m128 scale = _mm_div_ps(one, weight);
+      cr = _mm_add_ps(cr, _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(sumR, scale), cr), amount));
+      cg = _mm_add_ps(cg, _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(sumG, scale), cg), amount));
+      cb = _mm_add_ps(cb, _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(sumB, scale), cb), amount));
+
+      _mm_store_ps(chunk.r + i, _mm_add_ps(luma, cr));
+      _mm_store_ps(chunk.g + i, _mm_add_ps(luma, cg));
+      _mm_store_ps(chunk.b + i, _mm_add_ps(luma, cb));
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // four lines' values at the same place along them, one line to a lane
+  static inline __m128 LoadLanes(const float *const lines[4], ptrdiff_t offset, bool contiguous)
+  {
+    if(contiguous) {
+      return _mm_loadu_ps(lines[0] + offset);
+    }
+    return _mm_setr_ps(lines[0][offset], lines[1][offset], lines[2][offset], lines[3][offset]);
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // box blur along the lines of a plane, four lines at once, one to a lane,
+  // keeping a running sum so the cost doesn't depend on the radius. Samples
+  // are step apart along a line and lines are stride apart, and each line is
+  // taken to carry on past its ends with its end values. A running sum's
+  // rounding depends on where it started, so for exact results it starts
+  // afresh at each block boundary, counting from the origin, the image
+  // coordinate of the lines' first samples. Each output then depends only
+  // on where it is, however the image was split up, given the source border
+  // leaves room for the sum to run in from the start of the block.
+  inline void BoxBlurLines(const float *src, float *dst, int nLines, int length, ptrdiff_t step, ptrdiff_t stride, int radius,
+                           bool exact, int origin)
+  {
+    const __m128 scale = _mm_set1_ps(1.0f / float(2 * radius + 1));
+    const int last = length - 1;
+    const int block = ExactBlurBlock(radius);
+    const int firstRestart = exact ? (block - (origin % block + block) % block) % block : length;
+    alignas(16) float lanes[4];
+
+    for(int line = 0; line < nLines; line += 4) {
+      // a ragged last group repeats its final line. Lanes can be loaded in one
+      // go when the lines sit next to each other, as columns do.
+      const float *in[4];
+      float *out[4];
+      for(int l = 0; l < 4; ++l) {
+        ptrdiff_t which = std::min(line + l, nLines - 1);
+        in[l] = src + which * stride;
+        out[l] = dst + which * stride;
+      }
+      const bool contiguous = stride == 1 && line + 4 <= nLines;
+
+      __m128 sum = _mm_setzero_ps();
+      for(int k = -radius; k <= radius; ++k) {
+        sum = _mm_add_ps(sum, LoadLanes(in, std::min(std::max(k, 0), last) * step, contiguous));
+      }
+
+      int restart = firstRestart;
+      for(int x = 0; x < length; ++x) {
+        if(x == restart) {
+          sum = _mm_setzero_ps();
+          for(int k = x - radius; k <= x + radius; ++k) {
+            sum = _mm_add_ps(sum, LoadLanes(in, std::min(std::max(k, 0), last) * step, contiguous));
+          }
+          restart += block;
+        }
+
+        __m128 value = _mm_mul_ps(sum, scale);
+        if(contiguous) {
+          _mm_storeu_ps(out[0] + x * step, value);
+        }
+        else {
+          _mm_store_ps(lanes, value);
+          for(int l = 0; l < 4; ++l) {
+            out[l][x * step] = lanes[l];
+          }
+        }
+
+        // slide the window along one
+        __m128 entering = LoadLanes(in, std::min(x + radius + 1, last) * step, contiguous);
+        __m128 leaving = LoadLanes(in, std::max(x - radius, 0) * step, contiguous);
+        sum = _mm_add_ps(sum, _mm_sub_ps(entering, leaving));
+      }
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // near gaussian blur of a plane whose bottom left is at the given image
+  // coordinates, box blurs along the rows then down the columns, leaving the
+  // result in blurred and using scratch along the way
+  inline void BlurPlane(const float *plane, float *blurred, float *scratch, int x1, int y1, int width, int height,
+                        int radius, bool exact)
+  {
+    const float *from = plane;
+    for(int pass = 0; pass < 2 * kChromaBlurPasses; ++pass) {
+      float *to = pass % 2 == 0 ? scratch : blurred;
+      if(pass < kChromaBlurPasses) {
+        BoxBlurLines(from, to, height, width, 1, width, radius, exact, x1);
+      }
+      else {
+        BoxBlurLines(from, to, width, height, width, 1, radius, exact, y1);
+      }
+      from = to;
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // per channel gain and offset, as the values come in
+  inline void ApplyLevels(PixelChunk &chunk, const Levels &levels)
+  {
+    float *planes[3] = {chunk.r, chunk.g, chunk.b};
+    for(int c = 0; c < 3; ++c) {
+      const __m128 gain = _mm_set1_ps(levels.gain[c]);
+      const __m128 offset = _mm_set1_ps(levels.offset[c]);
+      float *plane = planes[c];
+      for(int i = 0; i < chunk.n; i += 4) {
+        _mm_store_ps(plane + i, _mm_add_ps(_mm_mul_ps(_mm_load_ps(plane + i), gain), offset));
+      }
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // tetrahedral interpolation within the cell whose first corner is at base, walking
+  // from corner 000 to 111 along the axes in decreasing order of their fraction
+  static inline __m128 Tetrahedral(const float *base, const int stride[3], const float frac[3])
+  {
+    int first = 0, second = 1, third = 2;
+    if(frac[first] < frac[second]) std::swap(first, second);
+    if(frac[second] < frac[third]) std::swap(second, third);
+    if(frac[first] < frac[second]) std::swap(first, second);
+
+    const float *corner1 = base + stride[first];
+    const float *corner2 = corner1 + stride[second];
+    const float *corner3 = corner2 + stride[third];
+
+    __m128 v0 = _mm_loadu_ps(base);
+    __m128 v1 = _mm_loadu_ps(corner1);
+    __m128 v2 = _mm_loadu_ps(corner2);
+    __m128 v3 = _mm_loadu_ps(corner3);
+
+    __m128 result = _mm_add_ps(v0, _mm_mul_ps(_mm_set1_ps(frac[first]), _mm_sub_ps(v1, v0)));
+    result = _mm_add_ps(result, _mm_mul_ps(_mm_set1_ps(frac[second]), _mm_sub_ps(v2, v1)));
+    return _mm_add_ps(result, _mm_mul_ps(_mm_set1_ps(frac[third]), _mm_sub_ps(v3, v2)));
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // run a strip through a 3D LUT, input outside the LUT's domain is clamped to it
+  inline void ApplyLut(PixelChunk &chunk, const Lut3D &lut)
+  {
+    const int last = lut.size - 1;
+    const int stride[3] = {4, 4 * lut.size, 4 * lut.size * lut.size};
+    float scale[3];
+    for(int c = 0; c < 3; ++c) {
+      scale[c] = last / (lut.domainMax[c] - lut.domainMin[c]);
+    }
+
+    const float *shaper = lut.shaper.empty() ? NULL : lut.shaper.data();
+    const int shaperLast = int(lut.shaper.size()) - 1;
+
+    float *planes[3] = {chunk.r, chunk.g, chunk.b};
+    for(int i = 0; i < chunk.n; ++i) {
+      int offset = 0;
+      float frac[3];
+      for(int c = 0; c < 3; ++c) {
+        float value = shaper ? Lookup1D(shaper, shaperLast, planes[c][i]) : planes[c][i];
+        float position = (value - lut.domainMin[c]) * scale[c];
+        position = std::min(std::max(position, 0.0f), float(last));
+        int index = std::min(int(position), last - 1);
+        frac[c] = position - index;
+        offset += index * stride[c];
+      }
+
+      alignas(16) float rgba[4];
+      _mm_store_ps(rgba, Tetrahedral(lut.table + offset, stride, frac));
+      chunk.r[i] = rgba[0];
+      chunk.g[i] = rgba[1];
+      chunk.b[i] = rgba[2];
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // take a strip as it came in to linear light
+  inline void DecodeChunk(PixelChunk &chunk, const RenderSettings &settings)
+  {
+    if(settings.restoreLevels) {
+      ApplyLevels(chunk, settings.levels);
+    }
+
+    if(settings.transfer != eTransferLinear) {
+      DecodeTransfer(chunk.r, chunk.n, settings.transfer);
+      DecodeTransfer(chunk.g, chunk.n, settings.transfer);
+      DecodeTransfer(chunk.b, chunk.n, settings.transfer);
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // run a strip through the stages before saturation, which leave it in linear
+  // light, along with the same strip of each of the frames temporal denoising
+  // looks at, if it is on
+  inline void LinearizeChunk(PixelChunk &chunk, const RenderSettings &settings, PixelChunk *neighbours)
+  {
+    DecodeChunk(chunk, settings);
+
+    if(neighbours && settings.denoiseCount) {
+      for(int k = 0; k < settings.denoiseCount; ++k) {
+        DecodeChunk(neighbours[k], settings);
+      }
+      DenoiseChroma(chunk, neighbours, settings.denoiseCount, settings.denoiseStrength);
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // run a strip in linear light through saturation and the stages after it
+  inline void FinishChunk(PixelChunk &chunk, const RenderSettings &settings)
+  {
+    Saturate(chunk, settings.saturation, settings.exposure);
+
+    if(settings.gamutCompression) {
+      CompressGamut(chunk);
+    }
+
+    if(settings.transfer != eTransferLinear) {
+      EncodeTransfer(chunk.r, chunk.n, settings.transfer);
+      EncodeTransfer(chunk.g, chunk.n, settings.transfer);
+      EncodeTransfer(chunk.b, chunk.n, settings.transfer);
+    }
+
+    if(settings.lut) {
+      ApplyLut(chunk, *settings.lut);
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // run a strip through every stage of the effect
+  inline void ProcessChunk(PixelChunk &chunk, const RenderSettings &settings, PixelChunk *neighbours = NULL)
+  {
+    if(settings.bakedLut) {
+      ApplyLut(chunk, *settings.bakedLut);
+      return;
+    }
+
+    LinearizeChunk(chunk, settings, neighbours);
+    FinishChunk(chunk, settings);
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // high and low halves of the 64 bit products of four 32 bit lanes and a constant
+  static inline void MulHiLo(__m128i a, __m128i m, __m128i &hi, __m128i &lo)
+  {
+    __m128i even = _mm_mul_epu32(a, m);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), m);
+    lo = _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                            _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+    hi = _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 3, 1)),
+                            _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 3, 1)));
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Philox4x32-10 counter based random numbers for four counters at once, one
+  // to a lane. The same counter and key always give the same four words, so
+  // grain needs no state carried from one pixel to the next.
+  static inline void Philox4x32(__m128i counter[4], unsigned int key0, unsigned int key1)
+  {
+    const __m128i m0 = _mm_set1_epi32(int(0xD2511F53));
+    const __m128i m1 = _mm_set1_epi32(int(0xCD9E8D57));
+
+    for(int round = 0; round < 10; ++round) {
+      __m128i hi0, lo0, hi1, lo1;
+      MulHiLo(counter[0], m0, hi0, lo0);
+      MulHiLo(counter[2], m1, hi1, lo1);
+      __m128i k0 = _mm_set1_epi32(int(key0)), k1 = _mm_set1_epi32(int(key1));
+      counter[0] = _mm_xor_si128(_mm_xor_si128(hi1, counter[1]), k0);
+      counter[1] = lo1;
+      counter[2] = _mm_xor_si128(_mm_xor_si128(hi0, counter[3]), k1);
+      counter[3] = lo0;
+      key0 += 0x9E3779B9u;
+      key1 += 0xBB67AE85u;
+    }
+  }
+
+  // second key word of the grain generator, the seed being the first
+  const unsigned int kGrainKey = 0x5851F42Du;
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // add grain to a finished strip starting at x, y. Each pixel's grain comes
+  // from one Philox draw keyed on the seed, with its position and the frame
+  // as the counter, so it is the same however the frame is split up. The
+  // draw's four words give eight 16 bit uniforms, pairs of which are summed
+  // for a triangular distribution, one pair shared by the channels and one
+  // for each of them.
+  inline void AddGrain(PixelChunk &chunk, const RenderSettings &settings, int x, int y)
+  {
+    // a triangular distribution has a standard deviation of 1/sqrt(6)
+    const float scale = settings.grainAmount * 2.44948974f / 65536.0f;
+    const __m128 mono = _mm_set1_ps(scale * sqrtf(1.0f - settings.grainColour));
+    const __m128 colour = _mm_set1_ps(scale * sqrtf(settings.grainColour));
+    const __m128 offset = _mm_set1_ps(65535.0f);
+    const __m128i low = _mm_set1_epi32(0xFFFF);
+
+    // the frame and how far through it, for fielded or motion blurred renders
+    double frame = floor(settings.grainTime);
+    const __m128i frameWord = _mm_set1_epi32(int((long long) frame));
+    const __m128i fractionWord = _mm_set1_epi32(int((settings.grainTime - frame) * 65536.0));
+    const __m128i row = _mm_set1_epi32(y);
+
+    float *planes[3] = {chunk.r, chunk.g, chunk.b};
+    for(int i = 0; i < chunk.n; i += 4) {
+      __m128i counter[4];
+      counter[0] = _mm_add_epi32(_mm_set1_epi32(x + i), _mm_setr_epi32(0, 1, 2, 3));
+      counter[1] = row;
+      counter[2] = frameWord;
+      counter[3] = fractionWord;
+      Philox4x32(counter, (unsigned int) settings.grainSeed, kGrainKey);
+
+      // each word's halves summed, less the mean, the shared and the per
+      // channel grain mixed so their variances add up to the amount's
+      __m128 noise[4];
+      for(int w = 0; w < 4; ++w) {
+        __m128 a = _mm_cvtepi32_ps(_mm_and_si128(counter[w], low));
+        __m128 b = _mm_cvtepi32_ps(_mm_srli_epi32(counter[w], 16));
+        noise[w] = _mm_sub_ps(_mm_add_ps(a, b), offset);
+      }
+
+      __m128 shared = _mm_mul_ps(noise[0], mono);
+      for(int c = 0; c < 3; ++c) {
+        __m128 grain = _mm_add_ps(shared, _mm_mul_ps(noise[c + 1], colour));
+        _mm_store_ps(planes[c] + i, _mm_add_ps(_mm_load_ps(planes[c] + i), grain));
+      }
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // lattice sizes for baked tables, 10 bit and deeper content in 16 bit images
+  // needs the finer one to stay within a code value
+  const int kBakedLutSize8Bit = 33;
+  const int kBakedLutSize16Bit = 65;
+
+  // entries in a baked table's shaper
+  const int kShaperSize = 4096;
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // evaluate the whole color transform over a lattice covering [0, 1] and store
+  // that as a 3D LUT, so a render can go through one lookup instead of every stage
+  inline std::shared_ptr<const Lut3D> BakeLut(const RenderSettings &settings, int size)
+  {
+    std::shared_ptr<Lut3D> baked(new Lut3D);
+    baked->size = size;
+    float *table = baked->allocate();
+
+    // linear light has most of what the eye cares about near black, so space
+    // the lattice evenly in sqrt(x) rather than in x
+    const bool shaped = settings.transfer == eTransferLinear;
+    if(shaped) {
+      baked->shaper.resize(kShaperSize);
+      for(int i = 0; i < kShaperSize; ++i) {
+        baked->shaper[i] = sqrtf(i / float(kShaperSize - 1));
+      }
+    }
+
+    const int entries = baked->nEntries();
+    const float step = 1.0f / (size - 1);
+    PixelChunk chunk;
+    for(int start = 0; start < entries; start += PixelChunk::kSize) {
+      chunk.count = std::min(int(PixelChunk::kSize), entries - start);
+      chunk.n = (chunk.count + 3) & ~3;
+      chunk.begin = 0;
+      chunk.end = chunk.count;
+
+      for(int i = 0; i < chunk.n; ++i) {
+        int entry = std::min(start + i, entries - 1);
+        chunk.r[i] = (entry % size) * step;
+        chunk.g[i] = (entry / size % size) * step;
+        chunk.b[i] = (entry / (size * size)) * step;
+        chunk.mask[i] = 1.0f;
+        if(shaped) {
+          chunk.r[i] *= chunk.r[i];
+          chunk.g[i] *= chunk.g[i];
+          chunk.b[i] *= chunk.b[i];
+        }
+      }
+
+      ProcessChunk(chunk, settings);
+
+      float *entry = &table[size_t(start) * 4];
+      for(int i = 0; i < chunk.count; ++i, entry += 4) {
+        entry[0] = chunk.r[i];
+        entry[1] = chunk.g[i];
+        entry[2] = chunk.b[i];
+      }
+    }
+
+    return baked;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // the size of table to bake the settings into for images of the given
+  // depth, 0 to go through the full chain. 8 and 16 bit sources only have so
+  // many values, so they can go through a table with the whole color
+  // transform baked in. 8 bit images with a LUT always do, it is interpolated
+  // anyway. Temporal denoising and chroma detail depend on more than a
+  // pixel's color, so they can't be baked into the table.
+  inline int BakedLutSize(const RenderSettings &settings, int bytesPerComponent)
+  {
+    int size = 0;
+    if(bytesPerComponent == 1 && (settings.bake || settings.lut)) {
+      size = kBakedLutSize8Bit;
+    }
+    else if(bytesPerComponent == 2 && settings.bake) {
+      size = kBakedLutSize16Bit;
+    }
+    if(!size || !IsPointwise(settings)) {
+      return 0;
+    }
+    return std::max(size, settings.lut ? settings.lut->size : 0);
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // process a window when chroma detail is on. It looks at the pixels around
+  // each one, so the window and the border round it are first taken to linear
+  // light and split into luma and two chroma planes, green's chroma being
+  // what the other two leave. The chroma planes are blurred, and the window
+  // put back together from them and finished a strip at a time.
+  template <class T, int MAX>
+  void ChromaDetailProcessing(const RenderSettings &settings,
+                              const AbortCheck &aborted,
+                              ImageView &src,
+                              ImageView &mask,
+                              ImageView &output,
+                              OfxRectI renderWindow,
+                              std::vector<std::unique_ptr<ImageView> > &frames)
+  {
+    // as much of the window and its border as the source has
+    const OfxRectI &bounds = src.bounds();
+    OfxRectI area = GrowRect(renderWindow, SourceBorder(settings));
+    area.x1 = std::max(area.x1, bounds.x1);
+    area.y1 = std::max(area.y1, bounds.y1);
+    area.x2 = std::max(std::min(area.x2, bounds.x2), area.x1);
+    area.y2 = std::max(std::min(area.y2, bounds.y2), area.y1);
+    const int width = area.x2 - area.x1;
+    const int height = area.y2 - area.y1;
+
+    size_t size = size_t(width) * height;
+    std::vector<float> luma(size), chromaR(size), chromaB(size), blurred(size), scratch(size);
+
+    PixelChunk chunk;
+    PixelChunk neighbours[2 * kMaxDenoiseRadius];
+    ImageView noMask;
+
+    for(int y = area.y1; y < area.y2; y++) {
+      if(y % 20 == 0 && Aborted(aborted)) return;
+
+      for(int x = area.x1; x < area.x2; x += PixelChunk::kSize) {
+        int count = std::min(int(PixelChunk::kSize), area.x2 - x);
+        LoadChunk<T, MAX>(chunk, src, noMask, x, y, count);
+        for(int k = 0; k < settings.denoiseCount; ++k) {
+          LoadChunk<T, MAX>(neighbours[k], *frames[k], noMask, x, y, count);
+        }
+        LinearizeChunk(chunk, settings, neighbours);
+
+        size_t offset = size_t(y - area.y1) * width + (x - area.x1);
+        for(int i = 0; i < count; ++i) {
+          float l = (chunk.r[i] + chunk.g[i] + chunk.b[i]) * (1.0f / 3.0f);
+          luma[offset + i] = l;
+          chromaR[offset + i] = chunk.r[i] - l;
+          chromaB[offset + i] = chunk.b[i] - l;
+        }
+      }
+    }
+
+    // move each chroma plane away from its blur to sharpen, towards it to soften
+    float *planes[2] = {chromaR.data(), chromaB.data()};
+    for(int c = 0; c < 2 && size; ++c) {
+      BlurPlane(planes[c], blurred.data(), scratch.data(), area.x1, area.y1, width, height, settings.chromaRadius,
+                settings.deterministic);
+      float *plane = planes[c];
+      const float *blur = blurred.data();
+      for(size_t i = 0; i < size; ++i) {
+        plane[i] += (plane[i] - blur[i]) * settings.chromaDetail;
+      }
+    }
+
+    for(int y = renderWindow.y1; y < renderWindow.y2; y++) {
+      if(y % 20 == 0 && Aborted(aborted)) return;
+
+      for(int x = renderWindow.x1; x < renderWindow.x2; x += PixelChunk::kSize) {
+        int count = std::min(int(PixelChunk::kSize), renderWindow.x2 - x);
+
+        // load the strip for its mask and for where the source has pixels,
+        // which are all in the area
+        LoadChunk<T, MAX>(chunk, src, mask, x, y, count);
+        if(chunk.begin < chunk.end) {
+          size_t offset = size_t(y - area.y1) * width + (x - area.x1);
+          for(int i = chunk.begin; i < chunk.end; ++i) {
+            float l = luma[offset + i], cr = chromaR[offset + i], cb = chromaB[offset + i];
+            chunk.r[i] = l + cr;
+            chunk.g[i] = l - cr - cb;
+            chunk.b[i] = l + cb;
+          }
+        }
+        FinishChunk(chunk, settings);
+        if(settings.grainAmount > 0) {
+          AddGrain(chunk, settings, x, y);
+        }
+        StoreChunk<T, MAX>(chunk, src, output, x, y);
+        if(settings.scopes) {
+          AccumulateScopes<T, MAX>(*settings.scopes, output, x, y, count);
+        }
+      }
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // bin a strip of the output for the scopes, read back as it was written so
+  // the mask and the rounding are in it, while it is still in cache
+  template <class T, int MAX>
+  void AccumulateScopes(ScopeBins &scopes, ImageView &output, int x, int y, int count)
+  {
+    const __m128 kr = _mm_set1_ps(0.2126f);
+    const __m128 kg = _mm_set1_ps(0.7152f);
+    const __m128 kb = _mm_set1_ps(0.0722f);
+    const __m128 cbScale = _mm_set1_ps(kVectorscopeSize / 1.8556f);
+    const __m128 crScale = _mm_set1_ps(kVectorscopeSize / 1.5748f);
+    const __m128 centre = _mm_set1_ps(kVectorscopeSize * 0.5f);
+    const __m128 lastScopeBin = _mm_set1_ps(float(kVectorscopeSize - 1));
+    const __m128 histogramScale = _mm_set1_ps(float(kScopeHistogramBins));
+    const __m128 lastHistogramBin = _mm_set1_ps(float(kScopeHistogramBins - 1));
+
+    PixelChunk chunk;
+    ImageView noMask;
+    LoadChunk<T, MAX>(chunk, output, noMask, x, y, count);
+
+    alignas(16) int cbBins[PixelChunk::kSize];
+    alignas(16) int crBins[PixelChunk::kSize];
+    alignas(16) int bins[3][PixelChunk::kSize];
+    const float *planes[3] = {chunk.r, chunk.g, chunk.b};
+    for(int i = 0; i < chunk.n; i += 4) {
+      __m128 r = _mm_load_ps(chunk.r + i);
+      __m128 g = _mm_load_ps(chunk.g + i);
+      __m128 b = _mm_load_ps(chunk.b + i);
+      __m128 luma = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, kr), _mm_mul_ps(g, kg)), _mm_mul_ps(b, kb));
+      __m128 cb = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(b, luma), cbScale), centre);
+      __m128 cr = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(r, luma), crScale), centre);
+      cb = _mm_min_ps(_mm_max_ps(cb, _mm_setzero_ps()), lastScopeBin);
+      cr = _mm_min_ps(_mm_max_ps(cr, _mm_setzero_ps()), lastScopeBin);
+      _mm_store_si128((__m128i *) (cbBins + i), _mm_cvttps_epi32(cb));
+      _mm_store_si128((__m128i *) (crBins + i), _mm_cvttps_epi32(cr));
+
+      for(int c = 0; c < 3; ++c) {
+        __m128 bin = _mm_mul_ps(_mm_load_ps(planes[c] + i), histogramScale);
+        bin = _mm_min_ps(_mm_max_ps(bin, _mm_setzero_ps()), lastHistogramBin);
+        _mm_store_si128((__m128i *) (bins[c] + i), _mm_cvttps_epi32(bin));
+      }
+    }
+
+    for(int i = chunk.begin; i < chunk.end; ++i) {
+      ++scopes.vectorscope[crBins[i]][cbBins[i]];
+      ++scopes.histogram[0][bins[0][i]];
+      ++scopes.histogram[1][bins[1][i]];
+      ++scopes.histogram[2][bins[2][i]];
+    }
+    scopes.count += chunk.end - chunk.begin;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // bin a window of the output for the scopes, for when it came from a cache
+  // rather than the kernel
+  inline void AccumulateScopeWindow(ScopeBins &scopes, ImageView &output, OfxRectI window)
+  {
+    for(int y = window.y1; y < window.y2; y++) {
+      for(int x = window.x1; x < window.x2; x += PixelChunk::kSize) {
+        int count = std::min(int(PixelChunk::kSize), window.x2 - x);
+        if(output.bytesPerComponent() == 1) {
+          AccumulateScopes<unsigned char, 255>(scopes, output, x, y, count);
+        }
+        else if(output.bytesPerComponent() == 2) {
+          AccumulateScopes<unsigned short, 65535>(scopes, output, x, y, count);
+        }
+        else {
+          AccumulateScopes<float, 1>(scopes, output, x, y, count);
+        }
+      }
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // iterate over our pixels and process them
+  template <class T, int MAX>
+  void PixelProcessing(const RenderSettings &settings,
+                       const AbortCheck &aborted,
+                       ImageView &src,
+                       ImageView &mask,
+                       ImageView &output,
+                       OfxRectI renderWindow)
+  {
+    // the kernel is fused, each strip goes through every stage while it is in cache
+    PixelChunk chunk;
+
+    // the frames temporal denoising looks at, wrapped up like the source
+    PixelChunk neighbours[2 * kMaxDenoiseRadius];
+    std::vector<std::unique_ptr<ImageView> > frames;
+    ImageView noMask;
+    for(int k = 0; k < settings.denoiseCount; ++k) {
+      const SourceFrame &frame = *settings.denoiseFrames[k];
+      frames.emplace_back(new ImageView((void *) frame.pixels.data(), frame.bounds, frame.rowBytes,
+                                        frame.nComponents, frame.bytesPerComponent));
+    }
+
+    if(settings.chromaDetail != 0 && !settings.bakedLut) {
+      ChromaDetailProcessing<T, MAX>(settings, aborted, src, mask, output, renderWindow, frames);
+      return;
+    }
+
+    for(int y = renderWindow.y1; y < renderWindow.y2; y++) {
+      if(y % 20 == 0 && Aborted(aborted)) break;
+
+      for(int x = renderWindow.x1; x < renderWindow.x2; x += PixelChunk::kSize) {
+        int count = std::min(int(PixelChunk::kSize), renderWindow.x2 - x);
+        LoadChunk<T, MAX>(chunk, src, mask, x, y, count);
+        for(int k = 0; k < settings.denoiseCount; ++k) {
+          LoadChunk<T, MAX>(neighbours[k], *frames[k], noMask, x, y, count);
+        }
+        ProcessChunk(chunk, settings, neighbours);
+        if(settings.grainAmount > 0) {
+          AddGrain(chunk, settings, x, y);
+        }
+        StoreChunk<T, MAX>(chunk, src, output, x, y);
+        if(settings.scopes) {
+          AccumulateScopes<T, MAX>(*settings.scopes, output, x, y, count);
+        }
+      }
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // process a window of pixels depending on the data type
+  inline void RenderWindow(const RenderSettings &settings,
+                           const AbortCheck &aborted,
+                           ImageView &src,
+                           ImageView &mask,
+                           ImageView &output,
+                           OfxRectI renderWindow)
+  {
+    if(output.bytesPerComponent() == 1) {
+      PixelProcessing<unsigned char, 255>(settings,
+                                          aborted,
+                                          src,
+                                          mask,
+                                          output,
+                                          renderWindow);
+    }
+    else if(output.bytesPerComponent() == 2) {
+      PixelProcessing<unsigned short, 65535>(settings,
+                                             aborted,
+                                             src,
+                                             mask,
+                                             output,
+                                             renderWindow);
+    }
+    else if(output.bytesPerComponent() == 4) {
+      PixelProcessing<float, 1>(settings,
+                                aborted,
+                                src,
+                                mask,
+                                output,
+                                renderWindow);
+    }
+    else {
+      throw " bad data type!";
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // a NUMA node and the processors on it
+  struct NumaNode {
+    int node;                 // the system's number for it, -1 for the whole machine
+    GROUP_AFFINITY affinity;  // its processors, unused for the whole machine
+    unsigned int nProcessors;
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // the machine's NUMA nodes that have processors. One without NUMA, or that
+  // won't say, looks like a single node covering the whole machine, which
+  // nothing is pinned to. Only a node's processors in its primary group are
+  // counted, as that is all the system tells us about.
+  inline std::vector<NumaNode> NumaNodes()
+  {
+    std::vector<NumaNode> nodes;
+    ULONG highest = 0;
+    if(GetNumaHighestNodeNumber(&highest) && highest > 0) {
+      for(ULONG n = 0; n <= highest; ++n) {
+        NumaNode node;
+        memset(&node, 0, sizeof(node));
+        node.node = int(n);
+        if(GetNumaNodeProcessorMaskEx(USHORT(n), &node.affinity) && node.affinity.Mask) {
+          node.nProcessors = (unsigned int) std::popcount((unsigned long long) node.affinity.Mask);
+          nodes.push_back(node);
+        }
+      }
+    }
+
+    if(nodes.size() < 2) {
+      NumaNode machine;
+      memset(&machine, 0, sizeof(machine));
+      machine.node = -1;
+      machine.nProcessors = std::max(std::thread::hardware_concurrency(), 1u);
+      nodes.assign(1, machine);
+    }
+    return nodes;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // pixel memory placed on a NUMA node, so the threads there that render into
+  // or out of it do so at local speed. With no node, or if the system won't
+  // place it, the pages land wherever they are first written, as usual.
+  class NodeBuffer {
+  public :
+    NodeBuffer(size_t bytes, int node);
+    ~NodeBuffer();
+
+    void *data() const { return data_; }
+    size_t size() const { return size_; }
+
+    // the node the memory was asked for on, -1 for anywhere
+    int node() const { return node_; }
+
+  private :
+    NodeBuffer(const NodeBuffer &);
+    NodeBuffer &operator=(const NodeBuffer &);
+
+    void *data_;
+    size_t size_;
+    int node_;
+  };
+
+  inline NodeBuffer::NodeBuffer(size_t bytes, int node)
+    : data_(NULL)
+    , size_(bytes)
+    , node_(node)
+  {
+    if(node >= 0) {
+      data_ = VirtualAllocExNuma(GetCurrentProcess(), NULL, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE,
+                                 DWORD(node));
+    }
+    if(!data_) {
+      data_ = VirtualAlloc(NULL, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    }
+    if(!data_) {
+      throw std::bad_alloc();
+    }
+  }
+
+  inline NodeBuffer::~NodeBuffer()
+  {
+    VirtualFree(data_, 0, MEM_RELEASE);
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // threads to render tiles on, for callers without a host to do it. Each job's
+  // tiles are dealt out in runs to the threads' queues, so neighbouring tiles
+  // go to the same thread. A thread works through its own queue from the
+  // front, and when it runs dry takes half of what is left at the back of
+  // another's, so threads that get cheap tiles, masked off or flat ones say,
+  // help out those that get dear ones.
+  //
+  // The threads are pinned to NUMA nodes. A pool for the whole machine spreads
+  // them over every node, in blocks so neighbouring tiles stay on one node,
+  // and steals from threads on its own node before going further afield. The
+  // thread calling run is one of them. A pool for one node keeps every thread
+  // on it, and the caller, being who knows where, only waits.
+  class TilePool {
+  public :
+    // start the threads, as many as the machine or the node has processors if
+    // 0. A node the machine doesn't have gets a pool for the whole machine.
+    explicit TilePool(unsigned int nThreads = 0, int node = -1);
+
+    // wait for the threads to finish
+    ~TilePool();
+
+    // how many threads work on a job, the caller's included
+    unsigned int size() const { return (unsigned int) queues_.size(); }
+
+    // what is done to each tile, given the index of the window it is from and
+    // of the thread it is on
+    typedef std::function<void(const OfxRectI &, unsigned int, unsigned int)> TileWork;
+
+    // split the windows into tiles of the given size and call work on each,
+    // returning once they are all done. The windows' tiles are all in the one
+    // job, so threads that finish with one window go straight on to the next.
+    // Only one job runs at a time, other callers wait. If any of the work
+    // throws, the first exception is thrown on from here.
+    void run(const std::vector<OfxRectI> &windows, int tileWidth, int tileHeight, const TileWork &work);
+
+    // the same for one window, work being given the index of the thread
+    void run(const OfxRectI &window, int tileWidth, int tileHeight,
+             const std::function<void(const OfxRectI &, unsigned int)> &work);
+
+  protected :
+    // a tile and the window it is from
+    struct Tile {
+      OfxRectI rect;
+      unsigned int window;
+    };
+
+    // each queue on its own cache lines, so threads don't fight over them
+    struct alignas(64) Queue {
+      std::mutex mutex;
+      std::deque<Tile> tiles;
+    };
+
+    bool next(unsigned int thread, Tile &tile);
+    bool steal(unsigned int thread);
+    void work(unsigned int thread);
+    void threadMain(unsigned int thread, NumaNode home);
+
+    std::vector<std::unique_ptr<Queue> > queues_;
+    std::vector<std::thread> threads_;
+
+    // whether the thread calling run is thread 0, and the order each thread
+    // looks at the others' queues in when stealing, those on its node first
+    bool callerWorks_;
+    std::vector<std::vector<unsigned int> > victims_;
+
+    // a job is handed to the threads by bumping the generation, each thread
+    // says it is done by dropping the busy count
+    std::mutex jobMutex_;
+    std::mutex mutex_;
+    std::condition_variable start_;
+    std::condition_variable done_;
+    const TileWork *job_;
+    unsigned long long generation_;
+    unsigned int busy_;
+    bool stopping_;
+    std::exception_ptr error_;
+  };
+
+  inline TilePool::TilePool(unsigned int nThreads, int node)
+    : callerWorks_(true)
+    , job_(NULL)
+    , generation_(0)
+    , busy_(0)
+    , stopping_(false)
+  {
+    std::vector<NumaNode> nodes = NumaNodes();
+    const NumaNode *only = NULL;
+    for(size_t n = 0; n < nodes.size(); ++n) {
+      if(node >= 0 && nodes[n].node == node) {
+        only = &nodes[n];
+      }
+    }
+    callerWorks_ = only == NULL;
+
+    if(nThreads == 0) {
+      nThreads = only ? only->nProcessors : std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    // which node each thread lives on
+    std::vector<const NumaNode *> homes(nThreads);
+    for(unsigned int t = 0; t < nThreads; ++t) {
+      homes[t] = only ? only : &nodes[size_t(t) * nodes.size() / nThreads];
+      queues_.emplace_back(new Queue);
+    }
+
+    victims_.resize(nThreads);
+    for(unsigned int t = 0; t < nThreads; ++t) {
+      for(int local = 1; local >= 0; --local) {
+        for(unsigned int i = 1; i < nThreads; ++i) {
+          unsigned int victim = (t + i) % nThreads;
+          if((homes[victim] == homes[t]) == bool(local)) {
+            victims_[t].push_back(victim);
+          }
+        }
+      }
+    }
+
+    for(unsigned int t = callerWorks_ ? 1 : 0; t < nThreads; ++t) {
+      threads_.emplace_back(&TilePool::threadMain, this, t, *homes[t]);
+    }
+  }
+
+  inline TilePool::~TilePool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    start_.notify_all();
+    for(size_t t = 0; t < threads_.size(); ++t) {
+      threads_[t].join();
+    }
+  }
+
+  inline void TilePool::run(const OfxRectI &window, int tileWidth, int tileHeight,
+                            const std::function<void(const OfxRectI &, unsigned int)> &work)
+  {
+    run(std::vector<OfxRectI>(1, window), tileWidth, tileHeight,
+        [&work](const OfxRectI &tile, unsigned int, unsigned int thread) { work(tile, thread); });
+  }
+
+  inline void TilePool::run(const std::vector<OfxRectI> &windows, int tileWidth, int tileHeight, const TileWork &work)
+  {
+    std::lock_guard<std::mutex> jobLock(jobMutex_);
+
+    std::vector<Tile> tiles;
+    for(size_t w = 0; w < windows.size(); ++w) {
+      const OfxRectI &window = windows[w];
+      for(int y = window.y1; y < window.y2; y += tileHeight) {
+        for(int x = window.x1; x < window.x2; x += tileWidth) {
+          Tile tile;
+          tile.rect.x1 = x;
+          tile.rect.y1 = y;
+          tile.rect.x2 = std::min(x + tileWidth, window.x2);
+          tile.rect.y2 = std::min(y + tileHeight, window.y2);
+          tile.window = (unsigned int) w;
+          tiles.push_back(tile);
+        }
+      }
+    }
+    if(tiles.empty()) {
+      return;
+    }
+
+    // deal the tiles out in runs, no thread can have started on them yet
+    const size_t nQueues = queues_.size();
+    for(size_t q = 0; q < nQueues; ++q) {
+      queues_[q]->tiles.assign(tiles.begin() + tiles.size() * q / nQueues,
+                               tiles.begin() + tiles.size() * (q + 1) / nQueues);
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      job_ = &work;
+      error_ = std::exception_ptr();
+      busy_ = (unsigned int) threads_.size();
+      ++generation_;
+    }
+    start_.notify_all();
+
+    if(callerWorks_) {
+      this->work(0);
+    }
+
+    std::exception_ptr error;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      done_.wait(lock, [this]() { return busy_ == 0; });
+      job_ = NULL;
+      error = error_;
+    }
+    if(error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+  // the next tile from the thread's own queue
+  inline bool TilePool::next(unsigned int thread, Tile &tile)
+  {
+    Queue &queue = *queues_[thread];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if(queue.tiles.empty()) {
+      return false;
+    }
+    tile = queue.tiles.front();
+    queue.tiles.pop_front();
+    return true;
+  }
+
+  // move half of the first other queue with anything in it to the thread's
+  // own, looking on its own node first, and at the ones after it first so
+  // thieves spread out
+  inline bool TilePool::steal(unsigned int thread)
+  {
+    const std::vector<unsigned int> &victims = victims_[thread];
+    std::vector<Tile> stolen;
+    for(size_t i = 0; i < victims.size() && stolen.empty(); ++i) {
+      Queue &victim = *queues_[victims[i]];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      size_t count = (victim.tiles.size() + 1) / 2;
+      stolen.assign(victim.tiles.end() - count, victim.tiles.end());
+      victim.tiles.erase(victim.tiles.end() - count, victim.tiles.end());
+    }
+    if(stolen.empty()) {
+      return false;
+    }
+
+    Queue &queue = *queues_[thread];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.tiles.insert(queue.tiles.end(), stolen.begin(), stolen.end());
+    return true;
+  }
+
+  // do tiles until there are none left anywhere. Tiles only ever move between
+  // queues, so once a thread finds them all empty it can stop, any in the
+  // middle of being stolen will be done by the thief.
+  inline void TilePool::work(unsigned int thread)
+  {
+    Tile tile;
+    for(;;) {
+      if(!next(thread, tile)) {
+        if(steal(thread)) {
+          continue;
+        }
+        return;
+      }
+
+      try {
+        (*job_)(tile.rect, tile.window, thread);
+      }
+      catch(...) {
+        // give up on the job, leaving whatever is queued to be thrown away
+        std::lock_guard<std::mutex> lock(mutex_);
+        if(!error_) {
+          error_ = std::current_exception();
+        }
+        for(size_t q = 0; q < queues_.size(); ++q) {
+          std::lock_guard<std::mutex> queueLock(queues_[q]->mutex);
+          queues_[q]->tiles.clear();
+        }
+        return;
+      }
+    }
+  }
+
+  inline void TilePool::threadMain(unsigned int thread, NumaNode home)
+  {
+    if(home.node >= 0) {
+      SetThreadGroupAffinity(GetCurrentThread(), &home.affinity, NULL);
+    }
+
+    unsigned long long generation = 0;
+    for(;;) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        start_.wait(lock, [&]() { return stopping_ || generation_ != generation; });
+        if(stopping_) {
+          return;
+        }
+        generation = generation_;
+      }
+
+      work(thread);
+
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        --busy_;
+      }
+      done_.notify_one();
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // a pool for each NUMA node, so a frame whose memory is on a node can be
+  // rendered by that node's threads alone, and frames on different nodes at
+  // the same time
+  class NodePools {
+  public :
+    // start a pool on each node, with all of its processors
+    NodePools();
+
+    // how many nodes there are, and so pools
+    unsigned int size() const { return (unsigned int) pools_.size(); }
+
+    // the system's number for the node a pool is on, to put buffers there
+    int node(unsigned int index) const { return nodes_[index]; }
+
+    TilePool &pool(unsigned int index) { return *pools_[index]; }
+
+    // the pool on the node a buffer is on, the first if it is on none
+    TilePool &poolFor(const NodeBuffer &buffer);
+
+  private :
+    std::vector<int> nodes_;
+    std::vector<std::unique_ptr<TilePool> > pools_;
+  };
+
+  inline NodePools::NodePools()
+  {
+    std::vector<NumaNode> nodes = NumaNodes();
+    for(size_t n = 0; n < nodes.size(); ++n) {
+      nodes_.push_back(nodes[n].node);
+      pools_.emplace_back(new TilePool(0, nodes[n].node));
+    }
+  }
+
+  inline TilePool &NodePools::poolFor(const NodeBuffer &buffer)
+  {
+    for(size_t n = 0; n < nodes_.size(); ++n) {
+      if(nodes_[n] == buffer.node()) {
+        return *pools_[n];
+      }
+    }
+    return *pools_[0];
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // the most bytes of source a tile should cover, so it and the output it
+  // renders to stay in a core's share of the cache
+  const int kTileBytes = 128 * 1024;
+
+  // the fewest tiles a job on a pool is split into for each of its threads,
+  // so they all have work and can even it out between them
+  const int kTilesPerThread = 4;
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // how many tiles of the given size the windows make
+  inline unsigned long long TileCount(const std::vector<OfxRectI> &windows, int tileWidth, int tileHeight)
+  {
+    unsigned long long count = 0;
+    for(size_t w = 0; w < windows.size(); ++w) {
+      const OfxRectI &window = windows[w];
+      if(window.x2 > window.x1 && window.y2 > window.y1) {
+        count += (unsigned long long)((window.x2 - window.x1 + tileWidth - 1) / tileWidth) *
+                 (unsigned long long)((window.y2 - window.y1 + tileHeight - 1) / tileHeight);
+      }
+    }
+    return count;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // the size of the tiles to render windows in on a pool. They are a strip
+  // wide and as tall as fits the cache, and at least eight times the border
+  // across, so that rendering the border over again for each one is cheap.
+  // Unless that leaves too few to go round the threads, when they are halved,
+  // the longer side first, until there are enough, as rendering more of the
+  // border costs less than threads sitting idle.
+  inline void PoolTileSize(const RenderSettings &settings, int bytesPerPixel, const std::vector<OfxRectI> &windows,
+                           unsigned int nThreads, int &tileWidth, int &tileHeight)
+  {
+    int border = SourceBorder(settings);
+    tileWidth = PixelChunk::kSize;
+    while(tileWidth < 8 * border) {
+      tileWidth += PixelChunk::kSize;
+    }
+    tileHeight = std::max(kTileBytes / (tileWidth * std::max(bytesPerPixel, 1)), std::max(8 * border, 4));
+
+    const int kMinTileWidth = 64, kMinTileHeight = 4;
+    unsigned long long wanted = (unsigned long long) kTilesPerThread * nThreads;
+    while(nThreads > 1 && TileCount(windows, tileWidth, tileHeight) < wanted) {
+      if(tileWidth > kMinTileWidth && (tileWidth >= tileHeight || tileHeight <= kMinTileHeight)) {
+        tileWidth = std::max(tileWidth / 2, kMinTileWidth);
+      }
+      else if(tileHeight > kMinTileHeight) {
+        tileHeight = std::max(tileHeight / 2, kMinTileHeight);
+      }
+      else {
+        break;
+      }
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // render a window of an image on a pool's threads, a tile at a time. The
+  // settings are used as they are, so whatever the plugin's render fills in,
+  // the levels, the exposure and any frames for denoising, has to be filled in
+  // already. If there are scopes, each thread bins into its own and they are
+  // added up at the end. The abort check may be called on any of the threads.
+  inline void ProcessImage(const RenderSettings &settings,
+                           ImageView &src,
+                           ImageView &mask,
+                           ImageView &output,
+                           OfxRectI renderWindow,
+                           TilePool &pool,
+                           const AbortCheck &aborted = AbortCheck())
+  {
+    std::vector<ScopeBins> scopes(settings.scopes ? pool.size() : 0);
+    if(!scopes.empty()) {
+      memset(scopes.data(), 0, scopes.size() * sizeof(ScopeBins));
+    }
+
+    int tileWidth, tileHeight;
+    PoolTileSize(settings, output.bytesPerPixel(), std::vector<OfxRectI>(1, renderWindow), pool.size(),
+                 tileWidth, tileHeight);
+
+    pool.run(renderWindow, tileWidth, tileHeight, [&](const OfxRectI &tile, unsigned int thread) {
+      if(Aborted(aborted)) {
+        return;
+      }
+
+      // the floating point mode belongs to the thread, not the caller
+      FloatModeGuard floatMode(settings.deterministic);
+
+      if(scopes.empty()) {
+        RenderWindow(settings, aborted, src, mask, output, tile);
+      }
+      else {
+        RenderSettings threadSettings = settings;
+        threadSettings.scopes = &scopes[thread];
+        RenderWindow(threadSettings, aborted, src, mask, output, tile);
+      }
+    });
+
+    for(size_t t = 0; t < scopes.size(); ++t) {
+      for(int v = 0; v < kVectorscopeSize; ++v) {
+        for(int u = 0; u < kVectorscopeSize; ++u) {
+          settings.scopes->vectorscope[v][u] += scopes[t].vectorscope[v][u];
+        }
+      }
+      for(int c = 0; c < 3; ++c) {
+        for(int bin = 0; bin < kScopeHistogramBins; ++bin) {
+          settings.scopes->histogram[c][bin] += scopes[t].histogram[c][bin];
+        }
+      }
+      settings.scopes->count += scopes[t].count;
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // a frame to render in a batch. The time is what grain is keyed on, and the
+  // node is the NUMA node the frame's memory is on, if it was put on one. An
+  // empty window renders all of the output. If the scopes are set, the
+  // frame's are added to them.
+  struct FrameView {
+    ImageView source;
+    ImageView mask;
+    ImageView output;
+    OfxRectI window;
+    OfxTime time;
+    int node;
+    ScopeBins *scopes;
+
+    FrameView()
+      : time(0)
+      , node(-1)
+      , scopes(NULL)
+    {
+      window.x1 = window.y1 = window.x2 = window.y2 = 0;
+    }
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // renders many frames with the same settings, for batch tools and libraries.
+  // What the plugin does for every render, fetching and checking the settings,
+  // baking them into a table and starting threads, is done once, and a batch
+  // of frames goes through the threads as one job, so small frames don't
+  // each wait for the last of their tiles before the next can start. Frames
+  // on a NUMA node are rendered by that node's threads. The rest are dealt
+  // out whole between the nodes, in turns that carry on from one batch to
+  // the next, and those too few to go round are cut into a band for each
+  // node, so a batch of one frame still has every node working on it.
+  class BatchProcessor {
+  public :
+    // get ready to render with the settings. Whatever the plugin's render
+    // fills in, the levels and the exposure, has to be filled in already,
+    // and any LUT they point at must outlive us. Temporal denoising needs
+    // frames from around each one that a batch doesn't have, so it is left
+    // out, as are the settings' scopes, each frame having its own. The
+    // pools may be shared with other processors, which then take turns on
+    // them, otherwise we start our own.
+    explicit BatchProcessor(const RenderSettings &settings, NodePools *pools = NULL);
+
+    // wait for the threads to finish
+    ~BatchProcessor();
+
+    // render the frames, each over its window, returning when they are done.
+    // The abort check may be called on any of the threads. Only one call
+    // runs at a time, other callers wait.
+    void processFrames(std::span<FrameView> frames, const AbortCheck &aborted = AbortCheck());
+
+    const RenderSettings &settings() const { return settings_; }
+
+  private :
+    // a frame, or a band of one, to render on a pool
+    struct Part {
+      size_t frame;
+      OfxRectI window;
+    };
+
+    // render some of the frames on one of the pools
+    void processOnPool(TilePool &pool, std::span<FrameView> frames, const std::vector<Part> &parts,
+                       const AbortCheck &aborted);
+
+    // a thread that waits on one of the pools after the first for every
+    // batch, the caller waiting on the first
+    void waiterMain(unsigned int pool);
+
+    RenderSettings settings_;
+
+    // the settings baked for 8 and 16 bit images, if they can be
+    std::shared_ptr<const Lut3D> baked_[2];
+
+    std::unique_ptr<NodePools> ownPools_;
+    NodePools *pools_;
+
+    // whose turn it is to get the next frame that isn't on a node
+    unsigned int turn_;
+
+    // the waiters are handed a batch by bumping the generation, and each says
+    // it is done by dropping the busy count, as with a pool's threads
+    std::vector<std::thread> waiters_;
+    std::mutex batchMutex_;
+    std::mutex mutex_;
+    std::condition_variable start_;
+    std::condition_variable done_;
+    const std::function<void(unsigned int)> *job_;
+    unsigned long long generation_;
+    unsigned int busy_;
+    bool stopping_;
+
+    // held while adding up scopes, a frame cut into bands being on more than
+    // one pool
+    std::mutex scopesMutex_;
+  };
+
+  inline BatchProcessor::BatchProcessor(const RenderSettings &settings, NodePools *pools)
+    : settings_(settings)
+    , pools_(pools)
+    , turn_(0)
+    , job_(NULL)
+    , generation_(0)
+    , busy_(0)
+    , stopping_(false)
+  {
+    if(!pools_) {
+      ownPools_.reset(new NodePools);
+      pools_ = ownPools_.get();
+    }
+
+    BuildCineonTable();
+
+    settings_.denoiseStrength = 0.0f;
+    settings_.denoiseCount = 0;
+    settings_.scopes = NULL;
+    settings_.bakedLut = NULL;
+
+    for(int depth = 0; depth < 2; ++depth) {
+      int size = BakedLutSize(settings_, depth + 1);
+      if(size) {
+        baked_[depth] = BakeLut(settings_, size);
+      }
+    }
+
+    for(unsigned int p = 1; p < pools_->size(); ++p) {
+      waiters_.emplace_back(&BatchProcessor::waiterMain, this, p);
+    }
+  }
+
+  inline BatchProcessor::~BatchProcessor()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    start_.notify_all();
+    for(size_t w = 0; w < waiters_.size(); ++w) {
+      waiters_[w].join();
+    }
+  }
+
+  inline void BatchProcessor::processFrames(std::span<FrameView> frames, const AbortCheck &aborted)
+  {
+    std::lock_guard<std::mutex> batchLock(batchMutex_);
+    const unsigned int nPools = pools_->size();
+
+    // frames on a node go to its pool
+    std::vector<std::vector<Part> > assigned(nPools);
+    std::vector<Part> unplaced;
+    for(size_t f = 0; f < frames.size(); ++f) {
+      const FrameView &frame = frames[f];
+      Part part;
+      part.frame = f;
+      part.window = frame.window.x1 < frame.window.x2 && frame.window.y1 < frame.window.y2 ?
+                    frame.window : frame.output.bounds();
+
+      unsigned int pool = nPools;
+      for(unsigned int p = 0; p < nPools; ++p) {
+        if(frame.node >= 0 && pools_->node(p) == frame.node) {
+          pool = p;
+        }
+      }
+      if(pool < nPools) {
+        assigned[pool].push_back(part);
+      }
+      else {
+        unplaced.push_back(part);
+      }
+    }
+
+    // the others go round whole while there are enough of them, and the rest
+    // are cut into bands
+    size_t whole = unplaced.size() - unplaced.size() % nPools;
+    for(size_t u = 0; u < unplaced.size(); ++u) {
+      Part part = unplaced[u];
+      if(u < whole) {
+        assigned[turn_++ % nPools].push_back(part);
+        continue;
+      }
+
+      int height = part.window.y2 - part.window.y1;
+      OfxRectI window = part.window;
+      for(unsigned int p = 0; p < nPools; ++p) {
+        part.window.y1 = window.y1 + int((long long) height * p / nPools);
+        part.window.y2 = window.y1 + int((long long) height * (p + 1) / nPools);
+        if(part.window.y1 < part.window.y2) {
+          assigned[p].push_back(part);
+        }
+      }
+    }
+
+    // hand the pools after the first to their waiters and wait on the first here
+    std::vector<std::exception_ptr> errors(nPools);
+    std::function<void(unsigned int)> job = [&](unsigned int p) {
+      try {
+        processOnPool(pools_->pool(p), frames, assigned[p], aborted);
+      }
+      catch(...) {
+        errors[p] = std::current_exception();
+      }
+    };
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      job_ = &job;
+      busy_ = (unsigned int) waiters_.size();
+      ++generation_;
+    }
+    start_.notify_all();
+
+    job(0);
+
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      done_.wait(lock, [this]() { return busy_ == 0; });
+      job_ = NULL;
+    }
+
+    for(size_t p = 0; p < errors.size(); ++p) {
+      if(errors[p]) {
+        std::rethrow_exception(errors[p]);
+      }
+    }
+  }
+
+  inline void BatchProcessor::waiterMain(unsigned int pool)
+  {
+    unsigned long long generation = 0;
+    for(;;) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        start_.wait(lock, [&]() { return stopping_ || generation_ != generation; });
+        if(stopping_) {
+          return;
+        }
+        generation = generation_;
+      }
+
+      // the job catches whatever the pool throws
+      (*job_)(pool);
+
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        --busy_;
+      }
+      done_.notify_one();
+    }
+  }
+
+  inline void BatchProcessor::processOnPool(TilePool &pool, std::span<FrameView> frames,
+                                            const std::vector<Part> &parts, const AbortCheck &aborted)
+  {
+    if(parts.empty()) {
+      return;
+    }
+
+    // each frame's settings only differ in the time and the table for its depth
+    std::vector<RenderSettings> frameSettings(parts.size(), settings_);
+    std::vector<OfxRectI> windows(parts.size());
+    int bytesPerPixel = 0;
+    for(size_t i = 0; i < parts.size(); ++i) {
+      FrameView &frame = frames[parts[i].frame];
+      int depth = frame.output.bytesPerComponent();
+      frameSettings[i].grainTime = frame.time;
+      frameSettings[i].bakedLut = depth <= 2 && depth > 0 ? baked_[depth - 1].get() : NULL;
+      windows[i] = parts[i].window;
+      bytesPerPixel = std::max(bytesPerPixel, frame.output.bytesPerPixel());
+    }
+
+    // every thread bins each frame it renders into its own scopes, made as
+    // it first needs them
+    std::vector<std::unique_ptr<ScopeBins> > scopes(size_t(pool.size()) * parts.size());
+
+    int tileWidth, tileHeight;
+    PoolTileSize(settings_, bytesPerPixel, windows, pool.size(), tileWidth, tileHeight);
+
+    pool.run(windows, tileWidth, tileHeight, [&](const OfxRectI &tile, unsigned int window, unsigned int thread) {
+      if(Aborted(aborted)) {
+        return;
+      }
+
+      FloatModeGuard floatMode(settings_.deterministic);
+
+      FrameView &frame = frames[parts[window].frame];
+      if(frame.scopes) {
+        std::unique_ptr<ScopeBins> &bins = scopes[size_t(thread) * parts.size() + window];
+        if(!bins) {
+          bins.reset(new ScopeBins);
+          memset(bins.get(), 0, sizeof(ScopeBins));
+        }
+        RenderSettings settings = frameSettings[window];
+        settings.scopes = bins.get();
+        RenderWindow(settings, aborted, frame.source, frame.mask, frame.output, tile);
+      }
+      else {
+        RenderWindow(frameSettings[window], aborted, frame.source, frame.mask, frame.output, tile);
+      }
+    });
+
+    std::lock_guard<std::mutex> lock(scopesMutex_);
+    for(size_t i = 0; i < scopes.size(); ++i) {
+      const ScopeBins *bins = scopes[i].get();
+      if(!bins) {
+        continue;
+      }
+      ScopeBins &total = *frames[parts[i % parts.size()].frame].scopes;
+      for(int v = 0; v < kVectorscopeSize; ++v) {
+        for(int u = 0; u < kVectorscopeSize; ++u) {
+          total.vectorscope[v][u] += bins->vectorscope[v][u];
+        }
+      }
+      for(int c = 0; c < 3; ++c) {
+        for(int bin = 0; bin < kScopeHistogramBins; ++bin) {
+          total.histogram[c][bin] += bins->histogram[c][bin];
+        }
+      }
+      total.count += bins->count;
+    }
+  }
+}
+
+#endif
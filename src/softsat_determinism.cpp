@@ -0,0 +1,130 @@
+// Copyright OpenFX and contributors to the OpenFX project.
+// Copyright SalkocsisFX.
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+Checks that deterministic renders come out the same bits however they are
+split up.
+
+  softsat_determinism
+
+Renders made up frames with every stage that has a deterministic mode turned
+on, once serially over the whole frame and then on pools of several sizes
+and in uneven windows, and compares them. The serial render's hash is
+checked against the one every build must make, whatever the compiler,
+runtime or instruction set. Exits with 1 if anything differs.
+*/
+
+#include "softsat_core.h"
+
+using namespace SoftSat;
+
+namespace {
+
+  const int kWidth = 517;
+  const int kHeight = 293;
+
+  // the hash of the serial render, which any build must match
+  const unsigned long long kExpectedHash = 0xfa259dfbbc057e8dull;
+
+  // the same made up frame every time, with enough detail and colour for the
+  // blurs, the gamut compression and the log curve to all do something. It
+  // is made with plain arithmetic only, as the runtime's sinf and the like
+  // differ in their last bits between builds.
+  void MakeFrame(std::vector<float> &pixels)
+  {
+    pixels.resize(size_t(kWidth) * kHeight * 4);
+    for(int y = 0; y < kHeight; ++y) {
+      for(int x = 0; x < kWidth; ++x) {
+        float *pixel = &pixels[(size_t(y) * kWidth + x) * 4];
+        pixel[0] = float(x) / kWidth;
+        pixel[1] = 0.05f + 0.009f * float(abs((x * 7 + y * 5) % 200 - 100));
+        pixel[2] = float((x * 7 + y * 13) % 101) / 100.0f;
+        pixel[3] = 1.0f;
+      }
+    }
+  }
+
+  // FNV-1a over a render's bytes
+  unsigned long long Hash(const std::vector<float> &pixels)
+  {
+    const unsigned char *bytes = (const unsigned char *) pixels.data();
+    unsigned long long hash = 14695981039346656037ull;
+    for(size_t i = 0; i < pixels.size() * sizeof(float); ++i) {
+      hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+  }
+
+  // report whether two renders match
+  bool Same(const char *what, const std::vector<float> &expected, const std::vector<float> &rendered)
+  {
+    bool same = memcmp(expected.data(), rendered.data(), expected.size() * sizeof(float)) == 0;
+    printf("%-40s %s\n", what, same ? "same" : "DIFFERENT");
+    return same;
+  }
+}
+
+int main()
+{
+  BuildCineonTable();
+
+  std::vector<float> source;
+  MakeFrame(source);
+  std::vector<float> expected(source.size()), rendered(source.size());
+  OfxRectI bounds = {0, 0, kWidth, kHeight};
+  ImageView sourceView(source.data(), bounds, kWidth * 16, 4, 4);
+  ImageView expectedView(expected.data(), bounds, kWidth * 16, 4, 4);
+  ImageView renderedView(rendered.data(), bounds, kWidth * 16, 4, 4);
+  ImageView noMask;
+
+  RenderSettings settings;
+  settings.saturation = 1.6f;
+  settings.transfer = eTransferCineonLog;
+  settings.chromaDetail = 0.7f;
+  settings.chromaSize = 9.0f;
+  settings.chromaRadius = ChromaBlurRadius(settings.chromaSize);
+  settings.gamutCompression = true;
+  settings.grainAmount = 0.03f;
+  settings.grainColour = 0.4f;
+  settings.grainTime = 12.0;
+  settings.deterministic = true;
+
+  {
+    FloatModeGuard floatMode(settings.deterministic);
+    RenderWindow(settings, AbortCheck(), sourceView, noMask, expectedView, bounds);
+  }
+  bool ok = true;
+  char what[64];
+
+  unsigned long long hash = Hash(expected);
+  printf("%-40s %016llx %s\n", "serial render hash", hash, hash == kExpectedHash ? "same" : "DIFFERENT");
+  ok = hash == kExpectedHash && ok;
+
+  // on pools, which tile as they like
+  const unsigned int threadCounts[] = {1, 3, 8};
+  for(size_t t = 0; t < sizeof(threadCounts) / sizeof(threadCounts[0]); ++t) {
+    TilePool pool(threadCounts[t]);
+    std::fill(rendered.begin(), rendered.end(), -1.0f);
+    ProcessImage(settings, sourceView, noMask, renderedView, bounds, pool);
+    snprintf(what, sizeof(what), "pool of %u threads", threadCounts[t]);
+    ok = Same(what, expected, rendered) && ok;
+  }
+
+  // in uneven windows, as a host might ask for them
+  const int splits[] = {1, 7, 64, 131};
+  for(size_t s = 0; s < sizeof(splits) / sizeof(splits[0]); ++s) {
+    std::fill(rendered.begin(), rendered.end(), -1.0f);
+    FloatModeGuard floatMode(settings.deterministic);
+    for(int y = 0; y < kHeight; y += splits[s]) {
+      for(int x = 0; x < kWidth; x += splits[s] * 3 + 5) {
+        OfxRectI window = {x, y, std::min(x + splits[s] * 3 + 5, kWidth), std::min(y + splits[s], kHeight)};
+        RenderWindow(settings, AbortCheck(), sourceView, noMask, renderedView, window);
+      }
+    }
+    snprintf(what, sizeof(what), "windows %d rows high", splits[s]);
+    ok = Same(what, expected, rendered) && ok;
+  }
+
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,169 @@
+// Copyright OpenFX and contributors to the OpenFX project.
+// Copyright SalkocsisFX.
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+Checks the coroutines batch tools read, saturate and write frames with.
+
+  softsat_pipeline
+
+Runs made up frames of several sizes through RenderTask coroutines that take
+a FrameSlots slot, make their frame on an IoPool, render it with a
+FrameRenderer and check it on the IoPool again against a serial render of
+the same frame, its scopes included. Then checks that no more frames were
+in flight than there are slots, and that a frame that can't be rendered
+throws out of its task's wait. Exits with 1 if anything is wrong.
+*/
+
+#include <atomic>
+
+#include "softsat_async.h"
+
+using namespace SoftSat;
+
+namespace {
+
+  const int kFrames = 24;
+  const unsigned int kSlots = 4;
+
+  // a frame's pixels and scopes, which stay put while it is in flight
+  struct Frame {
+    std::vector<float> source;
+    std::vector<float> output;
+    ScopeBins scopes;
+    FrameView view;
+  };
+
+  // the frames are of a few sizes, so batches mix them
+  void FrameSize(int frame, int &width, int &height)
+  {
+    const int widths[] = {320, 97, 517, 64};
+    const int heights[] = {180, 211, 43, 64};
+    width = widths[frame % 4];
+    height = heights[frame % 4];
+  }
+
+  // make up a frame, different for each, with plain arithmetic only so it
+  // is the same on every build
+  void MakeFrame(int frame, Frame &pixels)
+  {
+    int width, height;
+    FrameSize(frame, width, height);
+    pixels.source.resize(size_t(width) * height * 4);
+    pixels.output.assign(pixels.source.size(), -1.0f);
+    for(int y = 0; y < height; ++y) {
+      for(int x = 0; x < width; ++x) {
+        float *pixel = &pixels.source[(size_t(y) * width + x) * 4];
+        pixel[0] = float(x) / width;
+        pixel[1] = 0.05f + 0.009f * float(abs((x * 7 + y * 5 + frame * 11) % 200 - 100));
+        pixel[2] = float((x * 7 + y * 13 + frame) % 101) / 100.0f;
+        pixel[3] = 1.0f;
+      }
+    }
+    memset(&pixels.scopes, 0, sizeof(pixels.scopes));
+
+    OfxRectI bounds = {0, 0, width, height};
+    pixels.view.source = ImageView(pixels.source.data(), bounds, width * 16, 4, 4);
+    pixels.view.output = ImageView(pixels.output.data(), bounds, width * 16, 4, 4);
+    pixels.view.window = bounds;
+    pixels.view.time = frame;
+    pixels.view.scopes = &pixels.scopes;
+  }
+
+  // whether a frame rendered in a batch matches one rendered serially
+  bool Matches(const RenderSettings &settings, int frame, Frame &rendered)
+  {
+    Frame expected;
+    MakeFrame(frame, expected);
+    RenderSettings frameSettings = settings;
+    frameSettings.grainTime = frame;
+    frameSettings.scopes = &expected.scopes;
+    ImageView noMask;
+    {
+      FloatModeGuard floatMode(frameSettings.deterministic);
+      RenderWindow(frameSettings, AbortCheck(), expected.view.source, noMask, expected.view.output,
+                   expected.view.window);
+    }
+    return expected.output == rendered.output &&
+           memcmp(&expected.scopes, &rendered.scopes, sizeof(ScopeBins)) == 0;
+  }
+
+  std::atomic<int> gInFlight(0);
+  std::atomic<int> gMostInFlight(0);
+  std::atomic<int> gMatched(0);
+
+  // a frame's journey, as a batch tool would write it
+  RenderTask Convert(FrameRenderer &renderer, IoPool &io, FrameSlots &slots, int frame)
+  {
+    FrameSlots::Slot slot = co_await slots.acquire();
+    int inFlight = ++gInFlight;
+    int most = gMostInFlight;
+    while(inFlight > most && !gMostInFlight.compare_exchange_weak(most, inFlight)) {
+    }
+
+    std::unique_ptr<Frame> pixels(new Frame);
+    co_await io.run([&] { MakeFrame(frame, *pixels); });
+    co_await renderer.processAsync(pixels->view);
+    co_await io.run([&] {
+      if(Matches(renderer.settings(), frame, *pixels)) {
+        ++gMatched;
+      }
+    });
+    --gInFlight;
+  }
+
+  // a frame whose output has a depth nothing renders to
+  RenderTask Unrenderable(FrameRenderer &renderer, IoPool &io)
+  {
+    Frame pixels;
+    co_await io.run([&] { MakeFrame(0, pixels); });
+    pixels.view.output = ImageView(pixels.output.data(), pixels.view.window,
+                                   pixels.view.window.x2 * 16, 4, 3);
+    co_await renderer.processAsync(pixels.view);
+  }
+}
+
+int main()
+{
+  BuildCineonTable();
+
+  RenderSettings settings;
+  settings.saturation = 1.6f;
+  settings.transfer = eTransferCineonLog;
+  settings.chromaDetail = 0.7f;
+  settings.chromaSize = 9.0f;
+  settings.chromaRadius = ChromaBlurRadius(settings.chromaSize);
+  settings.grainAmount = 0.03f;
+  settings.grainColour = 0.4f;
+  settings.deterministic = true;
+
+  bool ok = true;
+  {
+    FrameRenderer renderer(settings);
+    IoPool io(2);
+    FrameSlots slots(kSlots);
+
+    std::vector<RenderTask> tasks;
+    for(int frame = 0; frame < kFrames; ++frame) {
+      tasks.push_back(Convert(renderer, io, slots, frame));
+    }
+    for(size_t t = 0; t < tasks.size(); ++t) {
+      tasks[t].wait();
+    }
+    printf("%-40s %d of %d\n", "frames matching serial renders", gMatched.load(), kFrames);
+    printf("%-40s %d of %u\n", "most frames in flight", gMostInFlight.load(), kSlots);
+    ok = gMatched == kFrames && gMostInFlight <= int(kSlots);
+
+    bool threw = false;
+    try {
+      Unrenderable(renderer, io).wait();
+    }
+    catch(const char *) {
+      threw = true;
+    }
+    printf("%-40s %s\n", "unrenderable frame", threw ? "threw" : "DIDN'T THROW");
+    ok = threw && ok;
+  }
+
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,112 @@
+// Copyright OpenFX and contributors to the OpenFX project.
+// Copyright SalkocsisFX.
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+Measures how renders scale with the threads in a pool.
+
+  softsat_scaling [frames]
+
+Renders a made up UHD frame on pools of 1, 2, 4 and so on threads up to the
+machine's processors, at a small and a large chroma size, fast and
+deterministic, and prints the milliseconds each render takes, the speedup
+over one thread and the size of the tiles the pool split the frame into.
+Each time is the best of frames renders, 5 if not given.
+*/
+
+#include <chrono>
+#include <cstdlib>
+
+#include "softsat_core.h"
+
+using namespace SoftSat;
+
+namespace {
+
+  const int kWidth = 3840;
+  const int kHeight = 2160;
+
+  // the same made up frame every time, with enough detail and colour for the
+  // blurs to do something
+  void MakeFrame(std::vector<float> &pixels)
+  {
+    pixels.resize(size_t(kWidth) * kHeight * 4);
+    for(int y = 0; y < kHeight; ++y) {
+      for(int x = 0; x < kWidth; ++x) {
+        float *pixel = &pixels[(size_t(y) * kWidth + x) * 4];
+        pixel[0] = float(x) / kWidth;
+        pixel[1] = 0.5f + 0.45f * sinf(x * 0.011f + y * 0.007f);
+        pixel[2] = float((x * 7 + y * 13) % 101) / 100.0f;
+        pixel[3] = 1.0f;
+      }
+    }
+  }
+
+  // the best time in milliseconds of some renders of the frame on a pool
+  double TimeRenders(const RenderSettings &settings, ImageView &source, ImageView &output, TilePool &pool, int frames)
+  {
+    ImageView noMask;
+    OfxRectI bounds = {0, 0, kWidth, kHeight};
+    double best = 0;
+    for(int f = 0; f < frames; ++f) {
+      FloatModeGuard floatMode(settings.deterministic);
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      ProcessImage(settings, source, noMask, output, bounds, pool);
+      double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+      best = f == 0 ? ms : std::min(best, ms);
+    }
+    return best;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  int frames = argc > 1 ? std::max(atoi(argv[1]), 1) : 5;
+
+  BuildCineonTable();
+
+  std::vector<float> source, rendered;
+  MakeFrame(source);
+  rendered.resize(source.size());
+  OfxRectI bounds = {0, 0, kWidth, kHeight};
+  ImageView sourceView(source.data(), bounds, kWidth * 16, 4, 4);
+  ImageView renderedView(rendered.data(), bounds, kWidth * 16, 4, 4);
+
+  unsigned int maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+  std::vector<unsigned int> threadCounts;
+  for(unsigned int n = 1; n < maxThreads; n *= 2) {
+    threadCounts.push_back(n);
+  }
+  threadCounts.push_back(maxThreads);
+
+  const float chromaSizes[] = {2.0f, 100.0f};
+  printf("%-8s %-13s %7s %10s %8s %10s\n", "chroma", "mode", "threads", "ms", "speedup", "tile");
+  for(size_t c = 0; c < sizeof(chromaSizes) / sizeof(chromaSizes[0]); ++c) {
+    for(int deterministic = 0; deterministic < 2; ++deterministic) {
+      RenderSettings settings;
+      settings.saturation = 1.6f;
+      settings.chromaDetail = 0.7f;
+      settings.chromaSize = chromaSizes[c];
+      settings.chromaRadius = ChromaBlurRadius(settings.chromaSize);
+      settings.deterministic = deterministic != 0;
+
+      double serial = 0;
+      for(size_t t = 0; t < threadCounts.size(); ++t) {
+        TilePool pool(threadCounts[t]);
+        int tileWidth, tileHeight;
+        PoolTileSize(settings, renderedView.bytesPerPixel(), std::vector<OfxRectI>(1, bounds), pool.size(),
+                     tileWidth, tileHeight);
+        double ms = TimeRenders(settings, sourceView, renderedView, pool, frames);
+        if(t == 0) {
+          serial = ms;
+        }
+        char tile[32];
+        snprintf(tile, sizeof(tile), "%dx%d", tileWidth, tileHeight);
+        printf("%-8g %-13s %7u %10.1f %8.2f %10s\n", settings.chromaSize, deterministic ? "deterministic" : "fast",
+               pool.size(), ms, serial / ms, tile);
+      }
+    }
+  }
+
+  return 0;
+}
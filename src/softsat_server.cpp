@@ -0,0 +1,415 @@
+// Copyright OpenFX and contributors to the OpenFX project.
+// Copyright SalkocsisFX.
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+The SoftSaturate render server, for tools that would otherwise start up,
+build the tables and start the threads for every job.
+
+  softsat_server [pipe name]
+
+It runs until it is killed, serving any number of clients at once, each on
+its own thread and with its own ring, all sharing the one set of pools. Only
+processes of the user it runs as, on this machine, can connect or open the
+rings. See softsat_server.h for how clients talk to it.
+*/
+
+#include "softsat_server.h"
+
+#include <string>
+
+using namespace SoftSat;
+
+namespace {
+
+  // how often a waiting client's thread checks that the client is still there
+  const DWORD kPollMilliseconds = 100;
+
+  // one process's worth of threads, shared by every client
+  NodePools *gPools = NULL;
+
+  // numbers the clients, for naming their rings
+  std::atomic<unsigned int> gNextClient(1);
+
+  // how many bytes of rings the clients have between them
+  std::atomic<unsigned long long> gRingBytes(0);
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // security attributes that let in the user we run as and no one else, for
+  // the pipe and the rings, which would otherwise be open to anyone logged on
+  class OwnerOnly {
+  public :
+    OwnerOnly();
+
+    // NULL if they couldn't be made
+    SECURITY_ATTRIBUTES *attributes() { return ok_ ? &attributes_ : NULL; }
+
+  private :
+    std::vector<char> user_;
+    std::vector<char> acl_;
+    SECURITY_DESCRIPTOR descriptor_;
+    SECURITY_ATTRIBUTES attributes_;
+    bool ok_;
+  };
+
+  OwnerOnly::OwnerOnly()
+    : ok_(false)
+  {
+    // who we are
+    HANDLE token = NULL;
+    if(!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token)) {
+      return;
+    }
+    DWORD bytes = 0;
+    GetTokenInformation(token, TokenUser, NULL, 0, &bytes);
+    user_.resize(bytes);
+    bool known = bytes != 0 && GetTokenInformation(token, TokenUser, user_.data(), bytes, &bytes);
+    CloseHandle(token);
+    if(!known) {
+      return;
+    }
+
+    // a DACL with just us on it
+    PSID sid = ((TOKEN_USER *) user_.data())->User.Sid;
+    acl_.resize(sizeof(ACL) + sizeof(ACCESS_ALLOWED_ACE) + GetLengthSid(sid));
+    PACL acl = (PACL) acl_.data();
+    ok_ = InitializeAcl(acl, DWORD(acl_.size()), ACL_REVISION) &&
+          AddAccessAllowedAce(acl, ACL_REVISION, GENERIC_ALL, sid) &&
+          InitializeSecurityDescriptor(&descriptor_, SECURITY_DESCRIPTOR_REVISION) &&
+          SetSecurityDescriptorDacl(&descriptor_, TRUE, acl, FALSE);
+
+    attributes_.nLength = sizeof(attributes_);
+    attributes_.lpSecurityDescriptor = &descriptor_;
+    attributes_.bInheritHandle = FALSE;
+  }
+
+  // the pipe's and the rings' security, the same for every client
+  OwnerOnly *gOwnerOnly = NULL;
+
+  // take bytes from what is left for rings, if there are enough
+  bool ReserveRingBytes(unsigned long long bytes)
+  {
+    unsigned long long used = gRingBytes.load();
+    do {
+      if(bytes > kMaxServerRingBytes - used) {
+        return false;
+      }
+    } while(!gRingBytes.compare_exchange_weak(used, used + bytes));
+    return true;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // one client, from its hello until its pipe closes
+  class ClientSession {
+  public :
+    explicit ClientSession(HANDLE pipe);
+    ~ClientSession();
+
+    void serve();
+
+  protected :
+    bool readMessage(std::vector<char> &message);
+    bool reply(int status, const char *error);
+    bool hello(const ServerHello &message);
+    void renderSubmitted();
+
+    HANDLE pipe_;
+    std::string name_;
+    HANDLE mapping_;
+    void *view_;
+    HANDLE submitEvent_;
+    HANDLE doneEvent_;
+    std::unique_ptr<RingLayout> ring_;
+
+    // the ring's size as we made it and how far we are through it, the
+    // client can write over the header's, and what it takes from the
+    // server's allowance
+    unsigned int slotCount_;
+    unsigned long long slotBytes_;
+    unsigned long long completed_;
+    unsigned long long ringBytes_;
+
+    std::shared_ptr<const Lut3D> lut_;
+    std::unique_ptr<BatchProcessor> batch_;
+  };
+
+  ClientSession::ClientSession(HANDLE pipe)
+    : pipe_(pipe)
+    , mapping_(NULL)
+    , view_(NULL)
+    , submitEvent_(NULL)
+    , doneEvent_(NULL)
+    , slotCount_(0)
+    , slotBytes_(0)
+    , completed_(0)
+    , ringBytes_(0)
+  {
+    char name[64];
+    snprintf(name, sizeof(name), "Local\\SoftSat.%lu.%u", GetCurrentProcessId(), gNextClient++);
+    name_ = name;
+  }
+
+  ClientSession::~ClientSession()
+  {
+    // nothing can be in the middle of a render by now, they run on our thread
+    batch_.reset();
+    ring_.reset();
+    if(view_)
+      UnmapViewOfFile(view_);
+    if(mapping_)
+      CloseHandle(mapping_);
+    if(submitEvent_)
+      CloseHandle(submitEvent_);
+    if(doneEvent_)
+      CloseHandle(doneEvent_);
+    DisconnectNamedPipe(pipe_);
+    CloseHandle(pipe_);
+    gRingBytes -= ringBytes_;
+  }
+
+  bool ClientSession::readMessage(std::vector<char> &message)
+  {
+    message.resize(4096);
+    DWORD read = 0;
+    if(!ReadFile(pipe_, message.data(), DWORD(message.size()), &read, NULL)) {
+      return false;
+    }
+    message.resize(read);
+    return true;
+  }
+
+  bool ClientSession::reply(int status, const char *error)
+  {
+    ServerReply message;
+    memset(&message, 0, sizeof(message));
+    message.type = eServerReply;
+    message.status = status;
+    if(status == 0) {
+      snprintf(message.ring, sizeof(message.ring), "%s", name_.c_str());
+    }
+    snprintf(message.error, sizeof(message.error), "%s", error ? error : "");
+
+    DWORD written = 0;
+    return WriteFile(pipe_, &message, sizeof(message), &written, NULL) && written == sizeof(message);
+  }
+
+  // make the ring and its events
+  bool ClientSession::hello(const ServerHello &message)
+  {
+    if(message.version != kServerVersion) {
+      reply(-1, "wrong version");
+      return false;
+    }
+    if(message.slotCount == 0 || message.slotCount > kMaxRingSlots ||
+       message.slotBytes == 0 || message.slotBytes > kMaxSlotBytes) {
+      reply(-1, "bad ring size");
+      return false;
+    }
+
+    unsigned long long bytes = RingLayout::Bytes(message.slotCount, message.slotBytes);
+    if(!ReserveRingBytes(bytes)) {
+      reply(-1, "no room for the ring");
+      return false;
+    }
+    ringBytes_ = bytes;
+
+    SECURITY_ATTRIBUTES *security = gOwnerOnly->attributes();
+    mapping_ = CreateFileMappingA(INVALID_HANDLE_VALUE, security, PAGE_READWRITE, DWORD(bytes >> 32), DWORD(bytes),
+                                  name_.c_str());
+    view_ = mapping_ ? MapViewOfFile(mapping_, FILE_MAP_ALL_ACCESS, 0, 0, 0) : NULL;
+    submitEvent_ = CreateEventA(security, FALSE, FALSE, (name_ + "Submit").c_str());
+    doneEvent_ = CreateEventA(security, FALSE, FALSE, (name_ + "Done").c_str());
+    if(!view_ || !submitEvent_ || !doneEvent_) {
+      reply(-1, "could not make the ring");
+      return false;
+    }
+
+    // the mapping arrives zeroed, so only the sizes need filling in
+    slotCount_ = message.slotCount;
+    slotBytes_ = message.slotBytes;
+    ring_.reset(new RingLayout(view_, slotBytes_));
+    RingHeader &header = ring_->header();
+    header.version = kServerVersion;
+    header.slotCount = message.slotCount;
+    header.slotBytes = message.slotBytes;
+    return reply(0, NULL);
+  }
+
+  // render every frame the client has submitted as one batch, failing the
+  // ones that don't make sense on their own
+  void ClientSession::renderSubmitted()
+  {
+    RingHeader &header = ring_->header();
+    unsigned long long completed = completed_;
+    unsigned long long submitted = header.submitted.load(std::memory_order_acquire);
+
+    // a client bumping the count past its ring is beyond help
+    if(submitted - completed > slotCount_) {
+      submitted = completed + slotCount_;
+    }
+    if(submitted == completed) {
+      return;
+    }
+
+    std::vector<FrameView> frames;
+    std::vector<RingSlot *> rendered;
+    for(unsigned long long index = completed; index < submitted; ++index) {
+      unsigned int s = (unsigned int)(index % slotCount_);
+      RingSlot &slot = ring_->slot(s);
+      slot.status = 0;
+      slot.error[0] = 0;
+
+      // check our own copy of what the client says, which it can't change under us
+      int width = slot.width;
+      int height = slot.height;
+      int nComponents = slot.nComponents;
+      int bytesPerComponent = slot.bytesPerComponent;
+      int bytesPerPixel = nComponents * bytesPerComponent;
+      const char *error = NULL;
+      if(!batch_) {
+        error = "no settings";
+      }
+      else if(nComponents != 3 && nComponents != 4) {
+        error = "bad number of components";
+      }
+      else if(bytesPerComponent != 1 && bytesPerComponent != 2 && bytesPerComponent != 4) {
+        error = "bad data type";
+      }
+      else if(width <= 0 || height <= 0 || (unsigned long long) width * height * bytesPerPixel > slotBytes_) {
+        error = "frame does not fit its slot";
+      }
+      if(error) {
+        slot.status = -1;
+        snprintf(slot.error, sizeof(slot.error), "%s", error);
+        continue;
+      }
+
+      OfxRectI bounds = {0, 0, width, height};
+      FrameView frame;
+      frame.source = ImageView(ring_->source(s), bounds, width * bytesPerPixel, nComponents, bytesPerComponent);
+      frame.output = ImageView(ring_->output(s), bounds, width * bytesPerPixel, nComponents, bytesPerComponent);
+      frame.time = slot.time;
+      if(slot.wantScopes) {
+        memset(&slot.scopes, 0, sizeof(slot.scopes));
+        frame.scopes = &slot.scopes;
+      }
+      frames.push_back(frame);
+      rendered.push_back(&slot);
+    }
+
+    if(!frames.empty()) {
+      const char *error = NULL;
+      try {
+        batch_->processFrames(frames);
+      }
+      catch(const char *what) {
+        error = what;
+      }
+      catch(const std::exception &what) {
+        error = what.what();
+      }
+      catch(...) {
+        error = "render failed";
+      }
+      if(error) {
+        for(size_t r = 0; r < rendered.size(); ++r) {
+          rendered[r]->status = -1;
+          snprintf(rendered[r]->error, sizeof(rendered[r]->error), "%s", error);
+        }
+      }
+    }
+
+    completed_ = submitted;
+    header.completed.store(submitted, std::memory_order_release);
+    SetEvent(doneEvent_);
+  }
+
+  void ClientSession::serve()
+  {
+    std::vector<char> message;
+    if(!readMessage(message) || message.size() != sizeof(ServerHello) ||
+       ((ServerHello *) message.data())->type != eServerHello) {
+      return;
+    }
+    if(!hello(*(ServerHello *) message.data())) {
+      return;
+    }
+
+    for(;;) {
+      renderSubmitted();
+
+      // a closed pipe means the client has gone, otherwise sleep until there
+      // are frames or a message, looking in on the pipe now and then
+      DWORD available = 0;
+      if(!PeekNamedPipe(pipe_, NULL, 0, NULL, &available, NULL)) {
+        return;
+      }
+      if(available == 0) {
+        WaitForSingleObject(submitEvent_, kPollMilliseconds);
+        continue;
+      }
+
+      // new settings, for frames submitted after the ones we have
+      if(!readMessage(message)) {
+        return;
+      }
+      renderSubmitted();
+      if(message.size() != sizeof(ServerSettings) || ((ServerSettings *) message.data())->type != eServerSettings) {
+        reply(-1, "unexpected message");
+        return;
+      }
+      RenderSettings settings;
+      const char *error = UnpackSettings(*(ServerSettings *) message.data(), settings, lut_);
+      batch_.reset(error ? NULL : new BatchProcessor(settings, gPools));
+      if(!reply(error ? -1 : 0, error)) {
+        return;
+      }
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // a client's thread
+  void ServeClient(HANDLE pipe)
+  {
+    try {
+      ClientSession session(pipe);
+      session.serve();
+    }
+    catch(...) {
+      // the session has cleaned up after itself, and only it is lost
+    }
+  }
+}
+
+int main(int argc, char **argv)
+{
+  const char *pipeName = argc > 1 ? argv[1] : SOFTSAT_SERVER_PIPE;
+
+  // everything a job would otherwise pay for up front
+  BuildCineonTable();
+  NodePools pools;
+  gPools = &pools;
+
+  OwnerOnly ownerOnly;
+  if(!ownerOnly.attributes()) {
+    fprintf(stderr, "softsat_server: could not keep other users out\n");
+    return 1;
+  }
+  gOwnerOnly = &ownerOnly;
+
+  for(;;) {
+    HANDLE pipe = CreateNamedPipeA(pipeName, PIPE_ACCESS_DUPLEX,
+                                   PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                                   PIPE_UNLIMITED_INSTANCES, 4096, 4096, 0, ownerOnly.attributes());
+    if(pipe == INVALID_HANDLE_VALUE) {
+      fprintf(stderr, "softsat_server: could not make the pipe %s\n", pipeName);
+      return 1;
+    }
+
+    if(!ConnectNamedPipe(pipe, NULL) && GetLastError() != ERROR_PIPE_CONNECTED) {
+      CloseHandle(pipe);
+      continue;
+    }
+    std::thread(ServeClient, pipe).detach();
+  }
+}
@@ -0,0 +1,223 @@
+// Copyright OpenFX and contributors to the OpenFX project.
+// Copyright SalkocsisFX.
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+What the render server and its clients agree on.
+
+A client connects to the server's named pipe and says hello, asking for a
+ring of so many slots of so many bytes. The server makes the ring, a file
+mapping the client opens by name, along with two events, and says where they
+are. Then the client sends the settings, which it may send again later, and
+the pipe carries nothing else until the client goes.
+
+Frames never go down the pipe. The client writes a frame's pixels into the
+next free slot, fills in its header, bumps the ring's submitted count and
+sets the submit event. The server renders every slot between its completed
+count and the submitted count as one batch, straight from and to the ring,
+bumps the completed count and sets the done event. A client may have as many
+frames in flight as there are slots, and gets them back in order.
+*/
+
+#ifndef SOFTSAT_SERVER_H
+#define SOFTSAT_SERVER_H
+
+#include <cmath>
+#include "softsat_core.h"
+
+namespace SoftSat {
+
+  // where the server listens unless it is told otherwise
+#define SOFTSAT_SERVER_PIPE "\\\\.\\pipe\\softsat"
+
+  // bumped whenever anything below changes
+  const unsigned int kServerVersion = 1;
+
+  // how big a ring the server will make for one client
+  const unsigned int kMaxRingSlots = 64;
+  const unsigned long long kMaxSlotBytes = 1ull << 30;
+
+  // how many bytes of rings the server will have for all its clients at
+  // once, a client asking for more than is left being turned away
+  const unsigned long long kMaxServerRingBytes = 16ull << 30;
+
+  // the ranges settings off the wire are held to, those of the plugin's
+  // params. Saturation has none there and auto saturation may scale it, so
+  // it is only kept from growing far past anything that looks sane.
+  const float kMaxServerSaturation = 16.0f;
+  const float kMinServerChromaDetail = -1.0f, kMaxServerChromaDetail = 4.0f;
+  const float kMinServerChromaSize = 0.5f, kMaxServerChromaSize = 100.0f;
+  const float kMaxServerGrainAmount = 0.5f;
+  const float kMaxServerGrainColour = 1.0f;
+
+  // the messages on the pipe, each starting with its type
+  enum ServerMessageType {
+    eServerHello = 1,
+    eServerSettings,
+    eServerReply,
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // the client's first message, the slots' bytes are for each of the source
+  // and the output
+  struct ServerHello {
+    unsigned int type;
+    unsigned int version;
+    unsigned int slotCount;
+    unsigned long long slotBytes;
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // the settings for the frames that follow, what the plugin has from its
+  // params once it has filled in the levels, exposure and saturation gain. The
+  // chroma detail's size is in pixels of the frames sent, and the LUT is a
+  // .cube file for the server to read, none if empty.
+  struct ServerSettings {
+    unsigned int type;
+    float saturation;
+    int transfer;
+    int restoreLevels;
+    float levelGain[3];
+    float levelOffset[3];
+    float exposure;
+    float chromaDetail;
+    float chromaSize;
+    int gamutCompression;
+    float grainAmount;
+    float grainColour;
+    int grainSeed;
+    int bake;
+    int deterministic;
+    char lutPath[MAX_PATH];
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // turn settings off the wire into ones for the kernel, reading the LUT if
+  // there is one, returning an error or NULL. Numbers that aren't finite are
+  // turned away, the rest are held to the params' ranges, so a client can't
+  // ask for blurs no frame could pay for.
+  inline const char *UnpackSettings(const ServerSettings &message, RenderSettings &settings,
+                                    std::shared_ptr<const Lut3D> &lut)
+  {
+    if(message.transfer < eTransferLinear || message.transfer > eTransferHLG) {
+      return "unknown transfer function";
+    }
+
+    const float numbers[] = {message.saturation, message.levelGain[0], message.levelGain[1], message.levelGain[2],
+                             message.levelOffset[0], message.levelOffset[1], message.levelOffset[2],
+                             message.exposure, message.chromaDetail, message.chromaSize,
+                             message.grainAmount, message.grainColour};
+    for(size_t i = 0; i < sizeof(numbers) / sizeof(numbers[0]); ++i) {
+      if(!std::isfinite(numbers[i])) {
+        return "settings that aren't numbers";
+      }
+    }
+
+    settings.saturation = std::clamp(message.saturation, -kMaxServerSaturation, kMaxServerSaturation);
+    settings.transfer = TransferFunction(message.transfer);
+    settings.restoreLevels = message.restoreLevels != 0;
+    for(int c = 0; c < 3; ++c) {
+      settings.levels.gain[c] = message.levelGain[c];
+      settings.levels.offset[c] = message.levelOffset[c];
+    }
+    settings.exposure = message.exposure;
+    settings.chromaDetail = std::clamp(message.chromaDetail, kMinServerChromaDetail, kMaxServerChromaDetail);
+    settings.chromaSize = std::clamp(message.chromaSize, kMinServerChromaSize, kMaxServerChromaSize);
+    settings.chromaRadius = ChromaBlurRadius(settings.chromaSize);
+    settings.gamutCompression = message.gamutCompression != 0;
+    settings.grainAmount = std::clamp(message.grainAmount, 0.0f, kMaxServerGrainAmount);
+    settings.grainColour = std::clamp(message.grainColour, 0.0f, kMaxServerGrainColour);
+    settings.grainSeed = message.grainSeed;
+    settings.bake = message.bake != 0;
+    settings.deterministic = message.deterministic != 0;
+
+    lut.reset();
+    char path[MAX_PATH];
+    memcpy(path, message.lutPath, sizeof(path));
+    path[MAX_PATH - 1] = 0;
+    if(path[0]) {
+      std::shared_ptr<Lut3D> parsed(new Lut3D);
+      if(!ReadCubeFile(path, *parsed)) {
+        return "could not read the LUT";
+      }
+      lut = parsed;
+    }
+    settings.lut = lut.get();
+    return NULL;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // the server's answer to either, 0 for success. The answer to hello names
+  // the ring's mapping, and its events are the same with "Submit" and "Done"
+  // on the end.
+  struct ServerReply {
+    unsigned int type;
+    int status;
+    char ring[128];
+    char error[128];
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // the start of the ring, the counts on their own cache lines so the two
+  // sides don't fight over them
+  struct RingHeader {
+    unsigned int version;
+    unsigned int slotCount;
+    unsigned long long slotBytes;
+    alignas(64) std::atomic<unsigned long long> submitted;
+    alignas(64) std::atomic<unsigned long long> completed;
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // a frame in the ring, its rows packed bottom row first. The client fills in
+  // the first part, the server the status and, if asked for, the scopes.
+  struct RingSlot {
+    int width;
+    int height;
+    int nComponents;
+    int bytesPerComponent;
+    OfxTime time;
+    int wantScopes;
+
+    int status;
+    char error[128];
+    ScopeBins scopes;
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // where things are in a mapped ring. Each slot's header is followed by its
+  // source and then its output, all on page boundaries.
+  class RingLayout {
+  public :
+    RingLayout(void *base, unsigned long long slotBytes)
+      : base_((char *) base)
+      , slotBytes_(RoundUp(slotBytes))
+      , stride_(RoundUp(sizeof(RingSlot)) + 2 * RoundUp(slotBytes))
+    {}
+
+    // how many bytes a ring of that size takes
+    static unsigned long long Bytes(unsigned int slotCount, unsigned long long slotBytes)
+    {
+      return RoundUp(sizeof(RingHeader)) + slotCount * (RoundUp(sizeof(RingSlot)) + 2 * RoundUp(slotBytes));
+    }
+
+    RingHeader &header() const { return *(RingHeader *) base_; }
+
+    RingSlot &slot(unsigned int index) const { return *(RingSlot *) slotBase(index); }
+
+    void *source(unsigned int index) const { return slotBase(index) + RoundUp(sizeof(RingSlot)); }
+
+    void *output(unsigned int index) const { return slotBase(index) + RoundUp(sizeof(RingSlot)) + slotBytes_; }
+
+  protected :
+    static unsigned long long RoundUp(unsigned long long bytes) { return (bytes + 4095) & ~4095ull; }
+
+    char *slotBase(unsigned int index) const { return base_ + RoundUp(sizeof(RingHeader)) + index * stride_; }
+
+    char *base_;
+    unsigned long long slotBytes_;
+    unsigned long long stride_;
+  };
+}
+
+#endif
@@ -0,0 +1,169 @@
+// Copyright OpenFX and contributors to the OpenFX project.
+// Copyright SalkocsisFX.
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+Checks the fast PQ and HLG curves against their reference formulas, and
+measures what they cost.
+
+  softsat_transfer
+
+Decodes and encodes signals and light across the whole range with the SIMD
+curves and with the formulas from ST 2084 and BT.2100 in double, and prints
+the worst errors. Signals past 1 must decode to finite light. Then renders a
+made up frame linear, PQ and HLG and prints how long each took against the
+linear render. The HDR curves are meant to stay within twice the linear
+render with chroma detail and gamut compression on, as the plugin is mostly
+used. With saturation alone there is little else to the render, so they are
+most of it. Exits with 1 if any curve is out by more than its tolerance. The
+times are only printed, as how they come out depends on whatever else the
+machine is doing.
+*/
+
+#include <chrono>
+
+#include "softsat_core.h"
+
+using namespace SoftSat;
+
+namespace {
+
+  // how many points each curve is checked at
+  const int kSamples = 1 << 16;
+
+  // the worst a decoded light may be out by, relative to the reference above
+  // kLightFloor and absolute below it, and an encoded signal absolutely, a
+  // tenth of a 12 bit code value. PQ's steep powers leave it several times
+  // further out than HLG in floats, however its pow is done.
+  const double kLightTolerance = 1e-4;
+  const double kLightFloor = 1e-4;
+  const double kSignalTolerance = 0.1 / 4095.0;
+
+  const int kWidth = 1920;
+  const int kHeight = 1080;
+  const int kRenders = 5;
+
+  double ReferencePQToLinear(double signal)
+  {
+    double e = pow(signal, 1.0 / kPQ_m2);
+    return pow(std::max(e - kPQ_c1, 0.0) / (kPQ_c2 - kPQ_c3 * e), 1.0 / kPQ_m1);
+  }
+
+  double ReferenceLinearToPQ(double light)
+  {
+    double y = pow(light, kPQ_m1);
+    return pow((kPQ_c1 + kPQ_c2 * y) / (1.0 + kPQ_c3 * y), kPQ_m2);
+  }
+
+  double ReferenceHLGToLinear(double signal)
+  {
+    return signal <= 0.5 ? signal * signal / 3.0 : (exp((signal - kHLG_c) / kHLG_a) + kHLG_b) / 12.0;
+  }
+
+  double ReferenceLinearToHLG(double light)
+  {
+    return light <= 1.0 / 12.0 ? sqrt(3.0 * light) : kHLG_a * log(12.0 * light - kHLG_b) + kHLG_c;
+  }
+
+  // how far a curve is from its reference over the samples, the values
+  // going in being what the samples map to, light relative above the floor
+  double WorstError(void (*curve)(float *, int), double (*reference)(double), const std::vector<float> &in,
+                    bool relative)
+  {
+    std::vector<float> out(in);
+    curve(out.data(), (int) out.size());
+    double worst = 0;
+    for(size_t i = 0; i < in.size(); ++i) {
+      double expected = reference(in[i]);
+      double error = fabs(out[i] - expected);
+      if(relative && expected > kLightFloor) {
+        error /= expected;
+      }
+      worst = std::max(worst, error);
+    }
+    return worst;
+  }
+
+  // report whether a curve is within its tolerance
+  bool Within(const char *what, double error, double tolerance)
+  {
+    bool within = error <= tolerance;
+    printf("%-40s %.2e %s\n", what, error, within ? "ok" : "OUT OF TOLERANCE");
+    return within;
+  }
+
+  // the best time in milliseconds of some serial renders of the frame
+  double TimeRenders(RenderSettings settings, TransferFunction transfer, ImageView &source, ImageView &output)
+  {
+    settings.transfer = transfer;
+    ImageView noMask;
+    OfxRectI bounds = {0, 0, kWidth, kHeight};
+    double best = 0;
+    for(int r = 0; r < kRenders; ++r) {
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      RenderWindow(settings, AbortCheck(), source, noMask, output, bounds);
+      double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+      best = r == 0 ? ms : std::min(best, ms);
+    }
+    return best;
+  }
+}
+
+int main()
+{
+  BuildCineonTable();
+
+  // signals evenly over [0, 1], and light evenly in log2 from 2^-20 up to
+  // 1, the top of both curves
+  std::vector<float> signals(kSamples), light(kSamples);
+  for(int i = 0; i < kSamples; ++i) {
+    signals[i] = float(i) / (kSamples - 1);
+    light[i] = float(exp2(-20.0 + 20.0 * i / (kSamples - 1)));
+  }
+
+  bool ok = true;
+  ok = Within("PQ to linear", WorstError(PQToLinear, ReferencePQToLinear, signals, true), kLightTolerance) && ok;
+  ok = Within("linear to PQ", WorstError(LinearToPQ, ReferenceLinearToPQ, light, false), kSignalTolerance) && ok;
+  ok = Within("HLG to linear", WorstError(HLGToLinear, ReferenceHLGToLinear, signals, true), kLightTolerance) && ok;
+  ok = Within("linear to HLG", WorstError(LinearToHLG, ReferenceLinearToHLG, light, false), kSignalTolerance) && ok;
+
+  // signals past PQ's top decode to its brightest, not to infinity
+  alignas(16) float past[4] = {1.0f, 1.5f, 1.98f, 4.0f};
+  PQToLinear(past, 4);
+  bool clamped = true;
+  for(int i = 0; i < 4; ++i) {
+    clamped = clamped && std::isfinite(past[i]) && past[i] == past[0];
+  }
+  printf("%-40s %s\n", "PQ signals past 1", clamped ? "ok" : "NOT CLAMPED");
+  ok = clamped && ok;
+
+  // what each curve costs a render, a mid grey frame with some colour in it
+  std::vector<float> source(size_t(kWidth) * kHeight * 4), rendered(source.size());
+  for(size_t p = 0; p < source.size(); p += 4) {
+    source[p] = 0.3f + 0.4f * float(p % 1024) / 1024.0f;
+    source[p + 1] = 0.5f;
+    source[p + 2] = 0.4f + 0.2f * float(p % 768) / 768.0f;
+    source[p + 3] = 1.0f;
+  }
+  OfxRectI bounds = {0, 0, kWidth, kHeight};
+  ImageView sourceView(source.data(), bounds, kWidth * 16, 4, 4);
+  ImageView renderedView(rendered.data(), bounds, kWidth * 16, 4, 4);
+
+  for(int stages = 0; stages < 2; ++stages) {
+    RenderSettings settings;
+    settings.saturation = 1.4f;
+    if(stages) {
+      settings.chromaDetail = 0.5f;
+      settings.chromaSize = 2.0f;
+      settings.chromaRadius = ChromaBlurRadius(settings.chromaSize);
+      settings.gamutCompression = true;
+    }
+    const char *what = stages ? "with chroma detail and gamut" : "saturation alone";
+    double linear = TimeRenders(settings, eTransferLinear, sourceView, renderedView);
+    double pq = TimeRenders(settings, eTransferPQ, sourceView, renderedView);
+    double hlg = TimeRenders(settings, eTransferHLG, sourceView, renderedView);
+    printf("%-40s linear %.1f ms, PQ %.2fx, HLG %.2fx\n", what, linear, pq / linear, hlg / linear);
+  }
+
+  return ok ? 0 : 1;
+}
@@ -22,6 +22,20 @@ The main features are
 
 #include <stdio.h>
 #include <math.h>
+#include <emmintrin.h>
+#include <ctype.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 #include "ofxsImageEffect.h"
 #include "ofxsMultiThread.h"
 
@@ -30,6 +44,8 @@ The main features are
 #include "ofxsProcessing.H"
 #include "ofxsMatrix2D.h"
 
+#include "softsat_core.h"
+
 #define kPluginName "SoftSaturate"
 #define kPluginGrouping "TSFBCE24RhythmHeaveners"
 #define kPluginDescription "Saturates old film."
@@ -83,21 +99,48 @@ The main features are
   }                                             \
 }
 
-// name of our two params
+// name of our params
 #define SATURATION_PARAM_NAME "saturation"
+#define RESTORE_LEVELS_PARAM_NAME "restoreLevels"
+#define DEFLICKER_PARAM_NAME "deflicker"
+#define DEFLICKER_FRAMES_PARAM_NAME "deflickerFrames"
+#define DENOISE_PARAM_NAME "temporalDenoise"
+#define DENOISE_FRAMES_PARAM_NAME "denoiseFrames"
+#define DENOISE_BUFFER_PARAM_NAME "denoiseBufferFrames"
+#define CHROMA_DETAIL_PARAM_NAME "chromaDetail"
+#define CHROMA_SIZE_PARAM_NAME "chromaDetailSize"
+#define AUTO_SATURATION_PARAM_NAME "autoSaturation"
+#define TARGET_CHROMA_PARAM_NAME "targetChroma"
+#define SMOOTHING_PARAM_NAME "smoothingFrames"
+#define CUT_THRESHOLD_PARAM_NAME "cutThreshold"
+#define GAMUT_PARAM_NAME "gamutCompression"
+#define TRANSFER_PARAM_NAME "transfer"
+#define LUT_FILE_PARAM_NAME "lutFile"
+#define GRAIN_PARAM_NAME "grainAmount"
+#define GRAIN_COLOUR_PARAM_NAME "grainColour"
+#define GRAIN_SEED_PARAM_NAME "grainSeed"
+#define BAKE_PARAM_NAME "bakeLut"
+#define DETERMINISTIC_PARAM_NAME "deterministic"
+#define FRAME_CACHE_PARAM_NAME "frameCacheSize"
+#define TILE_CACHE_PARAM_NAME "tileCache"
+#define REPEATED_FRAMES_PARAM_NAME "reuseRepeatedFrames"
+#define SCOPE_FILE_PARAM_NAME "scopeFile"
 
 // anonymous namespace to hide our symbols in
 namespace {
+  using namespace SoftSat;
+
   ////////////////////////////////////////////////////////////////////////////////
   // set of suite pointers provided by the host
   OfxHost               *gHost;
   OfxPropertySuiteV1    *gPropertySuite    = 0;
   OfxImageEffectSuiteV1 *gImageEffectSuite = 0;
   OfxParameterSuiteV1   *gParameterSuite   = 0;
+  OfxMultiThreadSuiteV1 *gMultiThreadSuite = 0;
 
   ////////////////////////////////////////////////////////////////////////////////
   // class to manage OFX images
-  class Image {
+  class Image : public ImageView {
   public    :
     // construct from a property set that represents the image
     Image(OfxPropertySetHandle propSet);
@@ -108,36 +151,19 @@ namespace {
     // destructor
     ~Image();
 
-    // get a pixel address, cast to the right type
-    template <class T>
-    T *pixelAddress(int x, int y)
-    {
-      return reinterpret_cast<T *>(rawAddress(x, y));
-    }
-
-    // Is this image empty?
-    operator bool();
+    // the host's identifier for the image content, may be NULL
+    const char *uniqueIdentifier() const { return uniqueIdentifier_; }
 
-    // bytes per component, 1, 2 or 4 for byte, short and float images
-    int bytesPerComponent() const { return bytesPerComponent_; }
-
-    // number of components
-    int nComponents() const { return nComponents_; }
+    // how much wider than tall a pixel is, which canonical x coordinates
+    // are divided by on top of the render scale to get pixels
+    double pixelAspectRatio() const { return pixelAspectRatio_; }
 
   protected :
     void construct();
 
-    // Look up a pixel address in the image. returns null if the pixel was not
-    // in the bounds of the image
-    void *rawAddress(int x, int y);
-
     OfxPropertySetHandle propSet_;
-    int rowBytes_;
-    OfxRectI bounds_;
-    char *dataPtr_;
-    int nComponents_;
-    int bytesPerComponent_;
-    int bytesPerPixel_;
+    char *uniqueIdentifier_;
+    double pixelAspectRatio_;
   };
 
   // construct from a property set
@@ -156,6 +182,7 @@ namespace {
     }
     else {
       propSet_ = NULL;
+      construct();
     }
   }
 
@@ -167,6 +194,17 @@ namespace {
       gPropertySuite->propGetIntN(propSet_, kOfxImagePropBounds, 4, &bounds_.x1);
       gPropertySuite->propGetPointer(propSet_, kOfxImagePropData, 0, (void **) &dataPtr_);
 
+      // not every host identifies images
+      uniqueIdentifier_ = NULL;
+      gPropertySuite->propGetString(propSet_, kOfxImagePropUniqueIdentifier, 0, &uniqueIdentifier_);
+
+      // square unless the host says otherwise
+      pixelAspectRatio_ = 1.0;
+      gPropertySuite->propGetDouble(propSet_, kOfxImagePropPixelAspectRatio, 0, &pixelAspectRatio_);
+      if(!(pixelAspectRatio_ > 0)) {
+        pixelAspectRatio_ = 1.0;
+      }
+
       // how many components per pixel?
       char *cstr;
       gPropertySuite->propGetString(propSet_, kOfxImageEffectPropComponents, 0, &cstr);
@@ -207,6 +245,9 @@ namespace {
       dataPtr_ = NULL;
       nComponents_ = 0;
       bytesPerComponent_ = 0;
+      bytesPerPixel_ = 0;
+      uniqueIdentifier_ = NULL;
+      pixelAspectRatio_ = 1.0;
     }
   }
 
@@ -217,398 +258,3622 @@ namespace {
       gImageEffectSuite->clipReleaseImage(propSet_);
   }
 
-  // get the address of a location in the image as a void *
-  void *Image::rawAddress(int x, int y)
+  ////////////////////////////////////////////////////////////////////////////////
+  // 64 bit hash in the style of XXH3 for spotting identical image data. Each 64
+  // byte stripe is mixed into eight 64 bit lanes, two at a time, with the SSE2
+  // 32x32->64 multiply, and the lanes are scrambled every kilobyte. It is not
+  // byte compatible with XXH3, it only has to agree with itself.
+  class ContentHash {
+  public :
+    explicit ContentHash(unsigned long long seed = 0);
+
+    // hash some more data
+    void update(const void *data, size_t length);
+
+    // hash a single plain value
+    template <class T>
+    void add(const T &value) { update(&value, sizeof(value)); }
+
+    // the hash of everything so far
+    unsigned long long digest() const;
+
+  protected :
+    void consumeStripe(const unsigned char *stripe);
+    void scramble();
+
+    enum { kStripe = 64, kStripesPerScramble = 16 };
+
+    __m128i acc_[4];
+    __m128i secret_[4];
+    unsigned char buffer_[kStripe];
+    size_t buffered_;
+    unsigned long long length_;
+    int stripes_;
+  };
+
+  const unsigned long long kPrime64_1 = 0x9E3779B185EBCA87ull;
+  const unsigned long long kPrime64_2 = 0xC2B2AE3D27D4EB4Full;
+  const unsigned int kPrime32_1 = 0x9E3779B1u;
+
+  // final mix of a 64 bit value so every input bit affects every output bit
+  static inline unsigned long long Avalanche(unsigned long long h)
   {
-    // Inside the bounds of this image?
-    if(x < bounds_.x1 || x >= bounds_.x2 || y < bounds_.y1 || y >= bounds_.y2)
-      return NULL;
+    h ^= h >> 33;
+    h *= kPrime64_2;
+    h ^= h >> 29;
+    h *= kPrime64_1;
+    h ^= h >> 32;
+    return h;
+  }
 
-    // turn image plane coordinates into offsets from the bottom left
-    int yOffset = y - bounds_.y1;
-    int xOffset = x - bounds_.x1;
+  ContentHash::ContentHash(unsigned long long seed)
+    : buffered_(0)
+    , length_(0)
+    , stripes_(0)
+  {
+    // secret lanes made from the seed, the accumulators start from primes
+    unsigned long long lanes[8];
+    unsigned long long state = seed ^ kPrime64_1;
+    for(int i = 0; i < 8; ++i) {
+      state += kPrime64_1;
+      lanes[i] = Avalanche(state);
+    }
+    for(int i = 0; i < 4; ++i) {
+      secret_[i] = _mm_loadu_si128((const __m128i *) &lanes[i * 2]);
+      acc_[i] = _mm_set_epi64x((long long) (kPrime64_2 * (i * 2 + 2)), (long long) (kPrime64_1 * (i * 2 + 1)));
+    }
+  }
 
-    // Find the start of our row, using byte arithmetic
-    char *rowStart = (dataPtr_) + yOffset * rowBytes_;
+  void ContentHash::consumeStripe(const unsigned char *stripe)
+  {
+    for(int i = 0; i < 4; ++i) {
+      __m128i data = _mm_loadu_si128((const __m128i *) (stripe + i * 16));
+      __m128i keyed = _mm_xor_si128(data, secret_[i]);
+      // low half of each 64 bit lane times its high half
+      __m128i product = _mm_mul_epu32(keyed, _mm_shuffle_epi32(keyed, _MM_SHUFFLE(3, 3, 1, 1)));
+      // and the raw data with its two lanes swapped
+      __m128i swapped = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+      acc_[i] = _mm_add_epi64(acc_[i], _mm_add_epi64(product, swapped));
+    }
 
-    // finally find the position of the first component of column
-    return rowStart + (xOffset * bytesPerPixel_);
+    if(++stripes_ == kStripesPerScramble) {
+      scramble();
+      stripes_ = 0;
+    }
   }
 
-  // are we empty?
-  Image:: operator bool()
+  void ContentHash::scramble()
   {
-    return propSet_ != NULL && dataPtr_ != NULL;
+    const __m128i prime = _mm_set1_epi32(int(kPrime32_1));
+    for(int i = 0; i < 4; ++i) {
+      __m128i acc = _mm_xor_si128(acc_[i], _mm_srli_epi64(acc_[i], 47));
+      acc = _mm_xor_si128(acc, secret_[i]);
+      // 64 bit lanes times a 32 bit prime, from two 32x32->64 multiplies
+      __m128i low = _mm_mul_epu32(acc, prime);
+      __m128i high = _mm_mul_epu32(_mm_srli_epi64(acc, 32), prime);
+      acc_[i] = _mm_add_epi64(low, _mm_slli_epi64(high, 32));
+    }
   }
 
-  ////////////////////////////////////////////////////////////////////////////////
-  // our instance data, where we are caching away clip and param handles
-  struct MyInstanceData {
-    // are we in the general context
-    bool isGeneralContext;
+  void ContentHash::update(const void *data, size_t length)
+  {
+    const unsigned char *bytes = (const unsigned char *) data;
+    length_ += length;
 
-    // handles to the clips we deal with
-    OfxImageClipHandle sourceClip;
-    OfxImageClipHandle maskClip;
-    OfxImageClipHandle outputClip;
+    // top up a partial stripe first
+    if(buffered_) {
+      size_t take = std::min(length, kStripe - buffered_);
+      memcpy(buffer_ + buffered_, bytes, take);
+      buffered_ += take;
+      bytes += take;
+      length -= take;
+      if(buffered_ < kStripe) {
+        return;
+      }
+      consumeStripe(buffer_);
+      buffered_ = 0;
+    }
 
-    // handles to a our parameters
-    OfxParamHandle saturationParam;
+    for(; length >= kStripe; bytes += kStripe, length -= kStripe) {
+      consumeStripe(bytes);
+    }
 
-    MyInstanceData()
-      : isGeneralContext(false)
-      , sourceClip(NULL)
-      , maskClip(NULL)
-      , outputClip(NULL)
-      , saturationParam(NULL)
-    {}
-  };
+    memcpy(buffer_, bytes, length);
+    buffered_ = length;
+  }
+
+  unsigned long long ContentHash::digest() const
+  {
+    ContentHash last(*this);
+    if(last.buffered_) {
+      memset(last.buffer_ + last.buffered_, 0, kStripe - last.buffered_);
+      last.consumeStripe(last.buffer_);
+    }
+
+    alignas(16) unsigned long long lanes[8];
+    for(int i = 0; i < 4; ++i) {
+      _mm_store_si128((__m128i *) &lanes[i * 2], _mm_xor_si128(last.acc_[i], last.secret_[i]));
+    }
+
+    unsigned long long h = length_ * kPrime64_1;
+    for(int i = 0; i < 8; ++i) {
+      h = Avalanche(h ^ Avalanche(lanes[i] + i));
+    }
+    return h;
+  }
 
   ////////////////////////////////////////////////////////////////////////////////
-  // get my instance data from a property set handle
-  MyInstanceData *FetchInstanceData(OfxPropertySetHandle effectProps)
+  // when and how big a file was last written, to tell if it changed
+  struct FileStamp {
+    unsigned long long writeTime;
+    unsigned long long size;
+
+    bool operator==(const FileStamp &other) const
+    {
+      return writeTime == other.writeTime && size == other.size;
+    }
+    bool operator!=(const FileStamp &other) const { return !(*this == other); }
+  };
+
+  bool GetFileStamp(const char *path, FileStamp &stamp)
   {
-    MyInstanceData *myData = 0;
-    gPropertySuite->propGetPointer(effectProps,
-                                   kOfxPropInstanceData,
-                                   0,
-                                   (void **) &myData);
-    return myData;
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if(!GetFileAttributesExA(path, GetFileExInfoStandard, &data)) {
+      return false;
+    }
+    stamp.writeTime = ((unsigned long long) data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+    stamp.size = ((unsigned long long) data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    return true;
   }
 
   ////////////////////////////////////////////////////////////////////////////////
-  // get my instance data
-  MyInstanceData *FetchInstanceData(OfxImageEffectHandle effect)
+  // binary LUT cache files, a header followed by the padded table exactly as it
+  // sits in memory so it can be mapped and used in place
+  const char kLutCacheMagic[8] = "SSLUT3D";
+  const unsigned int kLutCacheVersion = 1;
+  const char *kLutCacheSuffix = ".lutcache";
+
+  struct LutCacheHeader {
+    char magic[8];
+    unsigned int version;
+    int size;
+    float domainMin[3];
+    float domainMax[3];
+    FileStamp source;  // the .cube file this was built from
+    char padding[8];   // keeps the table 16 byte aligned
+  };
+  static_assert(sizeof(LutCacheHeader) == 64, "LUT cache header must keep the table aligned");
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // where the cache for a .cube file goes, next to it if we can write there,
+  // otherwise in the temp directory under a name made from a hash of its path
+  std::string LutCachePath(const char *path, bool sidecar)
   {
-    // get the property handle for the plugin
-    OfxPropertySetHandle effectProps;
-    gImageEffectSuite->getPropertySet(effect, &effectProps);
+    if(sidecar) {
+      return std::string(path) + kLutCacheSuffix;
+    }
 
-    // and get the instance data out of that
-    return FetchInstanceData(effectProps);
+    unsigned long long hash = 14695981039346656037ull;
+    for(const char *c = path; *c; ++c) {
+      hash = (hash ^ (unsigned char) tolower((unsigned char) *c)) * 1099511628211ull;
+    }
+
+    char tempDir[MAX_PATH + 1];
+    DWORD length = GetTempPathA(sizeof(tempDir), tempDir);
+    char name[64];
+    snprintf(name, sizeof(name), "softsat_%016llx%s", hash, kLutCacheSuffix);
+    return std::string(tempDir, length > 0 && length < sizeof(tempDir) ? length : 0) + name;
   }
 
   ////////////////////////////////////////////////////////////////////////////////
-  // get the named suite and put it in the given pointer, with error checking
-  template <class SUITE>
-  void FetchSuite(SUITE *& suite, const char *suiteName, int suiteVersion)
+  // map a LUT cache file read only, returns NULL if it is missing, damaged or
+  // was built from a different version of the source
+  std::shared_ptr<const Lut3D> MapLutCache(const std::string &cachePath, const FileStamp &source)
   {
-    suite = (SUITE *) gHost->fetchSuite(gHost->host, suiteName, suiteVersion);
-    if(!suite) {
-      ERROR_ABORT_IF(suite == NULL,
-                     "Failed to fetch %s version %d from the host.",
-                     suiteName,
-                     suiteVersion);
+    HANDLE file = CreateFileA(cachePath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+                              NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file == INVALID_HANDLE_VALUE) {
+      return NULL;
+    }
+
+    LARGE_INTEGER fileSize;
+    void *view = NULL;
+    if(GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > (long long) sizeof(LutCacheHeader)) {
+      HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+      if(mapping) {
+        view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        // the view keeps the mapping alive on its own
+        CloseHandle(mapping);
+      }
+    }
+    CloseHandle(file);
+    if(!view) {
+      return NULL;
+    }
+
+    const LutCacheHeader *header = (const LutCacheHeader *) view;
+    bool ok = memcmp(header->magic, kLutCacheMagic, sizeof(kLutCacheMagic)) == 0 &&
+              header->version == kLutCacheVersion &&
+              header->source == source &&
+              header->size >= 2 && header->size <= 256 &&
+              fileSize.QuadPart == (long long) (sizeof(LutCacheHeader) +
+                                                size_t(header->size) * header->size * header->size * 4 * sizeof(float));
+    if(!ok) {
+      UnmapViewOfFile(view);
+      return NULL;
     }
+
+    std::shared_ptr<Lut3D> lut(new Lut3D);
+    lut->size = header->size;
+    for(int c = 0; c < 3; ++c) {
+      lut->domainMin[c] = header->domainMin[c];
+      lut->domainMax[c] = header->domainMax[c];
+    }
+    lut->table = (const float *) (header + 1);
+    lut->mappedView = view;
+    return lut;
   }
 
   ////////////////////////////////////////////////////////////////////////////////
-  // The first _action_ called after the binary is loaded (three boot strapper functions will be howeever)
-  OfxStatus LoadAction(void)
+  // write a LUT cache file, going via a temporary so other processes never map
+  // a half written one
+  bool WriteLutCache(const std::string &cachePath, const Lut3D &lut, const FileStamp &source)
   {
-    // fetch our three suites
-    FetchSuite(gPropertySuite,    kOfxPropertySuite,    1);
-    FetchSuite(gImageEffectSuite, kOfxImageEffectSuite, 1);
-    FetchSuite(gParameterSuite,   kOfxParameterSuite,   1);
+    char tempSuffix[32];
+    snprintf(tempSuffix, sizeof(tempSuffix), ".%lu.tmp", (unsigned long) GetCurrentProcessId());
+    std::string tempPath = cachePath + tempSuffix;
 
-    return kOfxStatOK;
+    FILE *file = fopen(tempPath.c_str(), "wb");
+    if(!file) {
+      return false;
+    }
+
+    LutCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kLutCacheMagic, sizeof(kLutCacheMagic));
+    header.version = kLutCacheVersion;
+    header.size = lut.size;
+    for(int c = 0; c < 3; ++c) {
+      header.domainMin[c] = lut.domainMin[c];
+      header.domainMax[c] = lut.domainMax[c];
+    }
+    header.source = source;
+
+    size_t tableCount = size_t(lut.nEntries()) * 4;
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(lut.table, sizeof(float), tableCount, file) == tableCount;
+    ok = fclose(file) == 0 && ok;
+
+    ok = ok && MoveFileExA(tempPath.c_str(), cachePath.c_str(), MOVEFILE_REPLACE_EXISTING);
+    if(!ok) {
+      DeleteFileA(tempPath.c_str());
+    }
+    return ok;
   }
 
   ////////////////////////////////////////////////////////////////////////////////
-  // the plugin's basic description routine
-  OfxStatus DescribeAction(OfxImageEffectHandle descriptor)
+  // process wide store of LUTs, so each file is parsed once and every instance
+  // using it shares the one read only copy
+  class LutStore {
+  public :
+    // get the LUT in the given .cube file, NULL if it can't be read
+    std::shared_ptr<const Lut3D> fetch(const char *path);
+
+  protected :
+    // load a LUT from its cache, making the cache first if need be
+    std::shared_ptr<const Lut3D> load(const char *path, const FileStamp &stamp);
+
+    // each path has its own lock, held while it loads, so a slow file only
+    // holds up those waiting on the same one
+    struct Entry {
+      std::mutex mutex;
+      FileStamp stamp;
+      std::weak_ptr<const Lut3D> lut;
+    };
+
+    std::mutex mutex_;
+    std::map<std::string, std::shared_ptr<Entry> > entries_;
+  };
+
+  std::shared_ptr<const Lut3D> LutStore::fetch(const char *path)
   {
-    // get the property set handle for the plugin
-    OfxPropertySetHandle effectProps;
-    gImageEffectSuite->getPropertySet(descriptor, &effectProps);
+    FileStamp stamp;
+    if(!GetFileStamp(path, stamp)) {
+      return NULL;
+    }
 
-    // set some labels and the group it belongs to
-    gPropertySuite->propSetString(effectProps,
-                                  kOfxPropLabel,
-                                  0,
-                                  "OFX Saturation Example");
-    gPropertySuite->propSetString(effectProps,
-                                  kOfxImageEffectPluginPropGrouping,
-                                  0,
-                                  "OFX Example");
+    std::shared_ptr<Entry> entry;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
 
-    // define the image effects contexts we can be used in, in this case a filter
-    // and a general effect
-    gPropertySuite->propSetString(effectProps,
-                                  kOfxImageEffectPropSupportedContexts,
-                                  0,
-                                  kOfxImageEffectContextFilter);
+      // drop entries for LUTs nobody is using or loading any more, no one
+      // else holding an entry means no one else can be looking at its LUT
+      for(std::map<std::string, std::shared_ptr<Entry> >::iterator it = entries_.begin(); it != entries_.end(); ) {
+        if(it->second.use_count() == 1 && it->second->lut.expired()) {
+          it = entries_.erase(it);
+        }
+        else {
+          ++it;
+        }
+      }
 
-    gPropertySuite->propSetString(effectProps,
-                                  kOfxImageEffectPropSupportedContexts,
-                                  1,
-                                  kOfxImageEffectContextGeneral);
+      std::shared_ptr<Entry> &found = entries_[path];
+      if(!found) {
+        found.reset(new Entry());
+      }
+      entry = found;
+    }
 
-    // set the bit depths the plugin can handle
-    gPropertySuite->propSetString(effectProps,
-                                  kOfxImageEffectPropSupportedPixelDepths,
-                                  0,
-                                  kOfxBitDepthFloat);
-    gPropertySuite->propSetString(effectProps,
-                                  kOfxImageEffectPropSupportedPixelDepths,
-                                  1,
-                                  kOfxBitDepthShort);
-    gPropertySuite->propSetString(effectProps,
-                                  kOfxImageEffectPropSupportedPixelDepths,
-                                  2,
-                                  kOfxBitDepthByte);
+    std::lock_guard<std::mutex> lock(entry->mutex);
 
-    // say that a single instance of this plugin can be rendered in multiple threads
-    gPropertySuite->propSetString(effectProps,
-                                  kOfxImageEffectPluginRenderThreadSafety,
-                                  0,
-                                  kOfxImageEffectRenderFullySafe);
+    // already loaded by someone and not changed on disk since?
+    if(entry->stamp == stamp) {
+      std::shared_ptr<const Lut3D> lut = entry->lut.lock();
+      if(lut) {
+        return lut;
+      }
+    }
 
-    // say that the host should manage SMP threading over a single frame
-    gPropertySuite->propSetInt(effectProps,
-                               kOfxImageEffectPluginPropHostFrameThreading,
-                               0,
-                               1);
-    return kOfxStatOK;
+    std::shared_ptr<const Lut3D> lut = load(path, stamp);
+    if(lut) {
+      entry->stamp = stamp;
+      entry->lut = lut;
+    }
+    return lut;
   }
 
-  ////////////////////////////////////////////////////////////////////////////////
-  //  describe the plugin in context
-  OfxStatus
-  DescribeInContextAction(OfxImageEffectHandle descriptor,
-                          OfxPropertySetHandle inArgs)
+  std::shared_ptr<const Lut3D> LutStore::load(const char *path, const FileStamp &stamp)
   {
-    // get the context we are being described for
-    char *context;
-    gPropertySuite->propGetString(inArgs, kOfxImageEffectPropContext, 0, &context);
+    // try the sidecar first, then the temp directory
+    for(int sidecar = 1; sidecar >= 0; --sidecar) {
+      std::shared_ptr<const Lut3D> lut = MapLutCache(LutCachePath(path, sidecar != 0), stamp);
+      if(lut) {
+        return lut;
+      }
+    }
 
-    OfxPropertySetHandle props;
-    // define the mandated single output clip
-    gImageEffectSuite->clipDefine(descriptor, "Output", &props);
+    // no usable cache, parse the text and cache it for next time
+    std::shared_ptr<Lut3D> parsed(new Lut3D);
+    if(!ReadCubeFile(path, *parsed)) {
+      return NULL;
+    }
 
-    // set the component types we can handle on out output
-    gPropertySuite->propSetString(props,
-                                  kOfxImageEffectPropSupportedComponents,
-                                  0,
-                                  kOfxImageComponentRGBA);
-    gPropertySuite->propSetString(props,
-                                  kOfxImageEffectPropSupportedComponents,
-                                  1,
-                                  kOfxImageComponentRGB);
+    for(int sidecar = 1; sidecar >= 0; --sidecar) {
+      std::string cachePath = LutCachePath(path, sidecar != 0);
+      if(WriteLutCache(cachePath, *parsed, stamp)) {
+        std::shared_ptr<const Lut3D> lut = MapLutCache(cachePath, stamp);
+        if(lut) {
+          return lut;
+        }
+      }
+    }
 
-    // define the mandated single source clip
-    gImageEffectSuite->clipDefine(descriptor, "Source", &props);
+    // couldn't cache it anywhere, use it from memory
+    return parsed;
+  }
 
-    // set the component types we can handle on our main input
-    gPropertySuite->propSetString(props,
-                                  kOfxImageEffectPropSupportedComponents,
-                                  0,
-                                  kOfxImageComponentRGBA);
-    gPropertySuite->propSetString(props,
-                                  kOfxImageEffectPropSupportedComponents,
-                                  1,
-                                  kOfxImageComponentRGB);
+  // the one store for the whole process
+  LutStore gLutStore;
 
-    if(strcmp(context, kOfxImageEffectContextGeneral) == 0) {
-      gImageEffectSuite->clipDefine(descriptor, "Mask", &props);
+  ////////////////////////////////////////////////////////////////////////////////
+  // a shared pointer that render threads can read without ever taking a lock,
+  // while a writer swaps in new values RCU style. Readers copy the pointer out
+  // inside a tiny critical section counted per epoch, and a writer frees the
+  // cell it swapped out only once both epochs have drained.
+  template <class T>
+  class RcuPointer {
+  public :
+    RcuPointer()
+      : current_(new std::shared_ptr<const T>())
+      , epoch_(0)
+    {
+      readers_[0] = 0;
+      readers_[1] = 0;
+    }
 
-      // set the component types we can handle on our main input
-      gPropertySuite->propSetString(props,
-                                    kOfxImageEffectPropSupportedComponents,
-                                    0,
-                                    kOfxImageComponentAlpha);
-      gPropertySuite->propSetInt(props,
-                                 kOfxImageClipPropOptional,
-                                 0,
-                                 1);
-      gPropertySuite->propSetInt(props,
-                                 kOfxImageClipPropIsMask,
-                                 0,
-                                 1);
+    ~RcuPointer()
+    {
+      delete current_.load();
     }
 
+    // take a reference to the current value, wait free
+    std::shared_ptr<const T> get() const
+    {
+      unsigned epoch = epoch_.load();
+      readers_[epoch & 1].fetch_add(1);
+      std::shared_ptr<const T> value = *current_.load();
+      readers_[epoch & 1].fetch_sub(1);
+      return value;
+    }
 
-    // first get the handle to the parameter set
-    OfxParamSetHandle paramSet;
-    gImageEffectSuite->getParamSet(descriptor, &paramSet);
+    // swap in a new value, in flight readers carry on with the old one
+    void publish(std::shared_ptr<const T> value)
+    {
+      std::lock_guard<std::mutex> lock(writeMutex_);
+      const std::shared_ptr<const T> *old = current_.exchange(new std::shared_ptr<const T>(std::move(value)));
+
+      // flip twice, so readers that picked up an epoch just before the
+      // first flip are waited for as well
+      for(int flip = 0; flip < 2; ++flip) {
+        unsigned epoch = epoch_.fetch_add(1);
+        while(readers_[epoch & 1].load() != 0) {
+          std::this_thread::yield();
+        }
+      }
+      delete old;
+    }
+
+  protected :
+    std::atomic<const std::shared_ptr<const T> *> current_;
+    std::atomic<unsigned> epoch_;
+    mutable std::atomic<int> readers_[2];
+    std::mutex writeMutex_;
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // where an instance's LUT lives, shared with the watcher so it can swap the
+  // LUT when its file changes
+  struct LutSlot {
+    RcuPointer<Lut3D> lut;
+  };
+
+  // how often the watcher looks for changed LUT files
+  const int kLutPollMilliseconds = 1000;
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // background thread that polls the LUT files instances are using and reloads
+  // them when they change on disk. Loading happens on the watcher's thread, render
+  // threads only ever see a complete LUT swapped in. Polling rather than change
+  // notifications, as those are unreliable on the network shares looks live on.
+  class LutWatcher {
+  public :
+    LutWatcher()
+      : stopping_(false)
+    {}
+
+    ~LutWatcher()
+    {
+      stop();
+    }
+
+    // set a slot's LUT and keep it up to date with the given file, an empty
+    // path stops watching
+    void assign(const std::shared_ptr<LutSlot> &slot,
+                const std::string &path,
+                const FileStamp &stamp,
+                const std::shared_ptr<const Lut3D> &lut);
+
+    // stop the background thread, waiting for it to finish
+    void stop();
+
+  protected :
+    void run();
+
+    struct Watched {
+      std::weak_ptr<LutSlot> slot;
+      std::string path;
+      FileStamp stamp;
+    };
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::vector<Watched> watched_;
+    std::thread thread_;
+    bool stopping_;
+  };
+
+  void LutWatcher::assign(const std::shared_ptr<LutSlot> &slot,
+                          const std::string &path,
+                          const FileStamp &stamp,
+                          const std::shared_ptr<const Lut3D> &lut)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // publishing under our lock keeps us from racing a reload of the old file
+    slot->lut.publish(lut);
+
+    std::vector<Watched>::iterator found = watched_.begin();
+    while(found != watched_.end() && found->slot.lock() != slot) {
+      ++found;
+    }
+
+    if(path.empty()) {
+      if(found != watched_.end()) {
+        watched_.erase(found);
+      }
+      return;
+    }
+
+    if(found == watched_.end()) {
+      found = watched_.insert(watched_.end(), Watched());
+      found->slot = slot;
+    }
+    found->path = path;
+    found->stamp = stamp;
+
+    if(!thread_.joinable() && !stopping_) {
+      thread_ = std::thread(&LutWatcher::run, this);
+    }
+  }
+
+  void LutWatcher::stop()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_all();
+    if(thread_.joinable()) {
+      thread_.join();
+    }
+
+    // so we can start up again if the binary is loaded again
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = false;
+  }
+
+  void LutWatcher::run()
+  {
+    struct Reload {
+      std::string path;
+      FileStamp oldStamp;
+      FileStamp newStamp;
+      std::shared_ptr<const Lut3D> lut;
+    };
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    while(!stopping_) {
+      wake_.wait_for(lock, std::chrono::milliseconds(kLutPollMilliseconds));
+      if(stopping_) {
+        break;
+      }
+
+      // forget instances that have gone, and find the files we are watching
+      std::vector<Reload> reloads;
+      for(std::vector<Watched>::iterator it = watched_.begin(); it != watched_.end(); ) {
+        if(it->slot.expired()) {
+          it = watched_.erase(it);
+          continue;
+        }
+        bool seen = false;
+        for(size_t i = 0; i < reloads.size() && !seen; ++i) {
+          seen = reloads[i].path == it->path && reloads[i].oldStamp == it->stamp;
+        }
+        if(!seen) {
+          Reload reload;
+          reload.path = it->path;
+          reload.oldStamp = it->stamp;
+          reloads.push_back(reload);
+        }
+        ++it;
+      }
+
+      // stat and reload without holding the lock, this is the slow bit
+      lock.unlock();
+      for(size_t i = 0; i < reloads.size(); ++i) {
+        Reload &reload = reloads[i];
+        if(GetFileStamp(reload.path.c_str(), reload.newStamp) && reload.newStamp != reload.oldStamp) {
+          // a file caught half written won't parse, we'll try again next time round
+          reload.lut = gLutStore.fetch(reload.path.c_str());
+          MESSAGE(" reloaded LUT '%s'", reload.path.c_str());
+        }
+      }
+      lock.lock();
+
+      // swap the new LUTs into anyone still watching that version of the file
+      for(size_t i = 0; i < reloads.size(); ++i) {
+        if(!reloads[i].lut) {
+          continue;
+        }
+        for(size_t w = 0; w < watched_.size(); ++w) {
+          Watched &watched = watched_[w];
+          std::shared_ptr<LutSlot> slot = watched.slot.lock();
+          if(slot && watched.path == reloads[i].path && watched.stamp == reloads[i].oldStamp) {
+            watched.stamp = reloads[i].newStamp;
+            slot->lut.publish(reloads[i].lut);
+          }
+        }
+      }
+    }
+  }
+
+  // the one watcher for the whole process
+  LutWatcher gLutWatcher;
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // hash of everything in the settings that affects a rendered pixel
+  unsigned long long HashSettings(const RenderSettings &settings)
+  {
+    ContentHash hash;
+    hash.add(settings.saturation);
+    hash.add(settings.transfer);
+    hash.add(settings.restoreLevels);
+    if(settings.restoreLevels) {
+      hash.add(settings.levels);
+    }
+    hash.add(settings.exposure);
+    hash.add(settings.gamutCompression);
+    hash.add(settings.denoiseStrength);
+    if(settings.denoiseStrength > 0) {
+      hash.add(settings.denoiseCount);
+      for(int i = 0; i < settings.denoiseCount; ++i) {
+        hash.add(settings.denoiseFrames[i]->identity);
+      }
+    }
+    hash.add(settings.chromaDetail);
+    if(settings.chromaDetail != 0) {
+      hash.add(settings.chromaRadius);
+    }
+    hash.add(settings.lut ? settings.lut->id : 0ull);
+    hash.add(settings.grainAmount);
+    if(settings.grainAmount > 0) {
+      // grain differs from frame to frame, so a cached render is only any
+      // good at its own time
+      hash.add(settings.grainColour);
+      hash.add(settings.grainSeed);
+      hash.add(settings.grainTime);
+    }
+    hash.add(settings.bake);
+    hash.add(settings.deterministic);
+    return hash.digest();
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // hash of everything in the settings that SameColorTransform compares, along
+  // with the size of table they are to be baked into
+  unsigned long long HashColorTransform(const RenderSettings &settings, int size)
+  {
+    ContentHash hash;
+    hash.add(size);
+    hash.add(settings.saturation);
+    hash.add(settings.transfer);
+    hash.add(settings.restoreLevels);
+    if(settings.restoreLevels) {
+      hash.add(settings.levels);
+    }
+    hash.add(settings.exposure);
+    hash.add(settings.gamutCompression);
+    hash.add(settings.deterministic);
+    hash.add(settings.lut ? settings.lut->id : 0ull);
+    return hash.digest();
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // hash the pixels of an image that fall in a window, along with where they are
+  unsigned long long HashImageWindow(Image &image, OfxRectI window)
+  {
+    ContentHash hash;
+    if(image) {
+      const OfxRectI &bounds = image.bounds();
+      OfxRectI area = window;
+      area.x1 = std::max(area.x1, bounds.x1);
+      area.y1 = std::max(area.y1, bounds.y1);
+      area.x2 = std::max(std::min(area.x2, bounds.x2), area.x1);
+      area.y2 = std::max(std::min(area.y2, bounds.y2), area.y1);
+      hash.add(area);
+      hash.add(image.bytesPerPixel());
+
+      size_t rowLength = size_t(area.x2 - area.x1) * image.bytesPerPixel();
+      for(int y = area.y1; rowLength && y < area.y2; ++y) {
+        hash.update(image.pixelAddress<unsigned char>(area.x1, y), rowLength);
+      }
+    }
+    return hash.digest();
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // something that identifies an image's content, the host's identifier if it
+  // gives us one, otherwise a hash of the pixels in the window
+  unsigned long long ImageIdentity(Image &image, OfxRectI window)
+  {
+    const char *identifier = image.uniqueIdentifier();
+    if(identifier && *identifier) {
+      ContentHash hash(1);
+      hash.update(identifier, strlen(identifier));
+      return hash.digest();
+    }
+    return HashImageWindow(image, window);
+  }
+
+  // how many pixels across and down a fingerprint looks at
+  const int kFingerprintGrid = 64;
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // a cheap check that an image is the one we saw before, for each render of a
+  // frame to make without going over all of it. The host's identifier if it
+  // gives us one, otherwise a hash of the image's bounds and of the pixels on
+  // a grid spread over it, which any change upstream worth the name touches.
+  unsigned long long ImageFingerprint(Image &image)
+  {
+    const char *identifier = image.uniqueIdentifier();
+    if(identifier && *identifier) {
+      return ImageIdentity(image, image.bounds());
+    }
+
+    ContentHash hash(2);
+    const OfxRectI &bounds = image.bounds();
+    hash.add(bounds);
+    hash.add(image.bytesPerPixel());
+    long long width = bounds.x2 - bounds.x1, height = bounds.y2 - bounds.y1;
+    for(int j = 0; width > 0 && height > 0 && j < kFingerprintGrid; ++j) {
+      int y = bounds.y1 + int(height * (2 * j + 1) / (2 * kFingerprintGrid));
+      for(int i = 0; i < kFingerprintGrid; ++i) {
+        int x = bounds.x1 + int(width * (2 * i + 1) / (2 * kFingerprintGrid));
+        hash.update(image.pixelAddress<unsigned char>(x, y), image.bytesPerPixel());
+      }
+    }
+    return hash.digest();
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // everything a rendered window depends on
+  struct RenderCacheKey {
+    OfxTime time;
+    OfxRectI window;
+    double renderScale[2];
+    int bytesPerPixel;
+    unsigned long long settings;
+    unsigned long long source;
+    unsigned long long mask;
+
+    bool operator==(const RenderCacheKey &other) const
+    {
+      return time == other.time &&
+             window.x1 == other.window.x1 && window.y1 == other.window.y1 &&
+             window.x2 == other.window.x2 && window.y2 == other.window.y2 &&
+             renderScale[0] == other.renderScale[0] && renderScale[1] == other.renderScale[1] &&
+             bytesPerPixel == other.bytesPerPixel &&
+             settings == other.settings &&
+             source == other.source &&
+             mask == other.mask;
+    }
+
+    // fold the key down to 64 bits for looking it up
+    unsigned long long digest() const
+    {
+      ContentHash hash;
+      hash.add(time);
+      hash.add(window);
+      hash.add(renderScale);
+      hash.add(bytesPerPixel);
+      hash.add(settings);
+      hash.add(source);
+      hash.add(mask);
+      return hash.digest();
+    }
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // bounded LRU cache of rendered windows, so a host asking for the same pixels
+  // again gets a copy instead of a render. Used for whole render windows and
+  // for the tiles of static regions.
+  class RenderCache {
+  public :
+    RenderCache()
+      : capacity_(0)
+      , used_(0)
+      , hits_(0)
+      , misses_(0)
+    {}
+
+    // set the most memory we may use, evicting as needed, 0 turns us off
+    void setCapacity(size_t bytes);
+    bool enabled() const { return capacity_ > 0; }
+
+    // copy a cached render into the output's window, false if we don't have one
+    bool fetch(const RenderCacheKey &key, Image &output);
+
+    // remember what was rendered into the output's window
+    void store(const RenderCacheKey &key, Image &output);
+
+    unsigned long long hits() const { return hits_; }
+    unsigned long long misses() const { return misses_; }
+
+  protected :
+    void evict(size_t capacity);
+
+    struct Entry {
+      RenderCacheKey key;
+      std::shared_ptr<const std::vector<unsigned char> > pixels;
+    };
+    typedef std::list<Entry> EntryList;
+
+    std::mutex mutex_;
+    EntryList entries_; // most recently used first
+    std::unordered_multimap<unsigned long long, EntryList::iterator> index_;
+    size_t capacity_;
+    size_t used_;
+    std::atomic<unsigned long long> hits_;
+    std::atomic<unsigned long long> misses_;
+  };
+
+  void RenderCache::setCapacity(size_t bytes)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    capacity_ = bytes;
+    evict(capacity_);
+  }
+
+  void RenderCache::evict(size_t capacity)
+  {
+    while(used_ > capacity && !entries_.empty()) {
+      EntryList::iterator last = --entries_.end();
+      unsigned long long digest = last->key.digest();
+      for(auto it = index_.find(digest); it != index_.end() && it->first == digest; ++it) {
+        if(it->second == last) {
+          index_.erase(it);
+          break;
+        }
+      }
+      used_ -= last->pixels->size();
+      entries_.erase(last);
+    }
+  }
+
+  bool RenderCache::fetch(const RenderCacheKey &key, Image &output)
+  {
+    unsigned long long digest = key.digest();
+    std::shared_ptr<const std::vector<unsigned char> > pixels;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for(auto it = index_.find(digest); it != index_.end() && it->first == digest; ++it) {
+        if(it->second->key == key) {
+          entries_.splice(entries_.begin(), entries_, it->second);
+          pixels = it->second->pixels;
+          break;
+        }
+      }
+    }
+
+    if(!pixels) {
+      ++misses_;
+      return false;
+    }
+    ++hits_;
+
+    // copy out without holding the lock
+    const OfxRectI &window = key.window;
+    size_t rowLength = size_t(window.x2 - window.x1) * key.bytesPerPixel;
+    const unsigned char *row = pixels->data();
+    for(int y = window.y1; y < window.y2; ++y, row += rowLength) {
+      memcpy(output.pixelAddress<unsigned char>(window.x1, y), row, rowLength);
+    }
+    return true;
+  }
+
+  void RenderCache::store(const RenderCacheKey &key, Image &output)
+  {
+    const OfxRectI &window = key.window;
+    size_t rowLength = size_t(window.x2 - window.x1) * key.bytesPerPixel;
+    size_t size = rowLength * (window.y2 - window.y1);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if(size == 0 || size > capacity_) {
+        return;
+      }
+    }
+
+    std::shared_ptr<std::vector<unsigned char> > pixels(new std::vector<unsigned char>(size));
+    unsigned char *row = pixels->data();
+    for(int y = window.y1; y < window.y2; ++y, row += rowLength) {
+      memcpy(row, output.pixelAddress<unsigned char>(window.x1, y), rowLength);
+    }
+
+    unsigned long long digest = key.digest();
+    std::lock_guard<std::mutex> lock(mutex_);
+    for(auto it = index_.find(digest); it != index_.end() && it->first == digest; ++it) {
+      if(it->second->key == key) {
+        // someone beat us to it
+        return;
+      }
+    }
+    if(size > capacity_) {
+      return;
+    }
+    evict(capacity_ - size);
+    Entry entry;
+    entry.key = key;
+    entry.pixels = pixels;
+    entries_.push_front(entry);
+    index_.insert(std::make_pair(digest, entries_.begin()));
+    used_ += size;
+  }
+
+  // edge length of the tiles static regions are cached in, tiles sit on a grid
+  // in pixel space so they line up from one frame to the next
+  const int kCacheTileSize = 64;
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // how colourful a frame is. Chroma is a pixel's distance from the grey with
+  // the same average, measured where saturation is applied, so it scales
+  // directly with the saturation.
+  struct ChromaStats {
+    float mean;
+    float median;
+    float percentile95;
+  };
+
+  // bins per channel in the coarse histograms used to spot scene cuts
+  const int kCutBins = 32;
+
+  // bins per channel in the histograms black and white points are found from,
+  // about a 10 bit code value each. A thread's chroma, luma, level and cut
+  // bins together come to about 20K, so they stay in L1 alongside the pixels.
+  const int kLevelBins = 1024;
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // what the analysis pass finds out about a frame. Its chroma, its median
+  // luma in linear light, a coarse histogram of each channel as it came in, as
+  // fractions of the pixels looked at, and a fine one of each channel's values
+  // over [0, 1] as counts.
+  struct FrameAnalysis {
+    ChromaStats chroma;
+    float lumaMedian;
+    float cutHistogram[3][kCutBins];
+    unsigned int levelHistogram[3][kLevelBins];
+    unsigned long long levelCount;
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // statistics of recent frames by time, so the tiles of a frame share one
+  // analysis pass and temporal smoothing can reuse the passes over its
+  // neighbours. Frames are spread over shards by frame number, so renders of
+  // nearby frames rarely contend for a lock, and each shard keeps only its
+  // most recently used frames. The first render thread to want a frame's
+  // statistics works them out holding the entry's mutex, any others wait for
+  // it there.
+  class FrameStatsCache {
+  public :
+    struct Entry {
+      std::mutex mutex;
+      bool ready;        // has a render looked at this frame yet
+      bool valid;        // and was there a frame there to look at
+      unsigned long long source;  // fingerprint of the image the stats came from
+      FrameAnalysis analysis;
+
+      // how different the frame is from the one before, negative until
+      // someone has compared them
+      float cutDifference;
+    };
+
+    // the entry for a frame, made if need be
+    std::shared_ptr<Entry> fetch(OfxTime time, double renderScale, TransferFunction transfer);
+
+    // forget everything, the source has changed under us
+    void clear();
+
+  protected :
+    enum { kShards = 16, kMaxEntriesPerShard = 8 };
+
+    struct Key {
+      OfxTime time;
+      double renderScale;
+      TransferFunction transfer;
+
+      bool operator<(const Key &other) const
+      {
+        if(time != other.time) return time < other.time;
+        if(renderScale != other.renderScale) return renderScale < other.renderScale;
+        return transfer < other.transfer;
+      }
+    };
+
+    struct Slot {
+      std::shared_ptr<Entry> entry;
+      unsigned long long lastUsed;
+    };
+
+    struct Shard {
+      std::mutex mutex;
+      std::map<Key, Slot> slots;
+      unsigned long long clock;
+
+      Shard() : clock(0) {}
+    };
+
+    Shard shards_[kShards];
+  };
+
+  std::shared_ptr<FrameStatsCache::Entry> FrameStatsCache::fetch(OfxTime time,
+                                                                 double renderScale,
+                                                                 TransferFunction transfer)
+  {
+    Key key;
+    key.time = time;
+    key.renderScale = renderScale;
+    key.transfer = transfer;
+
+    Shard &shard = shards_[(unsigned int) (long long) floor(time) % kShards];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    Slot &slot = shard.slots[key];
+    slot.lastUsed = ++shard.clock;
+    if(!slot.entry) {
+      slot.entry.reset(new Entry);
+      slot.entry->ready = false;
+      slot.entry->valid = false;
+      slot.entry->source = 0;
+      slot.entry->cutDifference = -1.0f;
+
+      // make room by dropping the least recently used frame
+      if(shard.slots.size() > kMaxEntriesPerShard) {
+        std::map<Key, Slot>::iterator oldest = shard.slots.begin();
+        for(std::map<Key, Slot>::iterator it = shard.slots.begin(); it != shard.slots.end(); ++it) {
+          if(it->second.lastUsed < oldest->second.lastUsed) {
+            oldest = it;
+          }
+        }
+        shard.slots.erase(oldest);
+      }
+    }
+    return slot.entry;
+  }
+
+  void FrameStatsCache::clear()
+  {
+    for(int i = 0; i < kShards; ++i) {
+      std::lock_guard<std::mutex> lock(shards_[i].mutex);
+      shards_[i].slots.clear();
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // what we know about shots, the first frame of the shot each frame we have
+  // looked at belongs to, and the levels worked out for each shot. Shots
+  // depend on the cut threshold, so changing it starts us afresh.
+  class ShotCache {
+  public :
+    struct Entry {
+      std::mutex mutex;
+      bool ready;
+      Levels levels;
+    };
+
+    ShotCache() : threshold_(-1.0f) {}
+
+    // the first frame of the frame's shot, if we know it
+    bool findStart(OfxTime time, float threshold, OfxTime &start);
+
+    // remember where the frame's shot starts
+    void setStart(OfxTime time, float threshold, OfxTime start);
+
+    // the levels entry for the shot starting at the given frame, made if need be
+    std::shared_ptr<Entry> fetchLevels(OfxTime start);
+
+    // forget everything
+    void clear();
+
+  protected :
+    void checkThreshold(float threshold);
+
+    // more than any one session should ever render, it just stops the maps
+    // growing without end
+    enum { kMaxFrames = 1 << 16, kMaxShots = 256 };
+
+    std::mutex mutex_;
+    float threshold_;
+    std::map<OfxTime, OfxTime> starts_;
+    std::map<OfxTime, std::shared_ptr<Entry> > levels_;
+  };
+
+  void ShotCache::checkThreshold(float threshold)
+  {
+    if(threshold != threshold_) {
+      starts_.clear();
+      levels_.clear();
+      threshold_ = threshold;
+    }
+  }
+
+  bool ShotCache::findStart(OfxTime time, float threshold, OfxTime &start)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    checkThreshold(threshold);
+    std::map<OfxTime, OfxTime>::const_iterator it = starts_.find(time);
+    if(it == starts_.end()) {
+      return false;
+    }
+    start = it->second;
+    return true;
+  }
+
+  void ShotCache::setStart(OfxTime time, float threshold, OfxTime start)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    checkThreshold(threshold);
+    if(starts_.size() >= kMaxFrames) {
+      starts_.clear();
+    }
+    starts_[time] = start;
+  }
+
+  std::shared_ptr<ShotCache::Entry> ShotCache::fetchLevels(OfxTime start)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::shared_ptr<Entry> entry = levels_[start];
+    if(!entry) {
+      entry.reset(new Entry);
+      entry->ready = false;
+      levels_[start] = entry;
+      if(levels_.size() > kMaxShots) {
+        // drop the shot furthest from this one, the least likely to be wanted again
+        std::map<OfxTime, std::shared_ptr<Entry> >::iterator first = levels_.begin(), last = --levels_.end();
+        levels_.erase(start - first->first > last->first - start ? first : last);
+      }
+    }
+    return entry;
+  }
+
+  void ShotCache::clear()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    starts_.clear();
+    levels_.clear();
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // ring buffer of copies of recent source frames, so rendering a sequence in
+  // order fetches each frame from the host once for temporal denoising rather
+  // than once for every frame that looks at it. Holds at most the capacity's
+  // worth of frames, a new frame takes the place of the oldest.
+  class SourceFrameRing {
+  public :
+    SourceFrameRing() : next_(0) {}
+
+    // set how many frames we may hold, dropping them all if it changes
+    void setCapacity(int frames);
+
+    // copy the frame being rendered in, unless we have it already. If we have
+    // a different image for the frame, something upstream changed and every
+    // frame we hold is suspect, so we start again.
+    void storeCurrent(Image &src, OfxTime time, double renderScale);
+
+    // get a frame covering the area from the clip, only fetching it from the
+    // host if we don't have it, NULL if there is no frame there
+    std::shared_ptr<const SourceFrame> fetch(OfxImageClipHandle clip,
+                                             OfxTime time,
+                                             double renderScale,
+                                             const OfxRectI &area);
+
+  protected :
+    std::shared_ptr<const SourceFrame> find(OfxTime time, double renderScale, const OfxRectI &area);
+    void insert(const std::shared_ptr<const SourceFrame> &frame);
+    static std::shared_ptr<const SourceFrame> copy(Image &src, OfxTime time, double renderScale);
+
+    std::mutex mutex_;
+    std::vector<std::shared_ptr<const SourceFrame> > slots_;
+    size_t next_;
+  };
+
+  void SourceFrameRing::setCapacity(int frames)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if(slots_.size() != size_t(frames)) {
+      slots_.assign(frames, std::shared_ptr<const SourceFrame>());
+      next_ = 0;
+    }
+  }
+
+  std::shared_ptr<const SourceFrame> SourceFrameRing::find(OfxTime time, double renderScale, const OfxRectI &area)
+  {
+    for(size_t i = 0; i < slots_.size(); ++i) {
+      const SourceFrame *frame = slots_[i].get();
+      if(frame && frame->time == time && frame->renderScale == renderScale &&
+         frame->bounds.x1 <= area.x1 && frame->bounds.y1 <= area.y1 &&
+         frame->bounds.x2 >= area.x2 && frame->bounds.y2 >= area.y2) {
+        return slots_[i];
+      }
+    }
+    return std::shared_ptr<const SourceFrame>();
+  }
+
+  void SourceFrameRing::insert(const std::shared_ptr<const SourceFrame> &frame)
+  {
+    if(slots_.empty()) {
+      return;
+    }
+
+    // a frame we already have, likely fetched by another render meanwhile,
+    // is replaced where it is
+    for(size_t i = 0; i < slots_.size(); ++i) {
+      if(slots_[i] && slots_[i]->time == frame->time && slots_[i]->renderScale == frame->renderScale) {
+        slots_[i] = frame;
+        return;
+      }
+    }
+    slots_[next_] = frame;
+    next_ = (next_ + 1) % slots_.size();
+  }
+
+  std::shared_ptr<const SourceFrame> SourceFrameRing::copy(Image &src, OfxTime time, double renderScale)
+  {
+    std::shared_ptr<SourceFrame> frame(new SourceFrame);
+    frame->time = time;
+    frame->renderScale = renderScale;
+    frame->bounds = src.bounds();
+    frame->nComponents = src.nComponents();
+    frame->bytesPerComponent = src.bytesPerComponent();
+    frame->rowBytes = (frame->bounds.x2 - frame->bounds.x1) * src.bytesPerPixel();
+    frame->identity = ImageIdentity(src, src.bounds());
+    frame->fingerprint = ImageFingerprint(src);
+
+    frame->pixels.resize(size_t(frame->rowBytes) * (frame->bounds.y2 - frame->bounds.y1));
+    unsigned char *row = frame->pixels.data();
+    for(int y = frame->bounds.y1; y < frame->bounds.y2; ++y, row += frame->rowBytes) {
+      memcpy(row, src.pixelAddress<unsigned char>(frame->bounds.x1, y), frame->rowBytes);
+    }
+    return frame;
+  }
+
+  void SourceFrameRing::storeCurrent(Image &src, OfxTime time, double renderScale)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if(slots_.empty()) {
+        return;
+      }
+      std::shared_ptr<const SourceFrame> held = find(time, renderScale, src.bounds());
+      if(held) {
+        const OfxRectI &bounds = held->bounds;
+        bool sameArea = bounds.x1 == src.bounds().x1 && bounds.y1 == src.bounds().y1 &&
+                        bounds.x2 == src.bounds().x2 && bounds.y2 == src.bounds().y2;
+        if(!sameArea || held->fingerprint == ImageFingerprint(src)) {
+          return;
+        }
+        std::fill(slots_.begin(), slots_.end(), std::shared_ptr<const SourceFrame>());
+        next_ = 0;
+      }
+    }
+
+    // copy outside the lock so other renders are never held up by it
+    std::shared_ptr<const SourceFrame> frame = copy(src, time, renderScale);
+    std::lock_guard<std::mutex> lock(mutex_);
+    insert(frame);
+  }
+
+  std::shared_ptr<const SourceFrame> SourceFrameRing::fetch(OfxImageClipHandle clip,
+                                                            OfxTime time,
+                                                            double renderScale,
+                                                            const OfxRectI &area)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      std::shared_ptr<const SourceFrame> held = find(time, renderScale, area);
+      if(held) {
+        return held;
+      }
+    }
+
+    Image src(clip, time);
+    if(!src) {
+      return std::shared_ptr<const SourceFrame>();
+    }
+    std::shared_ptr<const SourceFrame> frame = copy(src, time, renderScale);
+    std::lock_guard<std::mutex> lock(mutex_);
+    insert(frame);
+    return frame;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // the scopes of the frames being rendered, merged from every render of a
+  // window of them, and written out to a file once the windows cover the
+  // whole frame. A window that overlaps one already merged means the frame
+  // is being rendered again, so it starts over. Frames that never get
+  // covered, from a host only rendering some of each, are written when they
+  // are pushed out by newer ones or the sequence ends.
+  class ScopeCollector {
+  public :
+    ScopeCollector() {}
+
+    // merge a render's scopes into those of its frame, whose region of
+    // definition is in pixels at the render scale, writing them to the file
+    // if that finishes the frame, any run of #s in its name being replaced
+    // by the frame number
+    void merge(const ScopeBins &scopes, OfxTime time, double renderScale, const OfxRectI &window,
+               const OfxRectI &rod, const char *path);
+
+    // write every frame still being merged, however much of it there is
+    void flush();
+
+  protected :
+    // the frames renders are likely to be spread over at once
+    enum { kMaxFrames = 8 };
+
+    struct Frame {
+      OfxTime time;
+      double renderScale;
+      OfxRectI rod;
+      std::string path;
+      std::vector<OfxRectI> windows;
+      unsigned long long covered;  // pixels of the RoD the windows cover
+      unsigned long long vectorscope[kVectorscopeSize][kVectorscopeSize];
+      unsigned long long histogram[3][kScopeHistogramBins];
+      unsigned long long count;
+    };
+
+    static std::string framePath(const char *path, OfxTime time);
+    static bool write(const std::string &path, const Frame &frame);
+    static void writeAll(const std::vector<std::shared_ptr<Frame> > &frames);
+
+    std::mutex mutex_;
+    std::list<std::shared_ptr<Frame> > frames_;  // most recently merged first
+  };
+
+  // how many pixels two rectangles have in common
+  static unsigned long long OverlapArea(const OfxRectI &a, const OfxRectI &b)
+  {
+    int width = std::min(a.x2, b.x2) - std::max(a.x1, b.x1);
+    int height = std::min(a.y2, b.y2) - std::max(a.y1, b.y1);
+    if(width <= 0 || height <= 0) {
+      return 0;
+    }
+    return (unsigned long long) width * (unsigned long long) height;
+  }
+
+  void ScopeCollector::merge(const ScopeBins &scopes, OfxTime time, double renderScale, const OfxRectI &window,
+                             const OfxRectI &rod, const char *path)
+  {
+    // frames that are done with, written once we have let go of the lock
+    std::vector<std::shared_ptr<Frame> > finished;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+
+      std::shared_ptr<Frame> frame;
+      for(auto i = frames_.begin(); i != frames_.end(); ++i) {
+        if((*i)->time == time) {
+          frame = *i;
+          frames_.erase(i);
+          break;
+        }
+      }
+
+      bool restart = !frame || frame->renderScale != renderScale || memcmp(&frame->rod, &rod, sizeof(rod)) != 0;
+      for(size_t i = 0; frame && !restart && i < frame->windows.size(); ++i) {
+        const OfxRectI &merged = frame->windows[i];
+        restart = merged.x1 < window.x2 && window.x1 < merged.x2 && merged.y1 < window.y2 && window.y1 < merged.y2;
+      }
+      if(restart) {
+        frame.reset(new Frame);
+        memset(frame->vectorscope, 0, sizeof(frame->vectorscope));
+        memset(frame->histogram, 0, sizeof(frame->histogram));
+        frame->count = 0;
+        frame->covered = 0;
+        frame->time = time;
+        frame->renderScale = renderScale;
+        frame->rod = rod;
+      }
+
+      frame->path = path;
+      frame->windows.push_back(window);
+      frame->covered += OverlapArea(window, rod);
+      for(int v = 0; v < kVectorscopeSize; ++v) {
+        for(int u = 0; u < kVectorscopeSize; ++u) {
+          frame->vectorscope[v][u] += scopes.vectorscope[v][u];
+        }
+      }
+      for(int c = 0; c < 3; ++c) {
+        for(int bin = 0; bin < kScopeHistogramBins; ++bin) {
+          frame->histogram[c][bin] += scopes.histogram[c][bin];
+        }
+      }
+      frame->count += scopes.count;
+
+      // the windows don't overlap, so once they add up to the RoD they cover it
+      if(OverlapArea(rod, rod) > 0 && frame->covered >= OverlapArea(rod, rod)) {
+        finished.push_back(frame);
+      }
+      else {
+        frames_.push_front(frame);
+        if(frames_.size() > kMaxFrames) {
+          finished.push_back(frames_.back());
+          frames_.pop_back();
+        }
+      }
+    }
+
+    writeAll(finished);
+  }
+
+  void ScopeCollector::flush()
+  {
+    std::vector<std::shared_ptr<Frame> > finished;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      finished.assign(frames_.begin(), frames_.end());
+      frames_.clear();
+    }
+    writeAll(finished);
+  }
+
+  void ScopeCollector::writeAll(const std::vector<std::shared_ptr<Frame> > &frames)
+  {
+    for(size_t f = 0; f < frames.size(); ++f) {
+      std::string path = framePath(frames[f]->path.c_str(), frames[f]->time);
+      ERROR_IF(!write(path, *frames[f]), " could not write the scopes to '%s'", path.c_str());
+    }
+  }
+
+  std::string ScopeCollector::framePath(const char *path, OfxTime time)
+  {
+    std::string result;
+    for(const char *c = path; *c; ) {
+      if(*c != '#') {
+        result += *c++;
+        continue;
+      }
+      int width = 0;
+      for(; *c == '#'; ++c) {
+        ++width;
+      }
+      char number[32];
+      snprintf(number, sizeof(number), "%0*d", width, int(floor(time)));
+      result += number;
+    }
+    return result;
+  }
+
+  // a text file anything can read. A line saying how many pixels the frame
+  // has so far, then the vectorscope with Cr going down from +0.5 and Cb
+  // across from -0.5, then a line per histogram bin from black up, with a
+  // count for each of red, green and blue. It goes via a temporary, so
+  // anything watching the file never reads a half written one.
+  bool ScopeCollector::write(const std::string &path, const Frame &frame)
+  {
+    char tempSuffix[32];
+    snprintf(tempSuffix, sizeof(tempSuffix), ".%lu.tmp", (unsigned long) GetCurrentThreadId());
+    std::string tempPath = path + tempSuffix;
+
+    FILE *file = fopen(tempPath.c_str(), "w");
+    if(!file) {
+      return false;
+    }
+
+    fprintf(file, "# SoftSaturate scopes\n");
+    fprintf(file, "frame %g scale %g pixels %llu\n", frame.time, frame.renderScale, frame.count);
+    fprintf(file, "vectorscope %d\n", kVectorscopeSize);
+    for(int v = kVectorscopeSize - 1; v >= 0; --v) {
+      for(int u = 0; u < kVectorscopeSize; ++u) {
+        fprintf(file, u ? " %llu" : "%llu", frame.vectorscope[v][u]);
+      }
+      fprintf(file, "\n");
+    }
+    fprintf(file, "histogram %d\n", kScopeHistogramBins);
+    for(int bin = 0; bin < kScopeHistogramBins; ++bin) {
+      fprintf(file, "%llu %llu %llu\n", frame.histogram[0][bin], frame.histogram[1][bin], frame.histogram[2][bin]);
+    }
+
+    bool ok = !ferror(file);
+    ok = fclose(file) == 0 && ok;
+    ok = ok && MoveFileExA(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+    if(!ok) {
+      DeleteFileA(tempPath.c_str());
+    }
+    return ok;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // color transforms recently baked into tables, by a hash of the transform
+  // and the table's size. A few are kept, so frames rendered at the same time
+  // with different settings don't keep throwing each other's tables away.
+  // The first render thread to want a table bakes it holding the entry's
+  // mutex, any others wanting it wait for it there rather than baking it
+  // again themselves.
+  class BakedLutCache {
+  public :
+    BakedLutCache() : clock_(0) {}
+
+    // the table for the settings, whose LUT is the one given, baking it if
+    // need be
+    std::shared_ptr<const Lut3D> fetch(const RenderSettings &settings, const std::shared_ptr<const Lut3D> &lut,
+                                       int size);
+
+  protected :
+    enum { kMaxEntries = 4 };
+
+    struct Entry {
+      std::mutex mutex;
+      RenderSettings settings;
+      std::shared_ptr<const Lut3D> lut;  // held so its address can't be reused
+      int size;
+      std::shared_ptr<const Lut3D> baked;  // NULL until someone has baked it
+    };
+
+    struct Slot {
+      std::shared_ptr<Entry> entry;
+      unsigned long long lastUsed;
+    };
+
+    std::mutex mutex_;
+    std::map<unsigned long long, Slot> slots_;
+    unsigned long long clock_;
+  };
+
+  std::shared_ptr<const Lut3D> BakedLutCache::fetch(const RenderSettings &settings,
+                                                    const std::shared_ptr<const Lut3D> &lut,
+                                                    int size)
+  {
+    std::shared_ptr<Entry> entry;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      Slot &slot = slots_[HashColorTransform(settings, size)];
+      slot.lastUsed = ++clock_;
+
+      // a new transform, or one that only hashes the same
+      if(!slot.entry || slot.entry->size != size || slot.entry->lut != lut ||
+         !SameColorTransform(slot.entry->settings, settings)) {
+        slot.entry.reset(new Entry);
+        slot.entry->settings = settings;
+        slot.entry->lut = lut;
+        slot.entry->size = size;
+
+        if(slots_.size() > kMaxEntries) {
+          std::map<unsigned long long, Slot>::iterator oldest = slots_.begin();
+          for(std::map<unsigned long long, Slot>::iterator it = slots_.begin(); it != slots_.end(); ++it) {
+            if(it->second.lastUsed < oldest->second.lastUsed) {
+              oldest = it;
+            }
+          }
+          slots_.erase(oldest);
+        }
+      }
+      entry = slot.entry;
+    }
+
+    std::lock_guard<std::mutex> lock(entry->mutex);
+    if(!entry->baked) {
+      entry->baked = BakeLut(settings, size);
+    }
+    return entry->baked;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // our instance data, where we are caching away clip and param handles
+  struct MyInstanceData {
+    // are we in the general context
+    bool isGeneralContext;
+
+    // handles to the clips we deal with
+    OfxImageClipHandle sourceClip;
+    OfxImageClipHandle maskClip;
+    OfxImageClipHandle outputClip;
+
+    // handles to a our parameters
+    OfxParamHandle saturationParam;
+    OfxParamHandle restoreLevelsParam;
+    OfxParamHandle deflickerParam;
+    OfxParamHandle deflickerFramesParam;
+    OfxParamHandle denoiseParam;
+    OfxParamHandle denoiseFramesParam;
+    OfxParamHandle denoiseBufferParam;
+    OfxParamHandle chromaDetailParam;
+    OfxParamHandle chromaSizeParam;
+    OfxParamHandle autoSaturationParam;
+    OfxParamHandle targetChromaParam;
+    OfxParamHandle smoothingParam;
+    OfxParamHandle cutThresholdParam;
+    OfxParamHandle gamutParam;
+    OfxParamHandle transferParam;
+    OfxParamHandle lutFileParam;
+    OfxParamHandle grainParam;
+    OfxParamHandle grainColourParam;
+    OfxParamHandle grainSeedParam;
+    OfxParamHandle bakeParam;
+    OfxParamHandle deterministicParam;
+    OfxParamHandle frameCacheParam;
+    OfxParamHandle tileCacheParam;
+    OfxParamHandle repeatedFramesParam;
+    OfxParamHandle scopeFileParam;
+
+    // the LUT applied after saturation, if any, kept up to date with its file
+    std::shared_ptr<LutSlot> lutSlot;
+
+    // the color transforms baked into tables for recent renders
+    BakedLutCache bakedLuts;
+
+    // windows we have rendered already, and tiles of them if we are
+    // reusing static regions
+    RenderCache frameCache;
+    RenderCache tileCache;
+
+    // statistics of recent frames, for auto saturation and deflickering
+    FrameStatsCache frameStats;
+
+    // shots and their levels, for fade restoration
+    ShotCache shots;
+
+    // recent source frames, for temporal denoising
+    SourceFrameRing sourceFrames;
+
+    // the scopes of the frames being rendered, if they are wanted
+    ScopeCollector scopes;
+
+    // renders over the current sequence, and how many of them were repeats
+    // of a frame we had rendered already
+    std::atomic<unsigned long long> sequenceRenders;
+    std::atomic<unsigned long long> sequenceRepeats;
+
+    MyInstanceData()
+      : isGeneralContext(false)
+      , sourceClip(NULL)
+      , maskClip(NULL)
+      , outputClip(NULL)
+      , saturationParam(NULL)
+      , restoreLevelsParam(NULL)
+      , deflickerParam(NULL)
+      , deflickerFramesParam(NULL)
+      , denoiseParam(NULL)
+      , denoiseFramesParam(NULL)
+      , denoiseBufferParam(NULL)
+      , chromaDetailParam(NULL)
+      , chromaSizeParam(NULL)
+      , autoSaturationParam(NULL)
+      , targetChromaParam(NULL)
+      , smoothingParam(NULL)
+      , cutThresholdParam(NULL)
+      , gamutParam(NULL)
+      , transferParam(NULL)
+      , lutFileParam(NULL)
+      , grainParam(NULL)
+      , grainColourParam(NULL)
+      , grainSeedParam(NULL)
+      , bakeParam(NULL)
+      , deterministicParam(NULL)
+      , frameCacheParam(NULL)
+      , tileCacheParam(NULL)
+      , repeatedFramesParam(NULL)
+      , scopeFileParam(NULL)
+      , lutSlot(new LutSlot)
+      , sequenceRenders(0)
+      , sequenceRepeats(0)
+    {}
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // get my instance data from a property set handle
+  MyInstanceData *FetchInstanceData(OfxPropertySetHandle effectProps)
+  {
+    MyInstanceData *myData = 0;
+    gPropertySuite->propGetPointer(effectProps,
+                                   kOfxPropInstanceData,
+                                   0,
+                                   (void **) &myData);
+    return myData;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // get my instance data
+  MyInstanceData *FetchInstanceData(OfxImageEffectHandle effect)
+  {
+    // get the property handle for the plugin
+    OfxPropertySetHandle effectProps;
+    gImageEffectSuite->getPropertySet(effect, &effectProps);
+
+    // and get the instance data out of that
+    return FetchInstanceData(effectProps);
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // get the named suite and put it in the given pointer, with error checking
+  template <class SUITE>
+  void FetchSuite(SUITE *& suite, const char *suiteName, int suiteVersion)
+  {
+    suite = (SUITE *) gHost->fetchSuite(gHost->host, suiteName, suiteVersion);
+    if(!suite) {
+      ERROR_ABORT_IF(suite == NULL,
+                     "Failed to fetch %s version %d from the host.",
+                     suiteName,
+                     suiteVersion);
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // The first _action_ called after the binary is loaded (three boot strapper functions will be howeever)
+  OfxStatus LoadAction(void)
+  {
+    // fetch our four suites
+    FetchSuite(gPropertySuite,    kOfxPropertySuite,    1);
+    FetchSuite(gImageEffectSuite, kOfxImageEffectSuite, 1);
+    FetchSuite(gParameterSuite,   kOfxParameterSuite,   1);
+    FetchSuite(gMultiThreadSuite, kOfxMultiThreadSuite, 1);
+
+    // tables shared by all instances
+    BuildCineonTable();
+
+    return kOfxStatOK;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // The last action called before the binary is unloaded
+  OfxStatus UnloadAction(void)
+  {
+    // our background threads must be gone before our code is
+    gLutWatcher.stop();
+
+    return kOfxStatOK;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // the plugin's basic description routine
+  OfxStatus DescribeAction(OfxImageEffectHandle descriptor)
+  {
+    // get the property set handle for the plugin
+    OfxPropertySetHandle effectProps;
+    gImageEffectSuite->getPropertySet(descriptor, &effectProps);
+
+    // set some labels and the group it belongs to
+    gPropertySuite->propSetString(effectProps,
+                                  kOfxPropLabel,
+                                  0,
+                                  "OFX Saturation Example");
+    gPropertySuite->propSetString(effectProps,
+                                  kOfxImageEffectPluginPropGrouping,
+                                  0,
+                                  "OFX Example");
+
+    // define the image effects contexts we can be used in, in this case a filter
+    // and a general effect
+    gPropertySuite->propSetString(effectProps,
+                                  kOfxImageEffectPropSupportedContexts,
+                                  0,
+                                  kOfxImageEffectContextFilter);
+
+    gPropertySuite->propSetString(effectProps,
+                                  kOfxImageEffectPropSupportedContexts,
+                                  1,
+                                  kOfxImageEffectContextGeneral);
+
+    // set the bit depths the plugin can handle
+    gPropertySuite->propSetString(effectProps,
+                                  kOfxImageEffectPropSupportedPixelDepths,
+                                  0,
+                                  kOfxBitDepthFloat);
+    gPropertySuite->propSetString(effectProps,
+                                  kOfxImageEffectPropSupportedPixelDepths,
+                                  1,
+                                  kOfxBitDepthShort);
+    gPropertySuite->propSetString(effectProps,
+                                  kOfxImageEffectPropSupportedPixelDepths,
+                                  2,
+                                  kOfxBitDepthByte);
+
+    // say that a single instance of this plugin can be rendered in multiple threads
+    gPropertySuite->propSetString(effectProps,
+                                  kOfxImageEffectPluginRenderThreadSafety,
+                                  0,
+                                  kOfxImageEffectRenderFullySafe);
+
+    // say that the host should manage SMP threading over a single frame
+    gPropertySuite->propSetInt(effectProps,
+                               kOfxImageEffectPluginPropHostFrameThreading,
+                               0,
+                               1);
+
+    // auto saturation can look at frames either side of the one being rendered
+    gPropertySuite->propSetInt(effectProps,
+                               kOfxImageEffectPropTemporalClipAccess,
+                               0,
+                               1);
+    return kOfxStatOK;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  //  describe the plugin in context
+  OfxStatus
+  DescribeInContextAction(OfxImageEffectHandle descriptor,
+                          OfxPropertySetHandle inArgs)
+  {
+    // get the context we are being described for
+    char *context;
+    gPropertySuite->propGetString(inArgs, kOfxImageEffectPropContext, 0, &context);
+
+    OfxPropertySetHandle props;
+    // define the mandated single output clip
+    gImageEffectSuite->clipDefine(descriptor, "Output", &props);
+
+    // set the component types we can handle on out output
+    gPropertySuite->propSetString(props,
+                                  kOfxImageEffectPropSupportedComponents,
+                                  0,
+                                  kOfxImageComponentRGBA);
+    gPropertySuite->propSetString(props,
+                                  kOfxImageEffectPropSupportedComponents,
+                                  1,
+                                  kOfxImageComponentRGB);
+
+    // define the mandated single source clip
+    gImageEffectSuite->clipDefine(descriptor, "Source", &props);
+
+    // set the component types we can handle on our main input
+    gPropertySuite->propSetString(props,
+                                  kOfxImageEffectPropSupportedComponents,
+                                  0,
+                                  kOfxImageComponentRGBA);
+    gPropertySuite->propSetString(props,
+                                  kOfxImageEffectPropSupportedComponents,
+                                  1,
+                                  kOfxImageComponentRGB);
+
+    if(strcmp(context, kOfxImageEffectContextGeneral) == 0) {
+      gImageEffectSuite->clipDefine(descriptor, "Mask", &props);
+
+      // set the component types we can handle on our main input
+      gPropertySuite->propSetString(props,
+                                    kOfxImageEffectPropSupportedComponents,
+                                    0,
+                                    kOfxImageComponentAlpha);
+      gPropertySuite->propSetInt(props,
+                                 kOfxImageClipPropOptional,
+                                 0,
+                                 1);
+      gPropertySuite->propSetInt(props,
+                                 kOfxImageClipPropIsMask,
+                                 0,
+                                 1);
+    }
+
+
+    // first get the handle to the parameter set
+    OfxParamSetHandle paramSet;
+    gImageEffectSuite->getParamSet(descriptor, &paramSet);
 
     // properties on our parameter
     OfxPropertySetHandle paramProps;
 
-    // now define a 'saturation' parameter and set its properties
-    gParameterSuite->paramDefine(paramSet,
-                                 kOfxParamTypeDouble,
-                                 SATURATION_PARAM_NAME,
-                                 &paramProps);
-    gPropertySuite->propSetString(paramProps,
-                                  kOfxParamPropDoubleType,
-                                  0,
-                                  kOfxParamDoubleTypeScale);
-    gPropertySuite->propSetDouble(paramProps,
-                                  kOfxParamPropDefault,
-                                  0,
-                                  1.0);
-    gPropertySuite->propSetDouble(paramProps,
-                                  kOfxParamPropDisplayMin,
-                                  0,
-                                  -2.0);
-    gPropertySuite->propSetDouble(paramProps,
-                                  kOfxParamPropDisplayMax,
-                                  0,
-                                  2.0);
-    gPropertySuite->propSetString(paramProps,
-                                  kOfxPropLabel,
-                                  0,
-                                  "Saturation");
-    gPropertySuite->propSetString(paramProps,
-                                  kOfxParamPropHint,
-                                  0,
-                                  "How saturated the image should be.");
+    // now define a 'saturation' parameter and set its properties
+    gParameterSuite->paramDefine(paramSet,
+                                 kOfxParamTypeDouble,
+                                 SATURATION_PARAM_NAME,
+                                 &paramProps);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropDoubleType,
+                                  0,
+                                  kOfxParamDoubleTypeScale);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropDefault,
+                                  0,
+                                  1.0);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropDisplayMin,
+                                  0,
+                                  -2.0);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropDisplayMax,
+                                  0,
+                                  2.0);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxPropLabel,
+                                  0,
+                                  "Saturation");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropHint,
+                                  0,
+                                  "How saturated the image should be.");
+
+    // and a 'restoreLevels' parameter, whether to undo uneven fading of the dye layers
+    gParameterSuite->paramDefine(paramSet,
+                                 kOfxParamTypeBoolean,
+                                 RESTORE_LEVELS_PARAM_NAME,
+                                 &paramProps);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropDefault,
+                               0,
+                               0);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxPropLabel,
+                                  0,
+                                  "Restore Faded Levels");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropHint,
+                                  0,
+                                  "Find each channel's black and white points from the first frames of every shot and stretch the channel back out to the full range before saturating, undoing dye layers that have faded unevenly.");
+
+    // and a 'deflicker' parameter, whether to even out exposure from frame to frame
+    gParameterSuite->paramDefine(paramSet,
+                                 kOfxParamTypeBoolean,
+                                 DEFLICKER_PARAM_NAME,
+                                 &paramProps);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropDefault,
+                               0,
+                               0);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxPropLabel,
+                                  0,
+                                  "Deflicker");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropHint,
+                                  0,
+                                  "Measure each frame's median brightness and scale it to the average over the neighbouring frames of the same shot, taking out the frame to frame exposure flicker of old film.");
+
+    // and a 'deflickerFrames' parameter, how many frames either side deflickering averages over
+    gParameterSuite->paramDefine(paramSet,
+                                 kOfxParamTypeInteger,
+                                 DEFLICKER_FRAMES_PARAM_NAME,
+                                 &paramProps);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropDefault,
+                               0,
+                               4);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropMin,
+                               0,
+                               1);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropMax,
+                               0,
+                               12);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropDisplayMin,
+                               0,
+                               1);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropDisplayMax,
+                               0,
+                               12);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxPropLabel,
+                                  0,
+                                  "Deflicker Frames");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropHint,
+                                  0,
+                                  "How many frames either side a frame's brightness is compared with. More frames take out slower flicker, but follow real changes in exposure more slowly.");
+
+    // and a 'temporalDenoise' parameter, how far to average chroma with the frames either side
+    gParameterSuite->paramDefine(paramSet,
+                                 kOfxParamTypeDouble,
+                                 DENOISE_PARAM_NAME,
+                                 &paramProps);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropDefault,
+                                  0,
+                                  0.0);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropMin,
+                                  0,
+                                  0.0);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropMax,
+                                  0,
+                                  1.0);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropDisplayMin,
+                                  0,
+                                  0.0);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropDisplayMax,
+                                  0,
+                                  1.0);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxPropLabel,
+                                  0,
+                                  "Temporal Chroma Denoise");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropHint,
+                                  0,
+                                  "How far to move each pixel's chroma towards its average over the neighbouring frames before saturating, so grain in the dyes isn't boosted along with the colour. Anything that moved is left out of the average. Brightness is never touched.");
+
+    // and a 'denoiseFrames' parameter, how many frames either side denoising averages over
+    gParameterSuite->paramDefine(paramSet,
+                                 kOfxParamTypeInteger,
+                                 DENOISE_FRAMES_PARAM_NAME,
+                                 &paramProps);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropDefault,
+                               0,
+                               1);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropMin,
+                               0,
+                               1);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropMax,
+                               0,
+                               kMaxDenoiseRadius);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropDisplayMin,
+                               0,
+                               1);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropDisplayMax,
+                               0,
+                               kMaxDenoiseRadius);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxPropLabel,
+                                  0,
+                                  "Denoise Frames");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropHint,
+                                  0,
+                                  "How many frames either side temporal denoising averages chroma over.");
+
+    // and a 'denoiseBufferFrames' parameter, how many source frames denoising keeps copies of
+    gParameterSuite->paramDefine(paramSet,
+                                 kOfxParamTypeInteger,
+                                 DENOISE_BUFFER_PARAM_NAME,
+                                 &paramProps);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropDefault,
+                               0,
+                               8);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropMin,
+                               0,
+                               1);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropMax,
+                               0,
+                               64);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropDisplayMin,
+                               0,
+                               1);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropDisplayMax,
+                               0,
+                               16);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropAnimates,
+                               0,
+                               0);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxPropLabel,
+                                  0,
+                                  "Denoise Buffer Frames");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropHint,
+                                  0,
+                                  "How many source frames temporal denoising keeps copies of, so rendering in order fetches each frame once. Needs to be at least twice the denoise frames plus one for that, more helps when the host renders frames out of order.");
+
+    // and a 'chromaDetail' parameter, how far to blur or sharpen chroma
+    gParameterSuite->paramDefine(paramSet,
+                                 kOfxParamTypeDouble,
+                                 CHROMA_DETAIL_PARAM_NAME,
+                                 &paramProps);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropDefault,
+                                  0,
+                                  0.0);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropMin,
+                                  0,
+                                  -1.0);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropMax,
+                                  0,
+                                  4.0);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropDisplayMin,
+                                  0,
+                                  -1.0);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropDisplayMax,
+                                  0,
+                                  1.0);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxPropLabel,
+                                  0,
+                                  "Chroma Detail");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropHint,
+                                  0,
+                                  "Blur or sharpen chroma alone before saturating. Below 0 blends towards blurred chroma, down to fully blurred at -1, calming colour noise. Above 0 sharpens chroma, pulling back colour that has bled past edges. Brightness is never touched.");
+
+    // and a 'chromaDetailSize' parameter, the size of the chroma blur
+    gParameterSuite->paramDefine(paramSet,
+                                 kOfxParamTypeDouble,
+                                 CHROMA_SIZE_PARAM_NAME,
+                                 &paramProps);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropDefault,
+                                  0,
+                                  2.0);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropMin,
+                                  0,
+                                  0.5);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropMax,
+                                  0,
+                                  100.0);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropDisplayMin,
+                                  0,
+                                  0.5);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropDisplayMax,
+                                  0,
+                                  20.0);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxPropLabel,
+                                  0,
+                                  "Chroma Detail Size");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropHint,
+                                  0,
+                                  "The size of the chroma blur in pixels, about as wide as the colour bleeding it should take back. Larger sizes cost no more to render.");
+
+    // and an 'autoSaturation' parameter, whether to set saturation from the frame's chroma
+    gParameterSuite->paramDefine(paramSet,
+                                 kOfxParamTypeBoolean,
+                                 AUTO_SATURATION_PARAM_NAME,
+                                 &paramProps);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropDefault,
+                               0,
+                               0);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxPropLabel,
+                                  0,
+                                  "Auto Saturation");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropHint,
+                                  0,
+                                  "Measure each frame's chroma and scale the saturation so its mean chroma hits the target. The saturation above then trims the result.");
+
+    // and a 'targetChroma' parameter, what auto saturation aims for
+    gParameterSuite->paramDefine(paramSet,
+                                 kOfxParamTypeDouble,
+                                 TARGET_CHROMA_PARAM_NAME,
+                                 &paramProps);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropDefault,
+                                  0,
+                                  0.1);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropMin,
+                                  0,
+                                  0.0);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropMax,
+                                  0,
+                                  1.0);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropDisplayMin,
+                                  0,
+                                  0.0);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropDisplayMax,
+                                  0,
+                                  0.3);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxPropLabel,
+                                  0,
+                                  "Target Chroma");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropHint,
+                                  0,
+                                  "The mean chroma auto saturation aims for, as the distance of a pixel from grey in linear light.");
+
+    // and a 'smoothingFrames' parameter, how many frames either side auto saturation averages over
+    gParameterSuite->paramDefine(paramSet,
+                                 kOfxParamTypeInteger,
+                                 SMOOTHING_PARAM_NAME,
+                                 &paramProps);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropDefault,
+                               0,
+                               0);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropMin,
+                               0,
+                               0);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropMax,
+                               0,
+                               12);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropDisplayMin,
+                               0,
+                               0);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropDisplayMax,
+                               0,
+                               12);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxPropLabel,
+                                  0,
+                                  "Smoothing Frames");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropHint,
+                                  0,
+                                  "How many frames either side auto saturation averages its measurements over, so the gain doesn't flicker with the film.");
+
+    // and a 'cutThreshold' parameter, how different frames must be to be in different shots
+    gParameterSuite->paramDefine(paramSet,
+                                 kOfxParamTypeDouble,
+                                 CUT_THRESHOLD_PARAM_NAME,
+                                 &paramProps);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropDefault,
+                                  0,
+                                  0.4);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropMin,
+                                  0,
+                                  0.0);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropMax,
+                                  0,
+                                  1.0);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropDisplayMin,
+                                  0,
+                                  0.0);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropDisplayMax,
+                                  0,
+                                  1.0);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxPropLabel,
+                                  0,
+                                  "Scene Cut Threshold");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropHint,
+                                  0,
+                                  "How different the histograms of two frames must be for there to be a cut between them, from 0 for identical to 1 for nothing in common. Neither smoothing nor deflickering reaches across a cut.");
+
+    // and a 'gamutCompression' parameter, whether to pull colours pushed out of gamut back in
+    gParameterSuite->paramDefine(paramSet,
+                                 kOfxParamTypeBoolean,
+                                 GAMUT_PARAM_NAME,
+                                 &paramProps);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropDefault,
+                               0,
+                               0);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxPropLabel,
+                                  0,
+                                  "Compress Gamut");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropHint,
+                                  0,
+                                  "Smoothly pull colours the saturation pushes out of the source's gamut back inside it, towards grey, as the ACES reference gamut compression does, rather than letting them clip. Colours well inside the gamut are left alone.");
+
+    // and a 'transfer' parameter saying how the source is encoded, so we can
+    // saturate in linear light
+    gParameterSuite->paramDefine(paramSet,
+                                 kOfxParamTypeChoice,
+                                 TRANSFER_PARAM_NAME,
+                                 &paramProps);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropChoiceOption,
+                                  0,
+                                  "Linear");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropChoiceOption,
+                                  1,
+                                  "Cineon Log");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropChoiceOption,
+                                  2,
+                                  "PQ (ST 2084)");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropChoiceOption,
+                                  3,
+                                  "HLG");
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropDefault,
+                               0,
+                               eTransferLinear);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxPropLabel,
+                                  0,
+                                  "Input Transfer");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropHint,
+                                  0,
+                                  "How the source is encoded. Non linear sources are decoded, saturated in linear light and encoded again.");
+
+    // and a 'lutFile' parameter naming a .cube LUT applied after saturation
+    gParameterSuite->paramDefine(paramSet,
+                                 kOfxParamTypeString,
+                                 LUT_FILE_PARAM_NAME,
+                                 &paramProps);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropStringMode,
+                                  0,
+                                  kOfxParamStringIsFilePath);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropStringFilePathExists,
+                               0,
+                               1);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropDefault,
+                                  0,
+                                  "");
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropAnimates,
+                               0,
+                               0);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxPropLabel,
+                                  0,
+                                  "LUT File");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropHint,
+                                  0,
+                                  "A .cube 3D LUT applied to the saturated image, leave empty for none.");
+
+    // and a 'grainAmount' parameter, how much film grain to add
+    gParameterSuite->paramDefine(paramSet,
+                                 kOfxParamTypeDouble,
+                                 GRAIN_PARAM_NAME,
+                                 &paramProps);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropDefault,
+                                  0,
+                                  0.0);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropMin,
+                                  0,
+                                  0.0);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropMax,
+                                  0,
+                                  0.5);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropDisplayMin,
+                                  0,
+                                  0.0);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropDisplayMax,
+                                  0,
+                                  0.1);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxPropLabel,
+                                  0,
+                                  "Grain");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropHint,
+                                  0,
+                                  "How much film grain to add to the finished image, as the standard deviation of the grain in output values. The grain depends only on the frame, the pixel and the seed, so any render of a frame gets the same grain.");
+
+    // and a 'grainColour' parameter, how much the grain differs between the channels
+    gParameterSuite->paramDefine(paramSet,
+                                 kOfxParamTypeDouble,
+                                 GRAIN_COLOUR_PARAM_NAME,
+                                 &paramProps);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropDefault,
+                                  0,
+                                  0.3);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropMin,
+                                  0,
+                                  0.0);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropMax,
+                                  0,
+                                  1.0);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropDisplayMin,
+                                  0,
+                                  0.0);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropDisplayMax,
+                                  0,
+                                  1.0);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxPropLabel,
+                                  0,
+                                  "Grain Colour");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropHint,
+                                  0,
+                                  "How much of the grain is different in each channel, from 0 for grain that only changes brightness to 1 for independent grain in each dye layer.");
+
+    // and a 'grainSeed' parameter, to get different grain from the same frames
+    gParameterSuite->paramDefine(paramSet,
+                                 kOfxParamTypeInteger,
+                                 GRAIN_SEED_PARAM_NAME,
+                                 &paramProps);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropDefault,
+                               0,
+                               0);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropAnimates,
+                               0,
+                               0);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxPropLabel,
+                                  0,
+                                  "Grain Seed");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropHint,
+                                  0,
+                                  "Picks the grain pattern. Layers with different seeds get grain that doesn't line up.");
+
+    // and a 'bakeLut' parameter to render through a compiled LUT
+    gParameterSuite->paramDefine(paramSet,
+                                 kOfxParamTypeBoolean,
+                                 BAKE_PARAM_NAME,
+                                 &paramProps);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropDefault,
+                               0,
+                               0);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxPropLabel,
+                                  0,
+                                  "Bake To LUT");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropHint,
+                                  0,
+                                  "Compile the whole color transform into a 3D LUT whenever a parameter changes and render 8 and 16 bit images through it alone. Costs the same however much is switched on, at the price of a little accuracy.");
+
+    // and a 'deterministic' parameter, to render the same bits everywhere
+    gParameterSuite->paramDefine(paramSet,
+                                 kOfxParamTypeBoolean,
+                                 DETERMINISTIC_PARAM_NAME,
+                                 &paramProps);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropDefault,
+                               0,
+                               0);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropAnimates,
+                               0,
+                               0);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxPropLabel,
+                                  0,
+                                  "Deterministic");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropHint,
+                                  0,
+                                  "Render exactly the same bits whatever machine, tiling or number of threads renders a frame, so frames from different render nodes match.");
+
+    // and a 'frameCacheSize' parameter, how much memory to keep renders in
+    gParameterSuite->paramDefine(paramSet,
+                                 kOfxParamTypeInteger,
+                                 FRAME_CACHE_PARAM_NAME,
+                                 &paramProps);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropDefault,
+                               0,
+                               0);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropMin,
+                               0,
+                               0);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropMax,
+                               0,
+                               65536);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropDisplayMin,
+                               0,
+                               0);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropDisplayMax,
+                               0,
+                               8192);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropAnimates,
+                               0,
+                               0);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropEvaluateOnChange,
+                               0,
+                               0);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxPropLabel,
+                                  0,
+                                  "Frame Cache (MB)");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropHint,
+                                  0,
+                                  "Memory for keeping recent renders, so the host asking for the same frame again gets a copy. 0 turns it off.");
+
+    // and a 'tileCache' parameter, whether to reuse static regions between frames
+    gParameterSuite->paramDefine(paramSet,
+                                 kOfxParamTypeBoolean,
+                                 TILE_CACHE_PARAM_NAME,
+                                 &paramProps);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropDefault,
+                               0,
+                               0);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropEvaluateOnChange,
+                               0,
+                               0);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxPropLabel,
+                                  0,
+                                  "Reuse Static Tiles");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropHint,
+                                  0,
+                                  "Cache renders in 64x64 tiles keyed on their source pixels instead of whole frames, so regions that don't change from frame to frame, such as letterbox bars, title cards and locked off shots, are copied rather than rendered. Uses the frame cache's memory.");
+
+    // and a 'reuseRepeatedFrames' parameter, whether to spot frames that repeat earlier ones
+    gParameterSuite->paramDefine(paramSet,
+                                 kOfxParamTypeBoolean,
+                                 REPEATED_FRAMES_PARAM_NAME,
+                                 &paramProps);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropDefault,
+                               0,
+                               0);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropEvaluateOnChange,
+                               0,
+                               0);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxPropLabel,
+                                  0,
+                                  "Reuse Repeated Frames");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropHint,
+                                  0,
+                                  "Look up cached frames by their source pixels rather than their time, so a frame that repeats one rendered earlier, as in telecined or frame doubled film, is copied instead of rendered. Uses the frame cache's memory.");
+
+    // and a 'scopeFile' parameter naming where to write the scopes of what we render
+    gParameterSuite->paramDefine(paramSet,
+                                 kOfxParamTypeString,
+                                 SCOPE_FILE_PARAM_NAME,
+                                 &paramProps);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropStringMode,
+                                  0,
+                                  kOfxParamStringIsFilePath);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropStringFilePathExists,
+                               0,
+                               0);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropDefault,
+                                  0,
+                                  "");
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropAnimates,
+                               0,
+                               0);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropEvaluateOnChange,
+                               0,
+                               0);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxPropLabel,
+                                  0,
+                                  "Scope File");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropHint,
+                                  0,
+                                  "A text file to write a vectorscope and RGB histogram of each rendered frame to, gathered as it renders. Any #s in the name are replaced by the frame number, otherwise it holds the last frame rendered. Leave empty for none.");
+
+    return kOfxStatOK;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // (re)load the LUT named by the lutFile param
+  void UpdateLut(MyInstanceData *myData)
+  {
+    char *path = NULL;
+    gParameterSuite->paramGetValue(myData->lutFileParam, &path);
+
+    // LUTs come from the process wide store, so they are parsed once and
+    // shared with any other instance using the same file
+    std::shared_ptr<const Lut3D> lut;
+    FileStamp stamp = FileStamp();
+    if(path && *path) {
+      GetFileStamp(path, stamp);
+      lut = gLutStore.fetch(path);
+      ERROR_IF(!lut, " could not read a 3D LUT from '%s'", path);
+    }
+
+    // and have the watcher swap in new versions as the file changes
+    gLutWatcher.assign(myData->lutSlot, path ? path : "", stamp, lut);
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  /// instance construction
+  OfxStatus CreateInstanceAction( OfxImageEffectHandle instance)
+  {
+    OfxPropertySetHandle effectProps;
+    gImageEffectSuite->getPropertySet(instance, &effectProps);
+
+    // To avoid continual lookup, put our handles into our instance
+    // data, those handles are guaranteed to be valid for the duration
+    // of the instance.
+    MyInstanceData *myData = new MyInstanceData;
+
+    // Set my private instance data
+    gPropertySuite->propSetPointer(effectProps, kOfxPropInstanceData, 0, (void *) myData);
+
+    // is this instance made for the general context?
+    char *context = 0;
+    gPropertySuite->propGetString(effectProps, kOfxImageEffectPropContext, 0,  &context);
+    myData->isGeneralContext = context && (strcmp(context, kOfxImageEffectContextGeneral) == 0);
+
+    // Cache the source and output clip handles
+    gImageEffectSuite->clipGetHandle(instance, "Source", &myData->sourceClip, 0);
+    gImageEffectSuite->clipGetHandle(instance, "Output", &myData->outputClip, 0);
+
+    if(myData->isGeneralContext) {
+      gImageEffectSuite->clipGetHandle(instance, "Mask", &myData->maskClip, 0);
+    }
+
+    // Cache away the param handles
+    OfxParamSetHandle paramSet;
+    gImageEffectSuite->getParamSet(instance, &paramSet);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    SATURATION_PARAM_NAME,
+                                    &myData->saturationParam,
+                                    0);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    RESTORE_LEVELS_PARAM_NAME,
+                                    &myData->restoreLevelsParam,
+                                    0);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    DEFLICKER_PARAM_NAME,
+                                    &myData->deflickerParam,
+                                    0);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    DEFLICKER_FRAMES_PARAM_NAME,
+                                    &myData->deflickerFramesParam,
+                                    0);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    DENOISE_PARAM_NAME,
+                                    &myData->denoiseParam,
+                                    0);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    DENOISE_FRAMES_PARAM_NAME,
+                                    &myData->denoiseFramesParam,
+                                    0);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    DENOISE_BUFFER_PARAM_NAME,
+                                    &myData->denoiseBufferParam,
+                                    0);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    CHROMA_DETAIL_PARAM_NAME,
+                                    &myData->chromaDetailParam,
+                                    0);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    CHROMA_SIZE_PARAM_NAME,
+                                    &myData->chromaSizeParam,
+                                    0);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    AUTO_SATURATION_PARAM_NAME,
+                                    &myData->autoSaturationParam,
+                                    0);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    TARGET_CHROMA_PARAM_NAME,
+                                    &myData->targetChromaParam,
+                                    0);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    SMOOTHING_PARAM_NAME,
+                                    &myData->smoothingParam,
+                                    0);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    CUT_THRESHOLD_PARAM_NAME,
+                                    &myData->cutThresholdParam,
+                                    0);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    GAMUT_PARAM_NAME,
+                                    &myData->gamutParam,
+                                    0);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    TRANSFER_PARAM_NAME,
+                                    &myData->transferParam,
+                                    0);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    LUT_FILE_PARAM_NAME,
+                                    &myData->lutFileParam,
+                                    0);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    GRAIN_PARAM_NAME,
+                                    &myData->grainParam,
+                                    0);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    GRAIN_COLOUR_PARAM_NAME,
+                                    &myData->grainColourParam,
+                                    0);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    GRAIN_SEED_PARAM_NAME,
+                                    &myData->grainSeedParam,
+                                    0);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    BAKE_PARAM_NAME,
+                                    &myData->bakeParam,
+                                    0);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    DETERMINISTIC_PARAM_NAME,
+                                    &myData->deterministicParam,
+                                    0);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    FRAME_CACHE_PARAM_NAME,
+                                    &myData->frameCacheParam,
+                                    0);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    TILE_CACHE_PARAM_NAME,
+                                    &myData->tileCacheParam,
+                                    0);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    REPEATED_FRAMES_PARAM_NAME,
+                                    &myData->repeatedFramesParam,
+                                    0);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    SCOPE_FILE_PARAM_NAME,
+                                    &myData->scopeFileParam,
+                                    0);
+
+    // and load up the LUT, if one is set
+    UpdateLut(myData);
+
+    return kOfxStatOK;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // a param changed, reload our LUT if it was the LUT file
+  OfxStatus InstanceChangedAction(OfxImageEffectHandle instance,
+                                  OfxPropertySetHandle inArgs)
+  {
+    char *type = 0, *name = 0;
+    gPropertySuite->propGetString(inArgs, kOfxPropType, 0, &type);
+    gPropertySuite->propGetString(inArgs, kOfxPropName, 0, &name);
+
+    if(strcmp(type, kOfxTypeParameter) == 0 && strcmp(name, LUT_FILE_PARAM_NAME) == 0) {
+      UpdateLut(FetchInstanceData(instance));
+      return kOfxStatOK;
+    }
+
+    // we didn't trap it
+    return kOfxStatReplyDefault;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // a sequence of frames is about to be rendered, start counting repeats afresh
+  OfxStatus BeginSequenceRenderAction(OfxImageEffectHandle instance)
+  {
+    MyInstanceData *myData = FetchInstanceData(instance);
+    myData->sequenceRenders = 0;
+    myData->sequenceRepeats = 0;
+    return kOfxStatOK;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // the sequence is done, write the scopes of any frames it didn't cover and
+  // say how many of its frames were repeats
+  OfxStatus EndSequenceRenderAction(OfxImageEffectHandle instance)
+  {
+    MyInstanceData *myData = FetchInstanceData(instance);
+    myData->scopes.flush();
+    if(myData->sequenceRepeats > 0) {
+      DUMP("STATS : ", " %llu of %llu renders in the sequence were repeated frames",
+           myData->sequenceRepeats.load(),
+           myData->sequenceRenders.load());
+    }
+    return kOfxStatOK;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // instance destruction
+  OfxStatus DestroyInstanceAction( OfxImageEffectHandle instance)
+  {
+    // get my instance data
+    MyInstanceData *myData = FetchInstanceData(instance);
+
+    // say how the frame cache did, if it was used
+    if(myData->frameCache.hits() + myData->frameCache.misses() > 0) {
+      DUMP("STATS : ", " frame cache had %llu hits and %llu misses",
+           myData->frameCache.hits(),
+           myData->frameCache.misses());
+    }
+    if(myData->tileCache.hits() + myData->tileCache.misses() > 0) {
+      DUMP("STATS : ", " tile cache had %llu hits and %llu misses",
+           myData->tileCache.hits(),
+           myData->tileCache.misses());
+    }
+
+    delete myData;
+
+    return kOfxStatOK;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // get our param values at the given time
+  void FetchRenderSettings(MyInstanceData *myData, OfxTime time, RenderSettings &settings)
+  {
+    double saturation = 1.0;
+    gParameterSuite->paramGetValueAtTime(myData->saturationParam, time, &saturation);
+    settings.saturation = float(saturation);
+
+    int transfer = eTransferLinear;
+    gParameterSuite->paramGetValueAtTime(myData->transferParam, time, &transfer);
+    settings.transfer = TransferFunction(transfer);
+
+    int restoreLevels = 0;
+    gParameterSuite->paramGetValueAtTime(myData->restoreLevelsParam, time, &restoreLevels);
+    settings.restoreLevels = restoreLevels != 0;
+
+    int deflicker = 0;
+    gParameterSuite->paramGetValueAtTime(myData->deflickerParam, time, &deflicker);
+    settings.deflicker = deflicker != 0;
+
+    int deflickerRadius = 0;
+    gParameterSuite->paramGetValueAtTime(myData->deflickerFramesParam, time, &deflickerRadius);
+    settings.deflickerRadius = deflickerRadius;
+
+    double denoiseStrength = 0.0;
+    gParameterSuite->paramGetValueAtTime(myData->denoiseParam, time, &denoiseStrength);
+    settings.denoiseStrength = float(denoiseStrength);
+
+    int denoiseRadius = 1;
+    gParameterSuite->paramGetValueAtTime(myData->denoiseFramesParam, time, &denoiseRadius);
+    settings.denoiseRadius = std::min(std::max(denoiseRadius, 1), kMaxDenoiseRadius);
+
+    double chromaDetail = 0.0;
+    gParameterSuite->paramGetValueAtTime(myData->chromaDetailParam, time, &chromaDetail);
+    settings.chromaDetail = float(chromaDetail);
+
+    double chromaSize = 2.0;
+    gParameterSuite->paramGetValueAtTime(myData->chromaSizeParam, time, &chromaSize);
+    settings.chromaSize = float(chromaSize);
+
+    int autoSaturation = 0;
+    gParameterSuite->paramGetValueAtTime(myData->autoSaturationParam, time, &autoSaturation);
+    settings.autoSaturation = autoSaturation != 0;
+
+    double targetChroma = 0.1;
+    gParameterSuite->paramGetValueAtTime(myData->targetChromaParam, time, &targetChroma);
+    settings.targetChroma = float(targetChroma);
+
+    int smoothingRadius = 0;
+    gParameterSuite->paramGetValueAtTime(myData->smoothingParam, time, &smoothingRadius);
+    settings.smoothingRadius = smoothingRadius;
+
+    double cutThreshold = 0.4;
+    gParameterSuite->paramGetValueAtTime(myData->cutThresholdParam, time, &cutThreshold);
+    settings.cutThreshold = float(cutThreshold);
+
+    int gamutCompression = 0;
+    gParameterSuite->paramGetValueAtTime(myData->gamutParam, time, &gamutCompression);
+    settings.gamutCompression = gamutCompression != 0;
+
+    double grainAmount = 0.0;
+    gParameterSuite->paramGetValueAtTime(myData->grainParam, time, &grainAmount);
+    settings.grainAmount = float(grainAmount);
+
+    double grainColour = 0.3;
+    gParameterSuite->paramGetValueAtTime(myData->grainColourParam, time, &grainColour);
+    settings.grainColour = float(grainColour);
+
+    int grainSeed = 0;
+    gParameterSuite->paramGetValueAtTime(myData->grainSeedParam, time, &grainSeed);
+    settings.grainSeed = grainSeed;
+    settings.grainTime = time;
+
+    int bake = 0;
+    gParameterSuite->paramGetValueAtTime(myData->bakeParam, time, &bake);
+    settings.bake = bake != 0;
+
+    int deterministic = 0;
+    gParameterSuite->paramGetValueAtTime(myData->deterministicParam, time, &deterministic);
+    settings.deterministic = deterministic != 0;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // chroma is binned over [0, kChromaRange), anything beyond lands in the last bin
+  const int kChromaBins = 1024;
+  const float kChromaRange = 1.0f;
+
+  // and summed in fixed point, so the mean comes out the same however the
+  // frame was split between threads
+  const float kChromaFixedPoint = 65536.0f;
+
+  // below this a frame is grey and auto saturation leaves it alone
+  const float kMinAutoChroma = 0.001f;
+
+  // luma is binned by its square root over [0, 1], which keeps the bins fine
+  // enough in the shadows that a dark frame's median doesn't jump about
+  const int kLumaBins = 1024;
+
+  // the cut histograms only look at every few rows, they need to be cheap
+  // far more than they need to be exact
+  const int kCutRowStep = 4;
+
+  // one thread's share of a frame's histograms
+  struct FrameHistograms {
+    unsigned int bins[kChromaBins];
+    unsigned long long sum;
+    unsigned long long count;
+
+    unsigned int lumaBins[kLumaBins];
+
+    unsigned int cutBins[3][kCutBins];
+    unsigned long long cutCount;
+
+    unsigned int levelBins[3][kLevelBins];
+    unsigned long long levelCount;
+  };
+
+  // what the analysis threads share, each has its own histogram
+  struct AnalysisJob {
+    Image *src;
+    TransferFunction transfer;
+    std::vector<FrameHistograms> histograms;
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // add a row of the source to a histogram
+  template <class T, int MAX>
+  void AccumulateRow(FrameHistograms &histogram, Image &src, Image &noMask, TransferFunction transfer, int y)
+  {
+    const OfxRectI &bounds = src.bounds();
+    const __m128 third = _mm_set1_ps(1.0f / 3.0f);
+    const __m128 range = _mm_set1_ps(kChromaRange);
+    const __m128 binScale = _mm_set1_ps(kChromaBins / kChromaRange);
+    const __m128 lastBin = _mm_set1_ps(float(kChromaBins - 1));
+    const __m128 fixedPoint = _mm_set1_ps(kChromaFixedPoint);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 cutScale = _mm_set1_ps(float(kCutBins));
+    const __m128 lastCutBin = _mm_set1_ps(float(kCutBins - 1));
+    const bool cutRow = (y - bounds.y1) % kCutRowStep == 0;
+    const __m128 levelScale = _mm_set1_ps(float(kLevelBins));
+    const __m128 lastLevelBin = _mm_set1_ps(float(kLevelBins - 1));
+    const __m128 lumaScale = _mm_set1_ps(float(kLumaBins));
+    const __m128 lastLumaBin = _mm_set1_ps(float(kLumaBins - 1));
+
+    PixelChunk chunk;
+    alignas(16) int bins[PixelChunk::kSize];
+    alignas(16) int lumaBins[PixelChunk::kSize];
+    alignas(16) int cutBins[3][PixelChunk::kSize];
+
+    for(int x = bounds.x1; x < bounds.x2; x += PixelChunk::kSize) {
+      int count = std::min(int(PixelChunk::kSize), bounds.x2 - x);
+      LoadChunk<T, MAX>(chunk, src, noMask, x, y, count);
+
+      // bin the channels as they come in, before decoding, where their
+      // values are spread more evenly
+      if(cutRow) {
+        const float *planes[3] = {chunk.r, chunk.g, chunk.b};
+        for(int c = 0; c < 3; ++c) {
+          for(int i = 0; i < chunk.n; i += 4) {
+            __m128 value = _mm_max_ps(_mm_load_ps(planes[c] + i), _mm_setzero_ps());
+            __m128 bin = _mm_min_ps(_mm_mul_ps(value, cutScale), lastCutBin);
+            _mm_store_si128((__m128i *) (cutBins[c] + i), _mm_cvttps_epi32(bin));
+          }
+          for(int i = 0; i < count; ++i) {
+            ++histogram.cutBins[c][cutBins[c][i]];
+          }
+        }
+        histogram.cutCount += count;
+      }
+
+      // and finely, for black and white points
+      {
+        const float *planes[3] = {chunk.r, chunk.g, chunk.b};
+        for(int c = 0; c < 3; ++c) {
+          for(int i = 0; i < chunk.n; i += 4) {
+            __m128 value = _mm_max_ps(_mm_load_ps(planes[c] + i), _mm_setzero_ps());
+            __m128 bin = _mm_min_ps(_mm_mul_ps(value, levelScale), lastLevelBin);
+            _mm_store_si128((__m128i *) (bins + i), _mm_cvttps_epi32(bin));
+          }
+          for(int i = 0; i < count; ++i) {
+            ++histogram.levelBins[c][bins[i]];
+          }
+        }
+        histogram.levelCount += count;
+      }
+
+      if(transfer != eTransferLinear) {
+        DecodeTransfer(chunk.r, chunk.n, transfer);
+        DecodeTransfer(chunk.g, chunk.n, transfer);
+        DecodeTransfer(chunk.b, chunk.n, transfer);
+      }
+
+      // padding past the end of the strip is black, which has no chroma, so
+      // it adds nothing to the sum
+      __m128i sum = _mm_setzero_si128();
+      for(int i = 0; i < chunk.n; i += 4) {
+        __m128 r = _mm_load_ps(chunk.r + i);
+        __m128 g = _mm_load_ps(chunk.g + i);
+        __m128 b = _mm_load_ps(chunk.b + i);
+        __m128 average = _mm_mul_ps(_mm_add_ps(_mm_add_ps(r, g), b), third);
+        __m128 luma = _mm_sqrt_ps(_mm_max_ps(average, _mm_setzero_ps()));
+        _mm_store_si128((__m128i *) (lumaBins + i), _mm_cvttps_epi32(_mm_min_ps(_mm_mul_ps(luma, lumaScale), lastLumaBin)));
+
+        r = _mm_sub_ps(r, average);
+        g = _mm_sub_ps(g, average);
+        b = _mm_sub_ps(b, average);
+        __m128 chroma = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(r, r), _mm_mul_ps(g, g)), _mm_mul_ps(b, b)));
+        chroma = _mm_min_ps(chroma, range);
+
+        _mm_store_si128((__m128i *) (bins + i), _mm_cvttps_epi32(_mm_min_ps(_mm_mul_ps(chroma, binScale), lastBin)));
+        sum = _mm_add_epi32(sum, _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(chroma, fixedPoint), half)));
+      }
+
+      alignas(16) unsigned int lanes[4];
+      _mm_store_si128((__m128i *) lanes, sum);
+      histogram.sum += (unsigned long long) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+      histogram.count += count;
+      for(int i = 0; i < count; ++i) {
+        ++histogram.bins[bins[i]];
+        ++histogram.lumaBins[lumaBins[i]];
+      }
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // multithread suite callback, each thread takes every threadMax'th row
+  void AnalyseFrameThread(unsigned int threadIndex, unsigned int threadMax, void *arg)
+  {
+    // the analysis feeds every render of the frame and its neighbours, so
+    // it must come out the same on any thread of any host
+    FloatModeGuard floatMode;
+
+    AnalysisJob *analysis = (AnalysisJob *) arg;
+    FrameHistograms &histogram = analysis->histograms[threadIndex];
+    Image &src = *analysis->src;
+    Image noMask((OfxPropertySetHandle) NULL);
+
+    const OfxRectI &bounds = src.bounds();
+    for(int y = bounds.y1 + int(threadIndex); y < bounds.y2; y += int(threadMax)) {
+      if(src.bytesPerComponent() == 1) {
+        AccumulateRow<unsigned char, 255>(histogram, src, noMask, analysis->transfer, y);
+      }
+      else if(src.bytesPerComponent() == 2) {
+        AccumulateRow<unsigned short, 65535>(histogram, src, noMask, analysis->transfer, y);
+      }
+      else {
+        AccumulateRow<float, 1>(histogram, src, noMask, analysis->transfer, y);
+      }
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // the value below which the given fraction of a histogram over [0, range) lies
+  template <class COUNT>
+  float HistogramPercentile(const COUNT *bins, int nBins, float range, unsigned long long count, double fraction)
+  {
+    unsigned long long wanted = (unsigned long long) (count * fraction);
+    unsigned long long seen = 0;
+    for(int bin = 0; bin < nBins; ++bin) {
+      seen += bins[bin];
+      if(seen > wanted) {
+        return (bin + 0.5f) * (range / nBins);
+      }
+    }
+    return range;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // the median of a histogram of square roots, interpolating within the bin it
+  // falls in, so it moves smoothly as the image does
+  float SquareRootHistogramMedian(const unsigned long long *bins, int nBins, unsigned long long count)
+  {
+    double wanted = count * 0.5;
+    unsigned long long seen = 0;
+    for(int bin = 0; bin < nBins; ++bin) {
+      if(bins[bin] && seen + bins[bin] > wanted) {
+        double root = (bin + (wanted - seen) / double(bins[bin])) / nBins;
+        return float(root * root);
+      }
+      seen += bins[bin];
+    }
+    return 1.0f;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // work out the statistics and histograms of a whole source image, in parallel
+  FrameAnalysis AnalyseFrame(Image &src, TransferFunction transfer)
+  {
+    unsigned int nThreads = 1;
+    gMultiThreadSuite->multiThreadNumCPUs(&nThreads);
+    nThreads = std::max(nThreads, 1u);
+
+    AnalysisJob analysis;
+    analysis.src = &src;
+    analysis.transfer = transfer;
+    analysis.histograms.resize(nThreads);
+    memset(analysis.histograms.data(), 0, nThreads * sizeof(FrameHistograms));
+
+    gMultiThreadSuite->multiThread(AnalyseFrameThread, nThreads, &analysis);
+
+    // merge the threads' histograms, integers all the way so the order doesn't matter
+    std::vector<unsigned long long> bins(kChromaBins, 0), lumaBins(kLumaBins, 0);
+    unsigned long long cutBins[3][kCutBins] = {};
+    unsigned long long sum = 0, count = 0, cutCount = 0;
+    for(unsigned int t = 0; t < nThreads; ++t) {
+      const FrameHistograms &histogram = analysis.histograms[t];
+      for(int bin = 0; bin < kChromaBins; ++bin) {
+        bins[bin] += histogram.bins[bin];
+      }
+      for(int bin = 0; bin < kLumaBins; ++bin) {
+        lumaBins[bin] += histogram.lumaBins[bin];
+      }
+      for(int c = 0; c < 3; ++c) {
+        for(int bin = 0; bin < kCutBins; ++bin) {
+          cutBins[c][bin] += histogram.cutBins[c][bin];
+        }
+      }
+      sum += histogram.sum;
+      count += histogram.count;
+      cutCount += histogram.cutCount;
+    }
+
+    FrameAnalysis result;
+    ChromaStats &stats = result.chroma;
+    stats.mean = count ? float(double(sum) / double(count) / kChromaFixedPoint) : 0.0f;
+    stats.median = HistogramPercentile(bins.data(), kChromaBins, kChromaRange, count, 0.5);
+    stats.percentile95 = HistogramPercentile(bins.data(), kChromaBins, kChromaRange, count, 0.95);
+    result.lumaMedian = count ? SquareRootHistogramMedian(lumaBins.data(), kLumaBins, count) : 0.0f;
+
+    for(int c = 0; c < 3; ++c) {
+      for(int bin = 0; bin < kCutBins; ++bin) {
+        result.cutHistogram[c][bin] = cutCount ? float(double(cutBins[c][bin]) / double(cutCount)) : 0.0f;
+      }
+    }
+
+    memset(result.levelHistogram, 0, sizeof(result.levelHistogram));
+    result.levelCount = 0;
+    for(unsigned int t = 0; t < nThreads; ++t) {
+      const FrameHistograms &histogram = analysis.histograms[t];
+      for(int c = 0; c < 3; ++c) {
+        for(int bin = 0; bin < kLevelBins; ++bin) {
+          result.levelHistogram[c][bin] += histogram.levelBins[c][bin];
+        }
+      }
+      result.levelCount += histogram.levelCount;
+    }
+    return result;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // get the analysis of the frame the source image is from, working it out
+  // if no other render of the frame has
+  FrameAnalysis FetchFrameAnalysis(MyInstanceData *myData,
+                                   Image &src,
+                                   OfxTime time,
+                                   double renderScale,
+                                   TransferFunction transfer)
+  {
+    for(;;) {
+      std::shared_ptr<FrameStatsCache::Entry> entry = myData->frameStats.fetch(time, renderScale, transfer);
+
+      // a frame we have looked at is only checked against a fingerprint, the
+      // analysis is the only pass over the whole of it
+      unsigned long long fingerprint = ImageFingerprint(src);
+      std::lock_guard<std::mutex> lock(entry->mutex);
+      if(!entry->ready) {
+        entry->analysis = AnalyseFrame(src, transfer);
+        entry->source = fingerprint;
+        entry->valid = entry->ready = true;
+      }
+      if(entry->source == fingerprint) {
+        return entry->analysis;
+      }
+
+      // the frame has changed since we looked at it, so something upstream
+      // changed and anything we remember about other frames is suspect too
+      myData->frameStats.clear();
+      myData->shots.clear();
+    }
+  }
 
-    return kOfxStatOK;
+  ////////////////////////////////////////////////////////////////////////////////
+  // get the analysis of another frame of the source, only fetching and
+  // looking at it if no render has yet, false if there is no frame there
+  bool FetchNeighbourAnalysis(MyInstanceData *myData,
+                              OfxTime time,
+                              double renderScale,
+                              TransferFunction transfer,
+                              FrameAnalysis &analysis)
+  {
+    std::shared_ptr<FrameStatsCache::Entry> entry = myData->frameStats.fetch(time, renderScale, transfer);
+
+    std::lock_guard<std::mutex> lock(entry->mutex);
+    if(!entry->ready) {
+      Image src(myData->sourceClip, time);
+      if(src) {
+        entry->analysis = AnalyseFrame(src, transfer);
+        entry->source = ImageFingerprint(src);
+        entry->valid = true;
+      }
+      entry->ready = true;
+    }
+    analysis = entry->analysis;
+    return entry->valid;
   }
 
   ////////////////////////////////////////////////////////////////////////////////
-  /// instance construction
-  OfxStatus CreateInstanceAction( OfxImageEffectHandle instance)
+  // how different two frames' cut histograms are, from 0 for the same spread of
+  // values to 1 for no overlap at all, averaged over the channels
+  float CutHistogramDifference(const FrameAnalysis &a, const FrameAnalysis &b)
   {
-    OfxPropertySetHandle effectProps;
-    gImageEffectSuite->getPropertySet(instance, &effectProps);
+    float difference = 0;
+    for(int c = 0; c < 3; ++c) {
+      for(int bin = 0; bin < kCutBins; ++bin) {
+        difference += fabsf(a.cutHistogram[c][bin] - b.cutHistogram[c][bin]);
+      }
+    }
+    return difference / 6.0f;
+  }
 
-    // To avoid continual lookup, put our handles into our instance
-    // data, those handles are guaranteed to be valid for the duration
-    // of the instance.
-    MyInstanceData *myData = new MyInstanceData;
+  ////////////////////////////////////////////////////////////////////////////////
+  // is there a scene cut between the frame at the given time and the one before
+  // it. The difference between the two is remembered with the frame, so each
+  // pair is only compared once whatever the threshold.
+  bool IsCutBefore(MyInstanceData *myData,
+                   OfxTime time,
+                   double renderScale,
+                   TransferFunction transfer,
+                   float threshold)
+  {
+    std::shared_ptr<FrameStatsCache::Entry> entry = myData->frameStats.fetch(time, renderScale, transfer);
+    {
+      std::lock_guard<std::mutex> lock(entry->mutex);
+      if(entry->ready && entry->cutDifference >= 0) {
+        return entry->cutDifference > threshold;
+      }
+    }
 
-    // Set my private instance data
-    gPropertySuite->propSetPointer(effectProps, kOfxPropInstanceData, 0, (void *) myData);
+    // both frames' analyses, without holding any entry while we get them
+    FrameAnalysis current, previous;
+    float difference = 0;
+    if(FetchNeighbourAnalysis(myData, time, renderScale, transfer, current) &&
+       FetchNeighbourAnalysis(myData, time - 1, renderScale, transfer, previous)) {
+      difference = CutHistogramDifference(current, previous);
+    }
 
-    // is this instance made for the general context?
-    char *context = 0;
-    gPropertySuite->propGetString(effectProps, kOfxImageEffectPropContext, 0,  &context);
-    myData->isGeneralContext = context && (strcmp(context, kOfxImageEffectContextGeneral) == 0);
+    std::lock_guard<std::mutex> lock(entry->mutex);
+    entry->cutDifference = difference;
+    return difference > threshold;
+  }
 
-    // Cache the source and output clip handles
-    gImageEffectSuite->clipGetHandle(instance, "Source", &myData->sourceClip, 0);
-    gImageEffectSuite->clipGetHandle(instance, "Output", &myData->outputClip, 0);
+  ////////////////////////////////////////////////////////////////////////////////
+  // what temporal smoothing needs to know of a neighbouring frame
+  struct WindowFrame {
+    int distance;
+    ChromaStats chroma;
+    float lumaMedian;
+  };
 
-    if(myData->isGeneralContext) {
-      gImageEffectSuite->clipGetHandle(instance, "Mask", &myData->maskClip, 0);
+  ////////////////////////////////////////////////////////////////////////////////
+  // the frames within the radius either side of a frame and in the same shot.
+  // The window stops at scene cuts and at the ends of the clip, and only
+  // fetches the frames no render has looked at yet.
+  void FetchShotWindow(MyInstanceData *myData,
+                       OfxTime time,
+                       double renderScale,
+                       TransferFunction transfer,
+                       int radius,
+                       float cutThreshold,
+                       std::vector<WindowFrame> &window)
+  {
+    window.clear();
+
+    // walk out from the frame each way until the radius, a cut or the end of the clip
+    FrameAnalysis neighbour;
+    for(int direction = -1; direction <= 1; direction += 2) {
+      for(int distance = 1; distance <= radius; ++distance) {
+        OfxTime neighbourTime = time + direction * distance;
+
+        // the cut that would end the window is before whichever of the
+        // neighbour and the frame next to it nearer us comes later
+        OfxTime laterTime = direction > 0 ? neighbourTime : neighbourTime + 1;
+        if(IsCutBefore(myData, laterTime, renderScale, transfer, cutThreshold)) {
+          break;
+        }
+
+        if(!FetchNeighbourAnalysis(myData, neighbourTime, renderScale, transfer, neighbour)) {
+          break;
+        }
+
+        WindowFrame frame;
+        frame.distance = distance;
+        frame.chroma = neighbour.chroma;
+        frame.lumaMedian = neighbour.lumaMedian;
+        window.push_back(frame);
+      }
     }
+  }
 
-    // Cache away the param handles
-    OfxParamSetHandle paramSet;
-    gImageEffectSuite->getParamSet(instance, &paramSet);
-    gParameterSuite->paramGetHandle(paramSet,
-                                    SATURATION_PARAM_NAME,
-                                    &myData->saturationParam,
-                                    0);
+  ////////////////////////////////////////////////////////////////////////////////
+  // a frame's statistics averaged with those of its neighbours within the
+  // radius, weighted down linearly with distance, so the auto gain doesn't
+  // flicker along with the film. The window stops at scene cuts, so one
+  // shot's colour never bleeds into the next.
+  ChromaStats SmoothChromaStats(MyInstanceData *myData,
+                                const ChromaStats &current,
+                                OfxTime time,
+                                double renderScale,
+                                TransferFunction transfer,
+                                int radius,
+                                float cutThreshold)
+  {
+    float weight = float(radius + 1);
+    ChromaStats sum = current;
+    sum.mean *= weight;
+    sum.median *= weight;
+    sum.percentile95 *= weight;
 
-    return kOfxStatOK;
+    std::vector<WindowFrame> window;
+    FetchShotWindow(myData, time, renderScale, transfer, radius, cutThreshold, window);
+    for(size_t i = 0; i < window.size(); ++i) {
+      float w = float(radius + 1 - window[i].distance);
+      sum.mean += window[i].chroma.mean * w;
+      sum.median += window[i].chroma.median * w;
+      sum.percentile95 += window[i].chroma.percentile95 * w;
+      weight += w;
+    }
+
+    sum.mean /= weight;
+    sum.median /= weight;
+    sum.percentile95 /= weight;
+    return sum;
   }
 
+  // below this median luma a frame is too near black for its exposure to be
+  // measured, and deflickering leaves it, and leaves it out, alone
+  const float kMinDeflickerLuma = 0.001f;
+
+  // the most deflickering will brighten or darken a frame by
+  const float kMaxDeflickerGain = 2.0f;
+
   ////////////////////////////////////////////////////////////////////////////////
-  // instance destruction
-  OfxStatus DestroyInstanceAction( OfxImageEffectHandle instance)
+  // the exposure gain that brings a frame's median luma to the average of its
+  // neighbours within the radius, weighted down linearly with distance.
+  // Flicker scales the light, so the average is taken of the logs. The window
+  // stops at scene cuts, so a change of shot is never smoothed over. The logs
+  // are our own rather than the C library's, whose last bits can depend on
+  // the CPU it picks a version for.
+  float DeflickerGain(MyInstanceData *myData,
+                      float lumaMedian,
+                      OfxTime time,
+                      double renderScale,
+                      TransferFunction transfer,
+                      int radius,
+                      float cutThreshold)
   {
-    // get my instance data
-    MyInstanceData *myData = FetchInstanceData(instance);
-    delete myData;
+    if(lumaMedian < kMinDeflickerLuma) {
+      return 1.0f;
+    }
 
-    return kOfxStatOK;
+    float weight = float(radius + 1);
+    float logCurrent = _mm_cvtss_f32(FastLog2(_mm_set_ss(lumaMedian)));
+    float sum = logCurrent * weight;
+
+    std::vector<WindowFrame> window;
+    FetchShotWindow(myData, time, renderScale, transfer, radius, cutThreshold, window);
+    for(size_t i = 0; i < window.size(); ++i) {
+      if(window[i].lumaMedian >= kMinDeflickerLuma) {
+        float w = float(radius + 1 - window[i].distance);
+        sum += _mm_cvtss_f32(FastLog2(_mm_set_ss(window[i].lumaMedian))) * w;
+        weight += w;
+      }
+    }
+
+    float gain = _mm_cvtss_f32(FastExp2(_mm_set_ss(sum / weight - logCurrent)));
+    return std::min(std::max(gain, 1.0f / kMaxDeflickerGain), kMaxDeflickerGain);
   }
 
   ////////////////////////////////////////////////////////////////////////////////
-  // clamp to 0 and MAX inclusive
-  template <class T, int MAX>
-  static inline T Clamp(float value)
+  // the saturation gain that takes a frame's mean chroma to the target, held
+  // back so the 95th percentile doesn't go past the top of the chroma range
+  float AutoSaturationGain(const ChromaStats &stats, float targetChroma)
+  {
+    if(stats.mean < kMinAutoChroma) {
+      return 1.0f;
+    }
+    float gain = targetChroma / stats.mean;
+    if(stats.percentile95 > 0) {
+      gain = std::min(gain, kChromaRange / stats.percentile95);
+    }
+    return gain;
+  }
+
+  // the percentiles taken as black and white, so a few specks of dirt or
+  // sparkle don't set them
+  const double kBlackPercentile = 0.005;
+  const double kWhitePercentile = 0.995;
+
+  // a channel spanning less than this is more likely flat than faded, and is
+  // left alone
+  const float kMinLevelsRange = 0.05f;
+
+  // shots are looked for in segments that start on multiples of this, so the
+  // shot a frame is in, and so its levels, depend on the frame alone and not
+  // on where a render started, as on a farm where each node starts mid shot.
+  // A shot that started in a frame's segment has its levels measured at its
+  // first frame. One that started before has its levels faded over the
+  // segment from those it ended the last segment with to ones measured at
+  // the segment's start, so a long shot never switches levels all at once.
+  // Two segments and their samples fit the frame stats cache.
+  const int kShotSegmentFrames = 64;
+
+  // how many frames from the start of a shot its levels are measured over
+  const int kShotSampleFrames = 8;
+
+  // the first frame of the segment a frame is in
+  OfxTime ShotSegmentStart(OfxTime time)
   {
-    if(MAX == 1)
-      return value; // don't clamp floating point values
-    else
-      return value < 0 ? T(0) : (value > MAX ? T(MAX) : T(value));
+    return floor(floor(time) / kShotSegmentFrames) * kShotSegmentFrames;
   }
 
   ////////////////////////////////////////////////////////////////////////////////
-  // clamp to 0 and MAX inclusive
-  template <class T1, class T2>
-  static inline T1 Blend(T1 v1, T2 v2, float blend)
+  // does a shot start at the frame, with a cut before it or no frame there
+  bool IsShotStart(MyInstanceData *myData,
+                   OfxTime time,
+                   double renderScale,
+                   TransferFunction transfer,
+                   float cutThreshold)
   {
-    return v1 + (v2-v1) * blend;
+    FrameAnalysis previous;
+    return !FetchNeighbourAnalysis(myData, time - 1, renderScale, transfer, previous) ||
+           IsCutBefore(myData, time, renderScale, transfer, cutThreshold);
   }
 
   ////////////////////////////////////////////////////////////////////////////////
-  // iterate over our pixels and process them
-  template <class T, int MAX>
-  void PixelProcessing(double saturation,
-                       OfxImageEffectHandle instance,
-                       Image &src,
-                       Image &mask,
-                       Image &output,
-                       OfxRectI renderWindow)
-  {
-    int nComps = output.nComponents();
-
-    // and do some processing
-    for(int y = renderWindow.y1; y < renderWindow.y2; y++) {
-      if(y % 20 == 0 && gImageEffectSuite->abort(instance)) break;
-
-      // get the row start for the output image
-      T *dstPix = output.pixelAddress<T>(renderWindow.x1, y);
-
-      for(int x = renderWindow.x1; x < renderWindow.x2; x++) {
-
-        // get the source pixel
-        T *srcPix = src.pixelAddress<T>(x, y);
-
-        // get the amount to mask by, no mask image means we do the full effect everywhere
-        float maskAmount = 1.0f;
-        if (mask) {
-          // get our mask pixel address
-          T *maskPix = mask.pixelAddress<T>(x, y);
-          if(maskPix) {
-            maskAmount = float(*maskPix)/float(MAX);
-          }
-          else {
-            maskAmount = 0;
-          }
+  // find the first frame of the shot a frame is in, walking back to the cut
+  // before it, the start of its segment or a frame whose shot we already know
+  OfxTime FindShotStart(MyInstanceData *myData,
+                        OfxTime time,
+                        double renderScale,
+                        TransferFunction transfer,
+                        float cutThreshold)
+  {
+    OfxTime start;
+    if(myData->shots.findStart(time, cutThreshold, start)) {
+      return start;
+    }
+
+    OfxTime segmentStart = ShotSegmentStart(time);
+    std::vector<OfxTime> walked;
+    start = time;
+    for(;;) {
+      walked.push_back(start);
+      if(start <= segmentStart || IsShotStart(myData, start, renderScale, transfer, cutThreshold)) {
+        break;
+      }
+      if(myData->shots.findStart(start - 1, cutThreshold, start)) {
+        break;
+      }
+      start -= 1;
+    }
+
+    for(size_t i = 0; i < walked.size(); ++i) {
+      myData->shots.setStart(walked[i], cutThreshold, start);
+    }
+    return start;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // work out the levels of the shot starting at the given frame, from the black
+  // and white points of its first few frames taken together
+  Levels MeasureShotLevels(MyInstanceData *myData,
+                           OfxTime start,
+                           double renderScale,
+                           TransferFunction transfer,
+                           float cutThreshold)
+  {
+    std::vector<unsigned long long> bins(3 * kLevelBins, 0);
+    unsigned long long count = 0;
+
+    FrameAnalysis analysis;
+    for(int i = 0; i < kShotSampleFrames; ++i) {
+      OfxTime frame = start + i;
+      if((i > 0 && IsCutBefore(myData, frame, renderScale, transfer, cutThreshold)) ||
+         !FetchNeighbourAnalysis(myData, frame, renderScale, transfer, analysis)) {
+        break;
+      }
+      for(int c = 0; c < 3; ++c) {
+        for(int bin = 0; bin < kLevelBins; ++bin) {
+          bins[c * kLevelBins + bin] += analysis.levelHistogram[c][bin];
         }
+      }
+      count += analysis.levelCount;
+    }
 
-        if(srcPix) {
-          if(maskAmount == 0) {
-            // we have a mask input, but the mask is zero here,
-            // so no effect happens, copy source to output
-            for(int i = 0; i < nComps; ++i) {
-              *dstPix = *srcPix;
-              ++dstPix; ++srcPix;
-            }
-          }
-          else {
-            // we have a non zero mask or no mask at all
+    Levels levels;
+    for(int c = 0; c < 3 && count; ++c) {
+      const unsigned long long *channel = &bins[c * kLevelBins];
+      float black = HistogramPercentile(channel, kLevelBins, 1.0f, count, kBlackPercentile);
+      float white = HistogramPercentile(channel, kLevelBins, 1.0f, count, kWhitePercentile);
+      if(white - black >= kMinLevelsRange) {
+        levels.gain[c] = 1.0f / (white - black);
+        levels.offset[c] = -black * levels.gain[c];
+      }
+    }
+    return levels;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // get the levels measured from the given frame on, measuring them if no
+  // render has yet
+  Levels FetchLevelsFrom(MyInstanceData *myData,
+                         OfxTime start,
+                         double renderScale,
+                         TransferFunction transfer,
+                         float cutThreshold)
+  {
+    std::shared_ptr<ShotCache::Entry> entry = myData->shots.fetchLevels(start);
+    std::lock_guard<std::mutex> lock(entry->mutex);
+    if(!entry->ready) {
+      entry->levels = MeasureShotLevels(myData, start, renderScale, transfer, cutThreshold);
+      entry->ready = true;
+    }
+    return entry->levels;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // get the levels of the shot a frame is in, faded in from the last segment's
+  // if the shot carries on from there
+  Levels FetchShotLevels(MyInstanceData *myData,
+                         OfxTime time,
+                         double renderScale,
+                         TransferFunction transfer,
+                         float cutThreshold)
+  {
+    OfxTime start = FindShotStart(myData, time, renderScale, transfer, cutThreshold);
+    Levels levels = FetchLevelsFrom(myData, start, renderScale, transfer, cutThreshold);
 
-            // find the average of the R, G and B
-            float average = (srcPix[0] + srcPix[1] + srcPix[2])/3.0f;
+    OfxTime segmentStart = ShotSegmentStart(time);
+    if(start != segmentStart || IsShotStart(myData, start, renderScale, transfer, cutThreshold)) {
+      return levels;
+    }
 
-            // scale each component around that average
-            for(int c = 0; c < 3; ++c) {
-              float value = (srcPix[c] - average) * saturation + average;
-              value = Clamp<T, MAX>(value);
-              // use the mask to control how much original we should have
-              dstPix[c] = Blend(srcPix[c], value, maskAmount);
-            }
+    // the levels the last segment ended with, whether from a shot that
+    // started in it or faded all the way to its own
+    OfxTime before = FindShotStart(myData, segmentStart - 1, renderScale, transfer, cutThreshold);
+    Levels from = FetchLevelsFrom(myData, before, renderScale, transfer, cutThreshold);
 
-            if(nComps == 4) { // if we have an alpha, just copy it
-              dstPix[3] = srcPix[3];
-            }
-            dstPix += nComps;
+    float fade = float(floor(time) - segmentStart + 1) / kShotSegmentFrames;
+    for(int c = 0; c < 3; ++c) {
+      levels.gain[c] = from.gain[c] + (levels.gain[c] - from.gain[c]) * fade;
+      levels.offset[c] = from.offset[c] + (levels.offset[c] - from.offset[c]) * fade;
+    }
+    return levels;
+  }
+
+  // round down to a multiple of the tile size, negative coordinates included
+  static inline int TileFloor(int value)
+  {
+    return value - (value % kCacheTileSize + kCacheTileSize) % kCacheTileSize;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // render a window tile by tile, copying any tile whose source and mask pixels
+  // and settings we have seen before out of the cache, whatever frame that was
+  void RenderCachedTiles(RenderCache &cache,
+                         RenderCacheKey key,
+                         const RenderSettings &settings,
+                         const AbortCheck &aborted,
+                         Image &src,
+                         Image &mask,
+                         Image &output,
+                         OfxRectI renderWindow)
+  {
+    // a tile's pixels only depend on its source, not on when it is
+    key.time = 0;
+
+    for(int ty = TileFloor(renderWindow.y1); ty < renderWindow.y2; ty += kCacheTileSize) {
+      for(int tx = TileFloor(renderWindow.x1); tx < renderWindow.x2; tx += kCacheTileSize) {
+        if(aborted()) return;
+
+        OfxRectI tile;
+        tile.x1 = std::max(tx, renderWindow.x1);
+        tile.y1 = std::max(ty, renderWindow.y1);
+        tile.x2 = std::min(tx + kCacheTileSize, renderWindow.x2);
+        tile.y2 = std::min(ty + kCacheTileSize, renderWindow.y2);
+
+        key.window = tile;
+        key.source = HashImageWindow(src, GrowRect(tile, SourceBorder(settings)));
+        key.mask = mask ? HashImageWindow(mask, tile) : 0;
+
+        if(!cache.fetch(key, output)) {
+          RenderWindow(settings, aborted, src, mask, output, tile);
+          if(!aborted()) {
+            cache.store(key, output);
           }
         }
-        else {
-          // we don't have a pixel in the source image, set output to zero
-          for(int i = 0; i < nComps; ++i) {
-            *dstPix = 0;
-            ++dstPix;
-          }
+        else if(settings.scopes) {
+          AccumulateScopeWindow(*settings.scopes, output, tile);
         }
       }
     }
@@ -638,8 +3903,19 @@ namespace {
     MyInstanceData *myData = FetchInstanceData(instance);
 
     // get our param values
-    double saturation = 1.0;
-    gParameterSuite->paramGetValueAtTime(myData->saturationParam, time, &saturation);
+    RenderSettings settings;
+    FetchRenderSettings(myData, time, settings);
+
+    // the host's floating point mode could differ from one machine to the next
+    FloatModeGuard floatMode(settings.deterministic);
+
+    // the kernel asks the host whether to carry on every so often
+    AbortCheck aborted = [instance]() { return gImageEffectSuite->abort(instance) != 0; };
+
+    // hang onto the LUT for the duration of the render, if the watcher swaps
+    // in a new one meanwhile we carry on with this one
+    std::shared_ptr<const Lut3D> lut = myData->lutSlot->lut.get(), bakedLut;
+    settings.lut = lut.get();
 
     // the property sets holding our images
     OfxPropertySetHandle outputImg = NULL, sourceImg = NULL, maskImg = NULL;
@@ -661,34 +3937,172 @@ namespace {
       // is optional, so don't worry if we don't have one.
       Image maskImg(myData->maskClip, time);
 
-      // now do our render depending on the data type
-      if(outputImg.bytesPerComponent() == 1) {
-        PixelProcessing<unsigned char, 255>(saturation,
-                                            instance,
-                                            sourceImg,
-                                            maskImg,
-                                            outputImg,
-                                            renderWindow);
-      }
-      else if(outputImg.bytesPerComponent() == 2) {
-        PixelProcessing<unsigned short, 65535>(saturation,
-                                               instance,
-                                               sourceImg,
-                                               maskImg,
-                                               outputImg,
-                                               renderWindow);
-      }
-      else if(outputImg.bytesPerComponent() == 4) {
-        PixelProcessing<float, 1>(saturation,
-                                  instance,
-                                  sourceImg,
-                                  maskImg,
-                                  outputImg,
-                                  renderWindow);
+      double renderScale[2] = {1.0, 1.0};
+      gPropertySuite->propGetDoubleN(inArgs, kOfxImageEffectPropRenderScale, 2, renderScale);
+      settings.chromaRadius = ChromaBlurRadius(settings.chromaSize * float(renderScale[0]));
+
+      // the source pixels the window depends on, which the regions of
+      // interest action asked the host for
+      OfxRectI sourceWindow = GrowRect(renderWindow, SourceBorder(settings));
+
+      // auto saturation, restoration and deflickering need the whole frame's
+      // statistics, which the regions of interest action made sure the source
+      // image covers
+      if(settings.autoSaturation || settings.restoreLevels || settings.deflicker) {
+        FrameAnalysis analysis = FetchFrameAnalysis(myData, sourceImg, time, renderScale[0], settings.transfer);
+        ChromaStats stats = analysis.chroma;
+
+        if(settings.restoreLevels) {
+          settings.levels = FetchShotLevels(myData, time, renderScale[0], settings.transfer, settings.cutThreshold);
+        }
+
+        // the luma and chroma are measured as the source comes in, before
+        // restoration, whose levels hold for the whole shot
+        if(settings.deflicker) {
+          settings.exposure = DeflickerGain(myData, analysis.lumaMedian, time, renderScale[0], settings.transfer,
+                                            settings.deflickerRadius, settings.cutThreshold);
+        }
+
+        if(settings.autoSaturation) {
+          if(settings.smoothingRadius > 0) {
+            stats = SmoothChromaStats(myData, stats, time, renderScale[0], settings.transfer,
+                                      settings.smoothingRadius, settings.cutThreshold);
+          }
+          settings.saturation *= AutoSaturationGain(stats, settings.targetChroma);
+        }
+      }
+
+      // temporal denoising needs the window of the frames either side, which
+      // the frames needed action asked the host for. The ring holds on to
+      // them, and to this frame, for the renders of the frames around us.
+      std::vector<std::shared_ptr<const SourceFrame> > denoiseFrames;
+      if(settings.denoiseStrength > 0) {
+        int bufferFrames = 8;
+        gParameterSuite->paramGetValue(myData->denoiseBufferParam, &bufferFrames);
+        myData->sourceFrames.setCapacity(bufferFrames);
+        myData->sourceFrames.storeCurrent(sourceImg, time, renderScale[0]);
+
+        // only as much of the neighbours as the source has for the window
+        OfxRectI area = sourceWindow;
+        area.x1 = std::max(area.x1, sourceImg.bounds().x1);
+        area.y1 = std::max(area.y1, sourceImg.bounds().y1);
+        area.x2 = std::max(std::min(area.x2, sourceImg.bounds().x2), area.x1);
+        area.y2 = std::max(std::min(area.y2, sourceImg.bounds().y2), area.y1);
+
+        for(int distance = 1; distance <= settings.denoiseRadius; ++distance) {
+          for(int direction = -1; direction <= 1; direction += 2) {
+            std::shared_ptr<const SourceFrame> frame =
+              myData->sourceFrames.fetch(myData->sourceClip, time + direction * distance, renderScale[0], area);
+            if(frame &&
+               frame->nComponents == sourceImg.nComponents() &&
+               frame->bytesPerComponent == sourceImg.bytesPerComponent()) {
+              settings.denoiseFrames[settings.denoiseCount++] = frame.get();
+              denoiseFrames.push_back(frame);
+            }
+          }
+        }
+      }
+
+      // 8 and 16 bit images can go through the whole color transform baked
+      // into one table, unless the gains measured from each frame change it
+      // every frame, when each table would be baked to be used for one
+      int bakedSize = BakedLutSize(settings, outputImg.bytesPerComponent());
+      bool perFrame = settings.autoSaturation || settings.deflicker || settings.restoreLevels;
+      if(bakedSize && !perFrame) {
+        bakedLut = myData->bakedLuts.fetch(settings, lut, bakedSize);
+        settings.bakedLut = bakedLut.get();
+      }
+
+      // the cache memory goes to whole frames, or to tiles if we are reusing
+      // static regions
+      int cacheSize = 0, tileCache = 0;
+      gParameterSuite->paramGetValue(myData->frameCacheParam, &cacheSize);
+      gParameterSuite->paramGetValue(myData->tileCacheParam, &tileCache);
+      myData->frameCache.setCapacity(tileCache ? 0 : size_t(cacheSize) << 20);
+      myData->tileCache.setCapacity(tileCache ? size_t(cacheSize) << 20 : 0);
+
+      // the scopes are gathered by the kernel as it writes the window, in our
+      // own bins as no other thread renders it, and merged into the frame's
+      // when we are done
+      char *scopePath = NULL;
+      gParameterSuite->paramGetValue(myData->scopeFileParam, &scopePath);
+      std::unique_ptr<ScopeBins> scopes;
+      if(scopePath && *scopePath) {
+        scopes.reset(new ScopeBins);
+        memset(scopes.get(), 0, sizeof(ScopeBins));
+        settings.scopes = scopes.get();
+      }
+
+      RenderCacheKey cacheKey;
+      cacheKey.time = time;
+      cacheKey.window = renderWindow;
+      cacheKey.renderScale[0] = renderScale[0];
+      cacheKey.renderScale[1] = renderScale[1];
+      cacheKey.bytesPerPixel = outputImg.bytesPerPixel();
+      cacheKey.settings = HashSettings(settings);
+      cacheKey.source = cacheKey.mask = 0;
+
+      if(myData->tileCache.enabled()) {
+        RenderCachedTiles(myData->tileCache, cacheKey, settings, aborted,
+                          sourceImg, maskImg, outputImg, renderWindow);
       }
       else {
-        throw " bad data type!";
-        throw 1;
+        // if we've rendered exactly this before, just copy it
+        int reuseRepeats = 0;
+        bool cached = false;
+        gParameterSuite->paramGetValue(myData->repeatedFramesParam, &reuseRepeats);
+
+        if(myData->frameCache.enabled()) {
+          if(reuseRepeats) {
+            // a repeated frame has the same pixels at a different time, so
+            // go by what is in the images and leave the time out of it
+            cacheKey.time = 0;
+            cacheKey.source = HashImageWindow(sourceImg, sourceWindow);
+            cacheKey.mask = maskImg ? HashImageWindow(maskImg, renderWindow) : 0;
+          }
+          else {
+            cacheKey.source = ImageIdentity(sourceImg, sourceWindow);
+            cacheKey.mask = maskImg ? ImageIdentity(maskImg, renderWindow) : 0;
+          }
+
+          ++myData->sequenceRenders;
+          cached = myData->frameCache.fetch(cacheKey, outputImg);
+          if(cached && reuseRepeats) {
+            ++myData->sequenceRepeats;
+          }
+        }
+
+        if(cached) {
+          if(settings.scopes) {
+            AccumulateScopeWindow(*settings.scopes, outputImg, renderWindow);
+          }
+        }
+        else {
+          RenderWindow(settings, aborted, sourceImg, maskImg, outputImg, renderWindow);
+
+          // keep it for next time, unless we were cut short
+          if(myData->frameCache.enabled() && !gImageEffectSuite->abort(instance)) {
+            myData->frameCache.store(cacheKey, outputImg);
+          }
+        }
+      }
+
+      // the scopes of a window we were cut short on would be missing some of it
+      if(settings.scopes && !gImageEffectSuite->abort(instance)) {
+        // the output's RoD in pixels, left empty if the host won't say, so
+        // the frame's scopes are only written at the end of the sequence.
+        // Canonical coordinates are square, so x is in pixels once divided
+        // by their aspect ratio as well.
+        OfxRectD rod;
+        OfxRectI rodPixels = {0, 0, 0, 0};
+        if(gImageEffectSuite->clipGetRegionOfDefinition(myData->outputClip, time, &rod) == kOfxStatOK) {
+          double scaleX = renderScale[0] / outputImg.pixelAspectRatio();
+          rodPixels.x1 = int(floor(rod.x1 * scaleX));
+          rodPixels.y1 = int(floor(rod.y1 * renderScale[1]));
+          rodPixels.x2 = int(ceil(rod.x2 * scaleX));
+          rodPixels.y2 = int(ceil(rod.y2 * renderScale[1]));
+        }
+        myData->scopes.merge(*settings.scopes, time, renderScale[0], renderWindow, rodPixels, scopePath);
       }
 
     }
@@ -717,11 +4131,18 @@ namespace {
     double time;
     gPropertySuite->propGetDouble(inArgs, kOfxPropTime, 0, &time);
 
-    double saturation = 1.0;
-    gParameterSuite->paramGetValueAtTime(myData->saturationParam, time, &saturation);
+    RenderSettings settings;
+    FetchRenderSettings(myData, time, settings);
 
-    // if the saturation value is 1.0 (or nearly so) say we aren't doing anything
-    if(fabs(saturation - 1.0) < 0.000000001) {
+    bool hasLut = myData->lutSlot->lut.get() != NULL;
+
+    // if the saturation value is 1.0 (or nearly so) and there is no LUT and
+    // nothing set automatically, say we aren't doing anything. Gamut
+    // compression still pulls in colours the source has out of gamut.
+    if(fabs(settings.saturation - 1.0) < 0.000000001 && !hasLut &&
+       !settings.autoSaturation && !settings.restoreLevels && !settings.deflicker &&
+       settings.denoiseStrength <= 0 && settings.chromaDetail == 0 && settings.grainAmount <= 0 &&
+       !settings.gamutCompression) {
       // we set the name of the input clip to pull default images from
       gPropertySuite->propSetString(outArgs, kOfxPropName, 0, "Source");
       // and say we trapped the action and we are at the identity
@@ -732,6 +4153,92 @@ namespace {
     return kOfxStatReplyDefault;
   }
 
+  ////////////////////////////////////////////////////////////////////////////////
+  // say what region of the source we need to render a window of output
+  OfxStatus GetRegionsOfInterestAction(OfxImageEffectHandle instance,
+                                       OfxPropertySetHandle inArgs,
+                                       OfxPropertySetHandle outArgs)
+  {
+    MyInstanceData *myData = FetchInstanceData(instance);
+
+    double time;
+    gPropertySuite->propGetDouble(inArgs, kOfxPropTime, 0, &time);
+
+    RenderSettings settings;
+    FetchRenderSettings(myData, time, settings);
+
+    // auto saturation, restoration and deflickering look at the whole frame
+    if(settings.autoSaturation || settings.restoreLevels || settings.deflicker) {
+      OfxRectD sourceRoD;
+      gImageEffectSuite->clipGetRegionOfDefinition(myData->sourceClip, time, &sourceRoD);
+      gPropertySuite->propSetDoubleN(outArgs, kOfxImageClipPropRoI "Source", 4, &sourceRoD.x1);
+      return kOfxStatOK;
+    }
+
+    // chroma detail looks a border's width round the window, which is in
+    // pixels at the render scale
+    if(settings.chromaDetail != 0) {
+      double renderScale[2] = {1.0, 1.0};
+      gPropertySuite->propGetDoubleN(inArgs, kOfxImageEffectPropRenderScale, 2, renderScale);
+      settings.chromaRadius = ChromaBlurRadius(settings.chromaSize * float(renderScale[0]));
+
+      OfxRectD roi;
+      gPropertySuite->propGetDoubleN(inArgs, kOfxImageEffectPropRegionOfInterest, 4, &roi.x1);
+      double border = SourceBorder(settings);
+      roi.x1 -= border / renderScale[0];
+      roi.y1 -= border / renderScale[1];
+      roi.x2 += border / renderScale[0];
+      roi.y2 += border / renderScale[1];
+      gPropertySuite->propSetDoubleN(outArgs, kOfxImageClipPropRoI "Source", 4, &roi.x1);
+      return kOfxStatOK;
+    }
+
+    // otherwise the default of the render window is all we need
+    return kOfxStatReplyDefault;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // say what frames of the source we need to render a frame
+  OfxStatus GetFramesNeededAction(OfxImageEffectHandle instance,
+                                  OfxPropertySetHandle inArgs,
+                                  OfxPropertySetHandle outArgs)
+  {
+    MyInstanceData *myData = FetchInstanceData(instance);
+
+    double time;
+    gPropertySuite->propGetDouble(inArgs, kOfxPropTime, 0, &time);
+
+    RenderSettings settings;
+    FetchRenderSettings(myData, time, settings);
+
+    // smoothed auto saturation, deflickering and temporal denoising look
+    // either side of the frame, restoring levels back to the start of the
+    // shot segment before its own, for the levels it fades from, and on over
+    // the levels' samples, otherwise the default of the frame itself is all
+    // we need
+    int radius = 0;
+    if(settings.autoSaturation) {
+      radius = settings.smoothingRadius;
+    }
+    if(settings.deflicker) {
+      radius = std::max(radius, settings.deflickerRadius);
+    }
+    if(settings.denoiseStrength > 0) {
+      radius = std::max(radius, settings.denoiseRadius);
+    }
+    if(radius == 0 && !settings.restoreLevels) {
+      return kOfxStatReplyDefault;
+    }
+
+    double range[2] = {time - radius, time + radius};
+    if(settings.restoreLevels) {
+      range[0] = std::min(range[0], ShotSegmentStart(time) - kShotSegmentFrames);
+      range[1] = std::max(range[1], time + kShotSampleFrames - 1);
+    }
+    gPropertySuite->propSetDoubleN(outArgs, kOfxImageClipPropFrameRange "_Source", 2, range);
+    return kOfxStatOK;
+  }
+
   ////////////////////////////////////////////////////////////////////////////////
   // The main entry point function, the host calls this to get the plugin to do things.
   OfxStatus MainEntryPoint(const char *action, const void *handle, OfxPropertySetHandle inArgs,  OfxPropertySetHandle outArgs)
@@ -746,6 +4253,10 @@ namespace {
       // The very first action called on a plugin.
       returnStatus = LoadAction();
     }
+    else if(strcmp(action, kOfxActionUnload) == 0) {
+      // The very last action called on a plugin.
+      returnStatus = UnloadAction();
+    }
     else if(strcmp(action, kOfxActionDescribe) == 0) {
       // the first action called to describe what the plugin does
       returnStatus = DescribeAction(effect);
@@ -758,6 +4269,10 @@ namespace {
       // the action called when an instance of a plugin is created
       returnStatus = CreateInstanceAction(effect);
     }
+    else if(strcmp(action, kOfxActionInstanceChanged) == 0) {
+      // the action called when a param or clip of an instance has changed
+      returnStatus = InstanceChangedAction(effect, inArgs);
+    }
     else if(strcmp(action, kOfxActionDestroyInstance) == 0) {
       // the action called when an instance of a plugin is destroyed
       returnStatus = DestroyInstanceAction(effect);
@@ -770,6 +4285,22 @@ namespace {
       // action called to render a frame
       returnStatus = RenderAction(effect, inArgs, outArgs);
     }
+    else if(strcmp(action, kOfxImageEffectActionGetRegionsOfInterest) == 0) {
+      // what parts of the source a render needs
+      returnStatus = GetRegionsOfInterestAction(effect, inArgs, outArgs);
+    }
+    else if(strcmp(action, kOfxImageEffectActionGetFramesNeeded) == 0) {
+      // what frames of the source a render needs
+      returnStatus = GetFramesNeededAction(effect, inArgs, outArgs);
+    }
+    else if(strcmp(action, kOfxImageEffectActionBeginSequenceRender) == 0) {
+      // a sequence of frames is about to be rendered
+      returnStatus = BeginSequenceRenderAction(effect);
+    }
+    else if(strcmp(action, kOfxImageEffectActionEndSequenceRender) == 0) {
+      // the sequence has been rendered
+      returnStatus = EndSequenceRenderAction(effect);
+    }
 
     MESSAGE(": END action is : %s \n", action );
     /// other actions to take the default value